@@ -0,0 +1,718 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <core.h>
+#include <io.h>
+
+#include "../src/internal.h"
+
+/* Minimum amount of time spent running each benchmark */
+#define RMQB_MIN_DURATION 500000000ULL /* 500ms */
+
+struct rmqb_bench {
+    const char *name;
+    void (*run)(void);
+    size_t (*size)(void); /* size of the input in bytes */
+};
+
+struct rmqb_corpus {
+    /* Small publish: Basic.Publish method, header and body frames */
+    struct c_buffer *small_publish;
+
+    /* Large headers table */
+    struct rmq_field_table *headers_table;
+    struct c_buffer *headers_table_data;
+    struct rmq_properties headers_properties;
+    struct c_buffer *headers_frame_payload;
+    struct rmq_publish_template *headers_template;
+
+    /* Nested arrays */
+    struct rmq_field_table *nested_table;
+    struct c_buffer *nested_table_data;
+
+    /* 1MB body */
+    struct c_buffer *large_body;
+
+    /* Basic.Deliver arguments */
+    struct c_buffer *deliver_args;
+};
+
+static struct rmqb_corpus rmqb_corpus;
+static uint64_t rmqb_nb_allocations;
+static uint64_t rmqb_nb_allocated_bytes;
+
+static void rmqb_die(const char *, ...)
+    __attribute__ ((format(printf, 1, 2), noreturn));
+
+static uint64_t rmqb_now(void);
+
+static void rmqb_setup_allocator(void);
+static void rmqb_corpus_init(void);
+static void rmqb_corpus_free(void);
+
+static void rmqb_run(const struct rmqb_bench *);
+
+static void rmqb_frame_read_small_publish(void);
+static size_t rmqb_frame_read_small_publish_size(void);
+static void rmqb_frame_read_large_body(void);
+static size_t rmqb_frame_read_large_body_size(void);
+static void rmqb_header_frame_read(void);
+static size_t rmqb_header_frame_read_size(void);
+static void rmqb_header_frame_write(void);
+static size_t rmqb_header_frame_write_size(void);
+static void rmqb_publish_template_write(void);
+static size_t rmqb_publish_template_write_size(void);
+static void rmqb_field_read_table_headers(void);
+static size_t rmqb_field_read_table_headers_size(void);
+static void rmqb_field_write_table_headers(void);
+static size_t rmqb_field_write_table_headers_size(void);
+static void rmqb_field_read_table_nested(void);
+static size_t rmqb_field_read_table_nested_size(void);
+static void rmqb_field_write_table_nested(void);
+static size_t rmqb_field_write_table_nested_size(void);
+static void rmqb_fields_read_deliver(void);
+static size_t rmqb_fields_read_deliver_size(void);
+static void rmqb_fields_write_publish(void);
+static size_t rmqb_fields_write_publish_size(void);
+
+static struct rmqb_bench rmqb_benches[] = {
+    {"frame_read/small_publish",
+     rmqb_frame_read_small_publish, rmqb_frame_read_small_publish_size},
+    {"frame_read/1mb_body",
+     rmqb_frame_read_large_body, rmqb_frame_read_large_body_size},
+    {"header_frame_read/large_headers",
+     rmqb_header_frame_read, rmqb_header_frame_read_size},
+    {"header_frame_write/large_headers",
+     rmqb_header_frame_write, rmqb_header_frame_write_size},
+    {"publish_template_write/large_headers",
+     rmqb_publish_template_write, rmqb_publish_template_write_size},
+    {"field_read_table/large_headers",
+     rmqb_field_read_table_headers, rmqb_field_read_table_headers_size},
+    {"field_write_table/large_headers",
+     rmqb_field_write_table_headers, rmqb_field_write_table_headers_size},
+    {"field_read_table/nested_arrays",
+     rmqb_field_read_table_nested, rmqb_field_read_table_nested_size},
+    {"field_write_table/nested_arrays",
+     rmqb_field_write_table_nested, rmqb_field_write_table_nested_size},
+    {"fields_read/basic_deliver",
+     rmqb_fields_read_deliver, rmqb_fields_read_deliver_size},
+    {"fields_vwrite/basic_publish",
+     rmqb_fields_write_publish, rmqb_fields_write_publish_size},
+};
+static size_t rmqb_nb_benches = sizeof(rmqb_benches) / sizeof(rmqb_benches[0]);
+
+int
+main(int argc, char **argv) {
+    const char *filter;
+
+    filter = (argc > 1) ? argv[1] : NULL;
+
+    rmqb_setup_allocator();
+    rmqb_corpus_init();
+
+    printf("%-36s %10s %12s %12s %12s\n",
+           "benchmark", "input", "ns/op", "bytes/op", "allocs/op");
+
+    for (size_t i = 0; i < rmqb_nb_benches; i++) {
+        const struct rmqb_bench *bench;
+
+        bench = rmqb_benches + i;
+
+        if (filter && !strstr(bench->name, filter))
+            continue;
+
+        rmqb_run(bench);
+    }
+
+    rmqb_corpus_free();
+    return 0;
+}
+
+static void
+rmqb_die(const char *fmt, ...) {
+    va_list ap;
+
+    fprintf(stderr, "fatal error: ");
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    putc('\n', stderr);
+    exit(1);
+}
+
+static uint64_t
+rmqb_now(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        rmqb_die("cannot read monotonic clock: %s", strerror(errno));
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* ---------------------------------------------------------------------------
+ *  Allocation counting
+ * ------------------------------------------------------------------------ */
+/* Bytes are counted for each allocation, including reallocations, so that
+ * a buffer growing several times is accounted for each copy. */
+static void *
+rmqb_malloc(size_t sz) {
+    rmqb_nb_allocations++;
+    rmqb_nb_allocated_bytes += sz;
+    return malloc(sz);
+}
+
+static void
+rmqb_free(void *ptr) {
+    free(ptr);
+}
+
+static void *
+rmqb_calloc(size_t nb, size_t sz) {
+    rmqb_nb_allocations++;
+    rmqb_nb_allocated_bytes += nb * sz;
+    return calloc(nb, sz);
+}
+
+static void *
+rmqb_realloc(void *ptr, size_t sz) {
+    rmqb_nb_allocations++;
+    rmqb_nb_allocated_bytes += sz;
+    return realloc(ptr, sz);
+}
+
+static void
+rmqb_setup_allocator(void) {
+    static struct c_memory_allocator allocator = {
+        .malloc = rmqb_malloc,
+        .free = rmqb_free,
+        .calloc = rmqb_calloc,
+        .realloc = rmqb_realloc,
+    };
+
+    c_set_memory_allocator(&allocator);
+}
+
+/* ---------------------------------------------------------------------------
+ *  Corpus
+ * ------------------------------------------------------------------------ */
+static void
+rmqb_write_frame(struct c_buffer *buf, enum rmq_frame_type type,
+                 const void *data, size_t size) {
+    struct rmq_frame frame;
+
+    rmq_frame_init(&frame);
+
+    frame.type = type;
+    frame.channel = 1;
+    frame.size = (uint32_t)size;
+    frame.payload = data;
+    frame.end = RMQ_FRAME_END;
+
+    rmq_frame_write(&frame, buf);
+}
+
+static void
+rmqb_corpus_init_small_publish(struct rmqb_corpus *corpus) {
+    struct rmq_method_frame method;
+    struct rmq_header_frame header;
+    struct rmq_properties properties;
+    struct c_buffer *args, *buf;
+    char body[256];
+
+    corpus->small_publish = c_buffer_new();
+
+    /* Method */
+    args = c_buffer_new();
+    rmq_fields_write(args,
+                     RMQ_FIELD_SHORT_UINT, 0,
+                     RMQ_FIELD_SHORT_STRING, "events",
+                     RMQ_FIELD_SHORT_STRING, "service.api.request",
+                     RMQ_FIELD_SHORT_SHORT_UINT, 0,
+                     RMQ_FIELD_END);
+
+    rmq_method_frame_init(&method);
+    method.class_id = RMQ_CLASS_BASIC;
+    method.method_id = RMQ_METHOD_BASIC_PUBLISH & 0xffff;
+    method.args = c_buffer_data(args);
+    method.args_sz = c_buffer_length(args);
+
+    buf = c_buffer_new();
+    rmq_method_frame_write(&method, buf);
+    rmqb_write_frame(corpus->small_publish, RMQ_FRAME_TYPE_METHOD,
+                     c_buffer_data(buf), c_buffer_length(buf));
+    c_buffer_delete(buf);
+    c_buffer_delete(args);
+
+    /* Header */
+    rmq_properties_init(&properties);
+    rmq_properties_set_content_type(&properties, "application/json");
+    rmq_properties_set_delivery_mode(&properties, RMQ_MSG_DELIVERY_PERSISTENT);
+    rmq_properties_set_timestamp(&properties, 1445000000);
+
+    rmq_header_frame_init(&header);
+    header.class_id = RMQ_CLASS_BASIC;
+    header.body_size = sizeof(body);
+    header.properties = &properties;
+
+    buf = c_buffer_new();
+    rmq_header_frame_write(&header, buf);
+    rmqb_write_frame(corpus->small_publish, RMQ_FRAME_TYPE_HEADER,
+                     c_buffer_data(buf), c_buffer_length(buf));
+    c_buffer_delete(buf);
+    rmq_properties_free(&properties);
+
+    /* Body */
+    memset(body, 'x', sizeof(body));
+    rmqb_write_frame(corpus->small_publish, RMQ_FRAME_TYPE_BODY,
+                     body, sizeof(body));
+}
+
+static void
+rmqb_corpus_init_headers(struct rmqb_corpus *corpus) {
+    struct rmq_header_frame header;
+    struct rmq_field_table *table;
+    struct rmq_msg *msg;
+
+    table = rmq_field_table_new();
+
+    for (int i = 0; i < 16; i++) {
+        char name[32], value[64];
+
+        snprintf(name, sizeof(name), "x-string-%d", i);
+        snprintf(value, sizeof(value), "value of string header number %d", i);
+        rmq_field_table_add_nocopy(table, c_strdup(name),
+                                   rmq_field_new_short_string(value));
+
+        snprintf(name, sizeof(name), "x-long-string-%d", i);
+        rmq_field_table_add_nocopy(table, c_strdup(name),
+                                   rmq_field_new_long_string(value,
+                                                             strlen(value)));
+
+        snprintf(name, sizeof(name), "x-int-%d", i);
+        rmq_field_table_add_nocopy(table, c_strdup(name),
+                                   rmq_field_new_long_int(i * 1000));
+
+        snprintf(name, sizeof(name), "x-timestamp-%d", i);
+        rmq_field_table_add_nocopy(table, c_strdup(name),
+                                   rmq_field_new_timestamp(1445000000
+                                                           + (uint64_t)i));
+    }
+
+    corpus->headers_table = table;
+
+    corpus->headers_table_data = c_buffer_new();
+    rmq_field_write_table(table, corpus->headers_table_data);
+
+    /* The properties share the table with the corpus, they are never freed
+     * with rmq_properties_free() */
+    rmq_properties_init(&corpus->headers_properties);
+    corpus->headers_properties.mask = RMQ_PROPERTY_CONTENT_TYPE
+                                    | RMQ_PROPERTY_HEADERS
+                                    | RMQ_PROPERTY_DELIVERY_MODE
+                                    | RMQ_PROPERTY_MESSAGE_ID
+                                    | RMQ_PROPERTY_TIMESTAMP;
+    corpus->headers_properties.content_type = c_strdup("application/json");
+    corpus->headers_properties.headers = table;
+    corpus->headers_properties.delivery_mode = RMQ_MSG_DELIVERY_PERSISTENT;
+    corpus->headers_properties.message_id =
+        c_strdup("4c8e1d5a-7f8b-4f6e-9a8e-0d6f3f1f2b7c");
+    corpus->headers_properties.timestamp = 1445000000;
+
+    rmq_header_frame_init(&header);
+    header.class_id = RMQ_CLASS_BASIC;
+    header.body_size = 1024;
+    header.properties = &corpus->headers_properties;
+
+    corpus->headers_frame_payload = c_buffer_new();
+    rmq_header_frame_write(&header, corpus->headers_frame_payload);
+
+    msg = rmq_msg_new();
+    msg->properties = corpus->headers_properties;
+
+    corpus->headers_template = rmq_publish_template_new(msg, "events",
+                                                        "service.api.request",
+                                                        RMQ_PUBLISH_DEFAULT);
+
+    rmq_properties_init(&msg->properties);
+    rmq_msg_delete(msg);
+}
+
+static struct rmq_field *
+rmqb_nested_array(int depth) {
+    struct rmq_field *field;
+
+    field = rmq_field_new_array();
+    field->u.array = c_ptr_vector_new();
+
+    for (uint32_t i = 0; i < 4; i++) {
+        c_ptr_vector_append(field->u.array, rmq_field_new_long_uint(i));
+        c_ptr_vector_append(field->u.array, rmq_field_new_short_string("item"));
+    }
+
+    if (depth > 0) {
+        c_ptr_vector_append(field->u.array, rmqb_nested_array(depth - 1));
+        c_ptr_vector_append(field->u.array, rmqb_nested_array(depth - 1));
+    }
+
+    return field;
+}
+
+static void
+rmqb_corpus_init_nested(struct rmqb_corpus *corpus) {
+    struct rmq_field_table *table;
+
+    table = rmq_field_table_new();
+    rmq_field_table_add_nocopy(table, c_strdup("x-nested"),
+                               rmqb_nested_array(4));
+
+    corpus->nested_table = table;
+
+    corpus->nested_table_data = c_buffer_new();
+    rmq_field_write_table(table, corpus->nested_table_data);
+}
+
+static void
+rmqb_corpus_init_large_body(struct rmqb_corpus *corpus) {
+    size_t size;
+    void *body;
+
+    size = 1024 * 1024;
+
+    body = c_malloc(size);
+    memset(body, 'x', size);
+
+    corpus->large_body = c_buffer_new();
+    rmqb_write_frame(corpus->large_body, RMQ_FRAME_TYPE_BODY, body, size);
+
+    c_free(body);
+}
+
+static void
+rmqb_corpus_init_deliver(struct rmqb_corpus *corpus) {
+    corpus->deliver_args = c_buffer_new();
+
+    rmq_fields_write(corpus->deliver_args,
+                     RMQ_FIELD_SHORT_STRING, "consumer-1",
+                     RMQ_FIELD_LONG_LONG_UINT, (uint64_t)123456789,
+                     RMQ_FIELD_SHORT_SHORT_UINT, 0,
+                     RMQ_FIELD_SHORT_STRING, "events",
+                     RMQ_FIELD_SHORT_STRING, "service.api.request",
+                     RMQ_FIELD_END);
+}
+
+static void
+rmqb_corpus_init(void) {
+    struct rmqb_corpus *corpus;
+
+    corpus = &rmqb_corpus;
+
+    rmqb_corpus_init_small_publish(corpus);
+    rmqb_corpus_init_headers(corpus);
+    rmqb_corpus_init_nested(corpus);
+    rmqb_corpus_init_large_body(corpus);
+    rmqb_corpus_init_deliver(corpus);
+}
+
+static void
+rmqb_corpus_free(void) {
+    struct rmqb_corpus *corpus;
+
+    corpus = &rmqb_corpus;
+
+    c_buffer_delete(corpus->small_publish);
+
+    corpus->headers_properties.headers = NULL;
+    rmq_properties_free(&corpus->headers_properties);
+    rmq_field_table_delete(corpus->headers_table);
+    c_buffer_delete(corpus->headers_table_data);
+    c_buffer_delete(corpus->headers_frame_payload);
+    rmq_publish_template_delete(corpus->headers_template);
+
+    rmq_field_table_delete(corpus->nested_table);
+    c_buffer_delete(corpus->nested_table_data);
+
+    c_buffer_delete(corpus->large_body);
+
+    c_buffer_delete(corpus->deliver_args);
+}
+
+/* ---------------------------------------------------------------------------
+ *  Runner
+ * ------------------------------------------------------------------------ */
+static void
+rmqb_run(const struct rmqb_bench *bench) {
+    uint64_t nb_ops, start, duration, nb_allocations, nb_allocated_bytes;
+
+    /* Warm up */
+    bench->run();
+
+    nb_ops = 1;
+
+    for (;;) {
+        nb_allocations = rmqb_nb_allocations;
+        nb_allocated_bytes = rmqb_nb_allocated_bytes;
+        start = rmqb_now();
+
+        for (uint64_t i = 0; i < nb_ops; i++)
+            bench->run();
+
+        duration = rmqb_now() - start;
+        nb_allocations = rmqb_nb_allocations - nb_allocations;
+        nb_allocated_bytes = rmqb_nb_allocated_bytes - nb_allocated_bytes;
+
+        if (duration >= RMQB_MIN_DURATION)
+            break;
+
+        nb_ops *= 2;
+    }
+
+    printf("%-36s %10zu %12.1f %12.1f %12.1f\n",
+           bench->name, bench->size(),
+           (double)duration / (double)nb_ops,
+           (double)nb_allocated_bytes / (double)nb_ops,
+           (double)nb_allocations / (double)nb_ops);
+}
+
+/* ---------------------------------------------------------------------------
+ *  Benchmarks
+ * ------------------------------------------------------------------------ */
+static void
+rmqb_frame_read_small_publish(void) {
+    const uint8_t *ptr;
+    size_t len;
+
+    ptr = c_buffer_data(rmqb_corpus.small_publish);
+    len = c_buffer_length(rmqb_corpus.small_publish);
+
+    while (len > 0) {
+        struct rmq_frame frame;
+        size_t frame_size;
+
+        if (rmq_frame_read(&frame, ptr, len, &frame_size) != 1)
+            rmqb_die("cannot read frame");
+
+        ptr += frame_size;
+        len -= frame_size;
+    }
+}
+
+static size_t
+rmqb_frame_read_small_publish_size(void) {
+    return c_buffer_length(rmqb_corpus.small_publish);
+}
+
+static void
+rmqb_frame_read_large_body(void) {
+    struct rmq_frame frame;
+    size_t frame_size;
+
+    if (rmq_frame_read(&frame, c_buffer_data(rmqb_corpus.large_body),
+                       c_buffer_length(rmqb_corpus.large_body),
+                       &frame_size) != 1) {
+        rmqb_die("cannot read frame");
+    }
+}
+
+static size_t
+rmqb_frame_read_large_body_size(void) {
+    return c_buffer_length(rmqb_corpus.large_body);
+}
+
+static void
+rmqb_header_frame_read(void) {
+    struct rmq_header_frame header;
+    struct rmq_properties properties;
+    struct rmq_frame frame;
+
+    rmq_frame_init(&frame);
+    frame.type = RMQ_FRAME_TYPE_HEADER;
+    frame.channel = 1;
+    frame.size = (uint32_t)c_buffer_length(rmqb_corpus.headers_frame_payload);
+    frame.payload = c_buffer_data(rmqb_corpus.headers_frame_payload);
+    frame.end = RMQ_FRAME_END;
+
+    if (rmq_header_frame_read(&header, &properties, &frame) == -1)
+        rmqb_die("cannot read header frame: %s", c_get_error());
+
+    rmq_properties_free(&properties);
+}
+
+static size_t
+rmqb_header_frame_read_size(void) {
+    return c_buffer_length(rmqb_corpus.headers_frame_payload);
+}
+
+static void
+rmqb_header_frame_write(void) {
+    struct rmq_header_frame header;
+    struct c_buffer *buf;
+
+    rmq_header_frame_init(&header);
+    header.class_id = RMQ_CLASS_BASIC;
+    header.body_size = 1024;
+    header.properties = &rmqb_corpus.headers_properties;
+
+    buf = c_buffer_new();
+    rmq_header_frame_write(&header, buf);
+    c_buffer_delete(buf);
+}
+
+static size_t
+rmqb_header_frame_write_size(void) {
+    return c_buffer_length(rmqb_corpus.headers_frame_payload);
+}
+
+static void
+rmqb_publish_template_write(void) {
+    struct c_buffer *buf;
+
+    /* Method and header frames of a publication */
+    buf = c_buffer_new();
+    rmq_publish_template_set_timestamp(rmqb_corpus.headers_template,
+                                       1445000000);
+    rmq_publish_template_write(rmqb_corpus.headers_template, 1, 1024, buf);
+    c_buffer_delete(buf);
+}
+
+static size_t
+rmqb_publish_template_write_size(void) {
+    const struct rmq_publish_template *template;
+
+    template = rmqb_corpus.headers_template;
+    return 8 + c_buffer_length(template->method)
+         + 8 + c_buffer_length(template->header);
+}
+
+static void
+rmqb_field_read_table_headers(void) {
+    struct rmq_field_table *table;
+    size_t size;
+
+    if (rmq_field_read_table(c_buffer_data(rmqb_corpus.headers_table_data),
+                             c_buffer_length(rmqb_corpus.headers_table_data),
+                             &table, &size) == -1) {
+        rmqb_die("cannot read table: %s", c_get_error());
+    }
+
+    rmq_field_table_delete(table);
+}
+
+static size_t
+rmqb_field_read_table_headers_size(void) {
+    return c_buffer_length(rmqb_corpus.headers_table_data);
+}
+
+static void
+rmqb_field_write_table_headers(void) {
+    struct c_buffer *buf;
+
+    buf = c_buffer_new();
+    rmq_field_write_table(rmqb_corpus.headers_table, buf);
+    c_buffer_delete(buf);
+}
+
+static size_t
+rmqb_field_write_table_headers_size(void) {
+    return c_buffer_length(rmqb_corpus.headers_table_data);
+}
+
+static void
+rmqb_field_read_table_nested(void) {
+    struct rmq_field_table *table;
+    size_t size;
+
+    if (rmq_field_read_table(c_buffer_data(rmqb_corpus.nested_table_data),
+                             c_buffer_length(rmqb_corpus.nested_table_data),
+                             &table, &size) == -1) {
+        rmqb_die("cannot read table: %s", c_get_error());
+    }
+
+    rmq_field_table_delete(table);
+}
+
+static size_t
+rmqb_field_read_table_nested_size(void) {
+    return c_buffer_length(rmqb_corpus.nested_table_data);
+}
+
+static void
+rmqb_field_write_table_nested(void) {
+    struct c_buffer *buf;
+
+    buf = c_buffer_new();
+    rmq_field_write_table(rmqb_corpus.nested_table, buf);
+    c_buffer_delete(buf);
+}
+
+static size_t
+rmqb_field_write_table_nested_size(void) {
+    return c_buffer_length(rmqb_corpus.nested_table_data);
+}
+
+static void
+rmqb_fields_read_deliver(void) {
+    char *consumer_tag, *exchange, *routing_key;
+    uint64_t delivery_tag;
+    uint8_t flags;
+
+    if (rmq_fields_read(c_buffer_data(rmqb_corpus.deliver_args),
+                        c_buffer_length(rmqb_corpus.deliver_args), NULL,
+                        RMQ_FIELD_SHORT_STRING, &consumer_tag,
+                        RMQ_FIELD_LONG_LONG_UINT, &delivery_tag,
+                        RMQ_FIELD_SHORT_SHORT_UINT, &flags,
+                        RMQ_FIELD_SHORT_STRING, &exchange,
+                        RMQ_FIELD_SHORT_STRING, &routing_key,
+                        RMQ_FIELD_END) == -1) {
+        rmqb_die("cannot read fields: %s", c_get_error());
+    }
+
+    c_free(consumer_tag);
+    c_free(exchange);
+    c_free(routing_key);
+}
+
+static size_t
+rmqb_fields_read_deliver_size(void) {
+    return c_buffer_length(rmqb_corpus.deliver_args);
+}
+
+static void
+rmqb_fields_write_publish(void) {
+    struct c_buffer *buf;
+
+    buf = c_buffer_new();
+
+    rmq_fields_write(buf,
+                     RMQ_FIELD_SHORT_UINT, 0,
+                     RMQ_FIELD_SHORT_STRING, "events",
+                     RMQ_FIELD_SHORT_STRING, "service.api.request",
+                     RMQ_FIELD_SHORT_SHORT_UINT, 0,
+                     RMQ_FIELD_END);
+
+    c_buffer_delete(buf);
+}
+
+static size_t
+rmqb_fields_write_publish_size(void) {
+    return 2 + 1 + strlen("events") + 1 + strlen("service.api.request") + 1;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <core.h>
+#include <io.h>
+
+#include "../src/internal.h"
+
+/* The first byte of the input selects the state of the client before the
+ * rest of the input is processed as data read from the connection. */
+enum rmqf_client_mode {
+    RMQF_CLIENT_MODE_HANDSHAKE,
+    RMQF_CLIENT_MODE_READY,
+};
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+static enum rmq_msg_action
+rmqf_on_msg(struct rmq_client *client, const struct rmq_delivery *delivery,
+            const struct rmq_msg *msg, void *arg) {
+    return RMQ_MSG_ACTION_ACK;
+}
+
+static void
+rmqf_on_undeliverable_msg(struct rmq_client *client,
+                          const struct rmq_delivery *delivery,
+                          const struct rmq_msg *msg, void *arg) {
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static struct io_base *io_base;
+
+    struct rmq_client *client;
+    struct rmq_consumer *consumer;
+    struct c_buffer *rbuf;
+
+    if (size < 1)
+        return 0;
+
+    if (!io_base)
+        io_base = io_base_new();
+
+    client = rmq_client_new(io_base);
+    rmq_client_set_undeliverable_msg_cb(client, rmqf_on_undeliverable_msg,
+                                        NULL);
+
+    switch (data[0] % 2) {
+    case RMQF_CLIENT_MODE_HANDSHAKE:
+        client->state = RMQ_CLIENT_STATE_CONNECTED;
+        break;
+
+    case RMQF_CLIENT_MODE_READY:
+        client->state = RMQ_CLIENT_STATE_READY;
+        client->channel = 1;
+
+        consumer = rmq_consumer_new("queue", c_strdup("consumer-1"));
+        consumer->msg_cb = rmqf_on_msg;
+
+        c_hash_table_insert(client->consumers_by_tag,
+                            consumer->tag, consumer);
+        c_hash_table_insert(client->consumers_by_queue,
+                            consumer->queue, consumer);
+
+        if (rmq_codec_deflate())
+            rmq_client_add_codec(client, rmq_codec_deflate());
+
+        rmq_client_get(client, "queue", RMQ_GET_DEFAULT, rmqf_on_msg, NULL);
+        rmq_client_drain_queue(client, "queue", RMQ_GET_DEFAULT, 4, 2,
+                               rmqf_on_msg, NULL);
+        break;
+    }
+
+    rbuf = c_buffer_new();
+    c_buffer_add(rbuf, data + 1, size - 1);
+
+    rmq_client_process_data(client, rbuf);
+
+    c_buffer_delete(rbuf);
+
+    rmq_client_delete(client);
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <core.h>
+#include <io.h>
+
+#include "../src/internal.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    struct rmq_field *field;
+    struct c_buffer *buf;
+    size_t field_size;
+
+    field = rmq_field_read_tagged(data, size, &field_size);
+    if (!field)
+        return 0;
+
+    if (field_size > size)
+        abort();
+
+    /* Anything we can read, we must be able to write back */
+    buf = c_buffer_new();
+    rmq_field_write_tagged(field, buf);
+    c_buffer_delete(buf);
+
+    rmq_field_delete(field);
+    return 0;
+}
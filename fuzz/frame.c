@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <core.h>
+#include <io.h>
+
+#include "../src/internal.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    const uint8_t *ptr;
+    size_t len;
+
+    ptr = data;
+    len = size;
+
+    while (len > 0) {
+        struct rmq_method_frame method;
+        struct rmq_header_frame header;
+        struct rmq_properties properties;
+        struct rmq_frame frame;
+        size_t frame_size;
+
+        if (rmq_frame_read(&frame, ptr, len, &frame_size) != 1)
+            break;
+
+        switch (frame.type) {
+        case RMQ_FRAME_TYPE_METHOD:
+            rmq_method_frame_read(&method, &frame);
+            break;
+
+        case RMQ_FRAME_TYPE_HEADER:
+            if (rmq_header_frame_read(&header, &properties, &frame) == 0)
+                rmq_properties_free(&properties);
+            break;
+        }
+
+        ptr += frame_size;
+        len -= frame_size;
+    }
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <core.h>
+#include <io.h>
+
+#include "../src/internal.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    struct rmq_header_frame header;
+    struct rmq_properties properties;
+    struct rmq_frame frame;
+    struct c_buffer *buf;
+
+    if (size > UINT32_MAX)
+        return 0;
+
+    rmq_frame_init(&frame);
+    frame.type = RMQ_FRAME_TYPE_HEADER;
+    frame.size = (uint32_t)size;
+    frame.payload = data;
+    frame.end = RMQ_FRAME_END;
+
+    if (rmq_header_frame_read(&header, &properties, &frame) == -1)
+        return 0;
+
+    /* Anything we can read, we must be able to write back */
+    buf = c_buffer_new();
+    rmq_header_frame_write(&header, buf);
+    c_buffer_delete(buf);
+
+    rmq_properties_free(&properties);
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <core.h>
+#include <io.h>
+
+#include "../src/internal.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    struct rmq_method_frame method;
+    struct rmq_frame frame;
+    struct rmq_field_table *table;
+    struct rmq_long_string string1, string2;
+    uint8_t u8_1, u8_2;
+
+    if (size > UINT32_MAX)
+        return 0;
+
+    rmq_frame_init(&frame);
+    frame.type = RMQ_FRAME_TYPE_METHOD;
+    frame.size = (uint32_t)size;
+    frame.payload = data;
+    frame.end = RMQ_FRAME_END;
+
+    if (rmq_method_frame_read(&method, &frame) == -1)
+        return 0;
+
+    /* Decode the arguments with the layout of Connection.Start, which
+     * contains most kinds of fields, to exercise rmq_fields_read() and its
+     * error path. */
+    rmq_long_string_init(&string1);
+    rmq_long_string_init(&string2);
+
+    if (rmq_fields_read(method.args, method.args_sz, NULL,
+                        RMQ_FIELD_SHORT_SHORT_UINT, &u8_1,
+                        RMQ_FIELD_SHORT_SHORT_UINT, &u8_2,
+                        RMQ_FIELD_TABLE, &table,
+                        RMQ_FIELD_LONG_STRING, &string1,
+                        RMQ_FIELD_LONG_STRING, &string2,
+                        RMQ_FIELD_END) == 0) {
+        rmq_field_table_delete(table);
+        rmq_long_string_free(&string1);
+        rmq_long_string_free(&string2);
+    }
+
+    return 0;
+}
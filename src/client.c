@@ -14,16 +14,26 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
 #include "internal.h"
 
 /* ---------------------------------------------------------------------------
  *  Delivery
  * ------------------------------------------------------------------------ */
 void
-rmq_delivery_init(struct rmq_delivery *delivery) {
+rmq_delivery_init(struct rmq_delivery *delivery, struct rmq_msg_pool *pool) {
     memset(delivery, 0, sizeof(struct rmq_delivery));
 
-    delivery->msg = rmq_msg_new();
+    if (pool) {
+        delivery->msg = rmq_msg_pool_acquire(pool);
+    } else {
+        delivery->msg = rmq_msg_new();
+    }
+
     delivery->msg->data_owned = true;
 }
 
@@ -39,6 +49,10 @@ rmq_delivery_free(struct rmq_delivery *delivery) {
     case RMQ_DELIVERY_TYPE_BASIC_RETURN:
         c_free(delivery->u.basic_return.reply_text);
         break;
+
+    case RMQ_DELIVERY_TYPE_BASIC_GET_OK:
+        rmq_get_delete(delivery->u.basic_get_ok.get);
+        break;
     }
 
     c_free(delivery->exchange);
@@ -51,6 +65,9 @@ rmq_delivery_free(struct rmq_delivery *delivery) {
 
 uint64_t
 rmq_delivery_tag(const struct rmq_delivery *delivery) {
+    if (delivery->type == RMQ_DELIVERY_TYPE_BASIC_GET_OK)
+        return delivery->u.basic_get_ok.tag;
+
     assert(delivery->type == RMQ_DELIVERY_TYPE_BASIC_DELIVER);
     return delivery->u.basic_deliver.tag;
 }
@@ -67,10 +84,19 @@ rmq_delivery_routing_key(const struct rmq_delivery *delivery) {
 
 bool
 rmq_delivery_is_redelivered(const struct rmq_delivery *delivery) {
+    if (delivery->type == RMQ_DELIVERY_TYPE_BASIC_GET_OK)
+        return delivery->u.basic_get_ok.redelivered;
+
     assert(delivery->type == RMQ_DELIVERY_TYPE_BASIC_DELIVER);
     return delivery->u.basic_deliver.redelivered;
 }
 
+uint32_t
+rmq_delivery_message_count(const struct rmq_delivery *delivery) {
+    assert(delivery->type == RMQ_DELIVERY_TYPE_BASIC_GET_OK);
+    return delivery->u.basic_get_ok.message_count;
+}
+
 enum rmq_reply_code
 rmq_delivery_undeliverable_reply_code(const struct rmq_delivery *delivery) {
     assert(delivery->type == RMQ_DELIVERY_TYPE_BASIC_RETURN);
@@ -112,6 +138,91 @@ rmq_consumer_delete(struct rmq_consumer *consumer) {
     c_free0(consumer, sizeof(struct rmq_consumer));
 }
 
+/* ---------------------------------------------------------------------------
+ *  Get
+ * ------------------------------------------------------------------------ */
+struct rmq_get_drain *
+rmq_get_drain_new(const char *queue, uint8_t options, unsigned int max,
+                  rmq_msg_cb cb, void *cb_arg) {
+    struct rmq_get_drain *drain;
+
+    drain = c_malloc0(sizeof(struct rmq_get_drain));
+
+    drain->queue = c_strdup(queue);
+    drain->options = options;
+
+    drain->msg_cb = cb;
+    drain->msg_cb_arg = cb_arg;
+
+    drain->nb_left = max;
+
+    return drain;
+}
+
+void
+rmq_get_drain_delete(struct rmq_get_drain *drain) {
+    if (!drain)
+        return;
+
+    c_free(drain->queue);
+
+    c_free0(drain, sizeof(struct rmq_get_drain));
+}
+
+struct rmq_get *
+rmq_get_new(rmq_msg_cb cb, void *cb_arg) {
+    struct rmq_get *get;
+
+    get = c_malloc0(sizeof(struct rmq_get));
+
+    get->msg_cb = cb;
+    get->msg_cb_arg = cb_arg;
+
+    return get;
+}
+
+void
+rmq_get_delete(struct rmq_get *get) {
+    if (!get)
+        return;
+
+    /* A drain is only referenced by its requests in flight */
+    if (get->drain) {
+        get->drain->nb_in_flight--;
+        if (get->drain->nb_in_flight == 0)
+            rmq_get_drain_delete(get->drain);
+    }
+
+    c_free0(get, sizeof(struct rmq_get));
+}
+
+/* ---------------------------------------------------------------------------
+ *  Synchronous operation
+ * ------------------------------------------------------------------------ */
+struct rmq_op *
+rmq_op_new(enum rmq_method method, enum rmq_method reply_method,
+           rmq_op_cb cb, void *cb_arg) {
+    struct rmq_op *op;
+
+    op = c_malloc0(sizeof(struct rmq_op));
+
+    op->method = method;
+    op->reply_method = reply_method;
+
+    op->cb = cb;
+    op->cb_arg = cb_arg;
+
+    return op;
+}
+
+void
+rmq_op_delete(struct rmq_op *op) {
+    if (!op)
+        return;
+
+    c_free0(op, sizeof(struct rmq_op));
+}
+
 /* ---------------------------------------------------------------------------
  *  Client
  * ------------------------------------------------------------------------ */
@@ -124,13 +235,90 @@ static void rmq_client_error(struct rmq_client *, const char *, ...)
 static void rmq_client_fatal(struct rmq_client *, const char *, ...)
     __attribute__ ((format(printf, 2, 3)));
 
+static struct rmq_timer *rmq_client_add_timer(struct rmq_client *, uint64_t,
+                                              rmq_timer_cb, uint64_t);
+static void rmq_client_remove_timer(struct rmq_client *,
+                                    struct rmq_timer **);
+static int rmq_client_schedule_timer_wheel(struct rmq_client *, uint64_t);
+static void rmq_client_on_timer_wheel_timer(int, uint64_t, void *);
+
+static void rmq_client_on_handshake_timeout(void *, uint64_t);
+
 static int rmq_client_start_heartbeat(struct rmq_client *, uint16_t);
 static void rmq_client_stop_heartbeat(struct rmq_client *);
-static void rmq_client_on_heartbeat_timer(int, uint64_t, void *);
-
-static void rmq_client_on_tcp_event(struct io_tcp_client *,
-                                    enum io_tcp_client_event,
-                                    void *);
+static void rmq_client_on_heartbeat_timer(void *, uint64_t);
+
+static void rmq_client_on_buffer_tuning_timer(void *, uint64_t);
+
+static void rmq_client_on_transport_event(struct rmq_transport *,
+                                          enum rmq_transport_event,
+                                          void *);
+
+static void rmq_client_write_compressed_header(struct rmq_client *,
+                                               const struct rmq_msg *,
+                                               struct c_buffer *);
+static void rmq_client_write_body(struct rmq_client *, struct c_buffer *,
+                                  const void *, size_t);
+
+static void rmq_client_spool_publish(struct rmq_client *, struct rmq_msg *,
+                                     const char *, const char *, uint32_t);
+static void rmq_client_replay_spool(struct rmq_client *);
+static void rmq_client_signal_replayed_msg(struct rmq_client *,
+                                           const struct rmq_spool_record *);
+static void rmq_client_stop_spool_replay(struct rmq_client *);
+static void rmq_client_on_spool_timer(void *, uint64_t);
+
+static enum rmq_msg_action rmq_client_on_rpc_reply(struct rmq_client *,
+                                                   const struct rmq_delivery *,
+                                                   const struct rmq_msg *,
+                                                   void *);
+static void rmq_client_on_rpc_timeout(void *, uint64_t);
+static void rmq_client_abort_rpc_calls(struct rmq_client *,
+                                       enum rmq_rpc_status);
+
+static void rmq_client_send_get(struct rmq_client *, const char *, uint8_t,
+                                struct rmq_get *);
+static struct rmq_get *rmq_client_pop_get(struct rmq_client *);
+static void rmq_client_delete_gets(struct rmq_client *);
+static void rmq_client_on_get_done(struct rmq_client *, struct rmq_get *,
+                                   bool);
+
+static void rmq_client_push_op(struct rmq_client *, enum rmq_method,
+                               enum rmq_method, rmq_op_cb, void *);
+static struct rmq_op *rmq_client_pop_op(struct rmq_client *);
+static int rmq_client_on_op_reply(struct rmq_client *, enum rmq_method,
+                                  const struct rmq_op_result *);
+static void rmq_client_abort_ops(struct rmq_client *, const char *);
+
+static struct rmq_field_table *rmq_client_properties(void);
+static void rmq_client_read_server_properties(struct rmq_client *,
+                                              struct rmq_field_table *);
+static void rmq_client_clear_server_properties(struct rmq_client *);
+
+static uint32_t rmq_client_negotiate_tune_value(uint32_t, uint32_t);
+
+static struct c_buffer *rmq_client_wbuf(struct rmq_client *, uint16_t);
+
+static void rmq_client_add_state_field(struct rmq_field_table *,
+                                       const char *, struct rmq_field *);
+static void rmq_client_add_state_data(struct rmq_field_table *, const char *,
+                                      const void *, size_t);
+static struct rmq_field_table *rmq_client_export_state(struct rmq_client *,
+                                                       const void *, size_t);
+static struct rmq_field *rmq_client_state_field(const struct rmq_field_table *,
+                                                const char *,
+                                                enum rmq_field_type);
+static const void *rmq_client_state_data(const struct rmq_field_table *,
+                                         const char *, size_t *);
+static const char *rmq_client_state_string(const struct rmq_field_table *,
+                                           const char *);
+static bool rmq_client_find_handler(const struct rmq_consumer_handler *,
+                                    size_t, const char *,
+                                    const struct rmq_consumer_handler **);
+static int rmq_client_import_state(struct rmq_client *, int,
+                                   const struct rmq_field_table *,
+                                   const struct rmq_consumer_handler *, size_t,
+                                   struct c_buffer *);
 
 static void rmq_client_on_conn_closed(struct rmq_client *);
 static void rmq_client_on_conn_established(struct rmq_client *);
@@ -144,6 +332,7 @@ static int rmq_client_on_header(struct rmq_client *,
                                 struct rmq_properties *);
 static int rmq_client_on_content(struct rmq_client *,
                                  const struct rmq_frame *);
+static void rmq_client_on_delivery_done(struct rmq_client *);
 
 struct rmq_client *
 rmq_client_new(struct io_base *io_base) {
@@ -153,8 +342,9 @@ rmq_client_new(struct io_base *io_base) {
 
     client->io_base = io_base;
 
-    client->tcp_client = io_tcp_client_new(io_base,
-                                           rmq_client_on_tcp_event, client);
+    client->transport = rmq_transport_new(io_base,
+                                          rmq_client_on_transport_event,
+                                          client);
 
     client->login = c_strdup("guest");
     client->password = c_strdup("guest");
@@ -164,7 +354,20 @@ rmq_client_new(struct io_base *io_base) {
     client->consumers_by_queue = c_hash_table_new(c_hash_string,
                                                   c_equal_string);
 
-    client->heartbeat_timer = -1;
+    client->msg_pool =
+        rmq_msg_pool_new(RMQ_MSG_POOL_DEFAULT_MAX_NB_MSGS,
+                         RMQ_MSG_POOL_DEFAULT_MAX_DATA_SIZE);
+
+    client->codecs = c_vector_new(sizeof(struct rmq_codec_instance));
+    client->codec_buf = c_buffer_new();
+
+    client->channel = RMQ_CLIENT_CHANNEL;
+    client->pending_wbuf = c_buffer_new();
+
+    rmq_timer_wheel_init(&client->timer_wheel, rmq_now_ms());
+    client->timer_wheel_timer = -1;
+
+    rmq_rpc_table_init(&client->rpc_calls);
 
     return client;
 }
@@ -173,11 +376,12 @@ void
 rmq_client_delete(struct rmq_client *client) {
     struct c_hash_table_iterator *it;
     struct rmq_consumer *consumer;
+    struct rmq_op *op;
 
     if (!client)
         return;
 
-    io_tcp_client_delete(client->tcp_client);
+    rmq_transport_delete(client->transport);
 
     c_free(client->login);
     c_free(client->password);
@@ -191,6 +395,38 @@ rmq_client_delete(struct rmq_client *client) {
 
     c_hash_table_delete(client->consumers_by_queue);
 
+    rmq_client_delete_gets(client);
+
+    while ((op = rmq_client_pop_op(client)))
+        rmq_op_delete(op);
+
+    rmq_client_clear_server_properties(client);
+
+    if (client->has_current_delivery)
+        rmq_delivery_free(&client->current_delivery);
+
+    rmq_msg_pool_delete(client->msg_pool);
+
+    for (size_t i = 0; i < c_vector_length(client->codecs); i++) {
+        struct rmq_codec_instance *instance;
+
+        instance = c_vector_entry(client->codecs, i);
+        instance->codec->delete_context(instance->context);
+    }
+    c_vector_delete(client->codecs);
+    c_buffer_delete(client->codec_buf);
+    c_buffer_delete(client->pending_wbuf);
+
+    rmq_client_stop_spool_replay(client);
+    rmq_spool_close(client->spool);
+    c_buffer_delete(client->spool_buf);
+
+    rmq_rpc_table_free(&client->rpc_calls);
+
+    if (client->timer_wheel_timer >= 0)
+        io_base_remove_timer(client->io_base, client->timer_wheel_timer);
+    rmq_timer_wheel_free(&client->timer_wheel);
+
     c_free0(client, sizeof(struct rmq_client));
 }
 
@@ -239,576 +475,2444 @@ rmq_client_set_vhost(struct rmq_client *client, const char *vhost) {
     client->vhost = c_strdup(vhost);
 }
 
-int
-rmq_client_connect(struct rmq_client *client,
-                   const char *host, uint16_t port) {
-    if (!client->login) {
-        c_set_error("missing login");
-        return -1;
-    }
-
-    if (!client->password) {
-        c_set_error("missing password");
-        return -1;
-    }
-
-    return io_tcp_client_connect(client->tcp_client, host, port);
+void
+rmq_client_set_msg_pool_limits(struct rmq_client *client,
+                               size_t max_nb_msgs, size_t max_data_size) {
+    rmq_msg_pool_set_limits(client->msg_pool, max_nb_msgs, max_data_size);
 }
 
 void
-rmq_client_disconnect(struct rmq_client *client) {
-    if (!io_tcp_client_is_connected(client->tcp_client))
-        return;
+rmq_client_msg_pool_stats(const struct rmq_client *client,
+                          struct rmq_msg_pool_stats *stats) {
+    const struct rmq_msg_pool *pool;
 
-    rmq_client_connection_close(client, RMQ_REPLY_CODE_SUCCESS, "goodbye");
+    pool = client->msg_pool;
 
-    /* TODO Timeout in case the server never sends Connection.Close-Ok and
-     * does not close the connection */
+    stats->nb_hits = pool->nb_hits;
+    stats->nb_misses = pool->nb_misses;
+    stats->nb_free_msgs = pool->nb_free_msgs;
 }
 
-int
-rmq_client_reconnect(struct rmq_client *client) {
-    return io_tcp_client_reconnect(client->tcp_client);
+struct rmq_msg *
+rmq_client_new_msg(struct rmq_client *client) {
+    return rmq_msg_pool_acquire(client->msg_pool);
 }
 
-bool
-rmq_client_is_ready(const struct rmq_client *client) {
-    return client->state == RMQ_CLIENT_STATE_READY;
-}
+int
+rmq_client_set_spool(struct rmq_client *client, const char *path,
+                     size_t size) {
+    struct rmq_spool *spool;
+
+    spool = NULL;
+    if (path) {
+        spool = rmq_spool_open(path, size);
+        if (!spool)
+            return -1;
+    }
 
-void
-rmq_client_send_frame(struct rmq_client *client, enum rmq_frame_type type,
-                      uint16_t channel, const void *data, size_t size) {
-    struct rmq_frame frame;
-    struct c_buffer *wbuf;
+    rmq_client_stop_spool_replay(client);
+    rmq_spool_close(client->spool);
 
-    assert(size <= UINT32_MAX);
+    client->spool = spool;
 
-    rmq_frame_init(&frame);
+    if (spool && !client->spool_buf)
+        client->spool_buf = c_buffer_new();
 
-    frame.type = type;
-    frame.channel = channel;
-    frame.size = size;
-    frame.payload = data;
-    frame.end = RMQ_FRAME_END;
+    /* Publications left by a previous process are replayed as soon as
+     * possible. */
+    if (spool && client->state == RMQ_CLIENT_STATE_READY)
+        rmq_client_replay_spool(client);
 
-    wbuf = io_tcp_client_wbuf(client->tcp_client);
-    rmq_frame_write(&frame, wbuf);
-    io_tcp_client_signal_data_written(client->tcp_client);
+    return 0;
 }
 
-void
-rmq_client_vsend_method_on_channel(struct rmq_client *client, uint16_t channel,
-                                   enum rmq_method method, va_list ap) {
-    struct rmq_method_frame method_frame;
-    struct c_buffer *args_buf, *buf;
+static struct rmq_codec_instance *
+rmq_client_find_codec(struct rmq_client *client, const char *encoding) {
+    for (size_t i = 0; i < c_vector_length(client->codecs); i++) {
+        struct rmq_codec_instance *instance;
 
-    /* Args */
-    args_buf = c_buffer_new();
-    rmq_fields_vwrite(args_buf, ap);
+        instance = c_vector_entry(client->codecs, i);
+        if (strcmp(instance->codec->encoding, encoding) == 0)
+            return instance;
+    }
 
-    /* Method frame */
-    rmq_method_frame_init(&method_frame);
+    return NULL;
+}
 
-    method_frame.class_id = method >> 16;
-    method_frame.method_id = method & 0x0000ffff;
-    method_frame.args = c_buffer_data(args_buf);
-    method_frame.args_sz = c_buffer_length(args_buf);
+int
+rmq_client_add_codec(struct rmq_client *client,
+                     const struct rmq_codec *codec) {
+    struct rmq_codec_instance instance;
 
-    /* Frame */
-    buf = c_buffer_new();
-    rmq_method_frame_write(&method_frame, buf);
+    /* Codecs such as rmq_codec_deflate() are not available in every build */
+    if (!codec) {
+        c_set_error("codec not available");
+        return -1;
+    }
 
-    rmq_client_send_frame(client, RMQ_FRAME_TYPE_METHOD, channel,
-                          c_buffer_data(buf), c_buffer_length(buf));
+    if (rmq_client_find_codec(client, codec->encoding))
+        return 0;
 
-    c_buffer_delete(args_buf);
-    c_buffer_delete(buf);
-}
+    instance.codec = codec;
 
-void
-rmq_client_send_method_on_channel(struct rmq_client *client, uint16_t channel,
-                                  enum rmq_method method, ...) {
-    va_list ap;
+    /* The context is kept for the lifetime of the client and reused for
+     * every message. */
+    instance.context = codec->new_context();
+    if (!instance.context) {
+        c_set_error("cannot create %s context: %s",
+                    codec->encoding, c_get_error());
+        return -1;
+    }
 
-    va_start(ap, method);
-    rmq_client_vsend_method_on_channel(client, channel, method, ap);
-    va_end(ap);
+    c_vector_append(client->codecs, &instance);
+    return 0;
 }
 
-void
-rmq_client_send_method(struct rmq_client *client, enum rmq_method method, ...) {
-    va_list ap;
+int
+rmq_client_enable_compression(struct rmq_client *client,
+                              const struct rmq_codec *codec,
+                              size_t threshold) {
+    if (rmq_client_add_codec(client, codec) == -1)
+        return -1;
 
-    va_start(ap, method);
-    rmq_client_vsend_method_on_channel(client, client->channel, method, ap);
-    va_end(ap);
+    client->compression_codec = codec;
+    client->compression_threshold = threshold;
+
+    return 0;
 }
 
-void
-rmq_client_send_header(struct rmq_client *client, uint16_t class_id,
-                       uint64_t body_size,
-                       const struct rmq_properties *properties) {
-    struct rmq_header_frame header_frame;
-    struct c_buffer *buf;
+static bool
+rmq_client_compress_body(struct rmq_client *client,
+                         const struct rmq_msg *msg) {
+    struct rmq_codec_instance *instance;
+    const struct rmq_codec *codec;
 
-    /* Header frame */
-    rmq_header_frame_init(&header_frame);
+    codec = client->compression_codec;
+    if (!codec)
+        return false;
 
-    header_frame.class_id = class_id;
-    header_frame.body_size = body_size;
-    header_frame.properties = properties;
+    if (msg->data_sz < client->compression_threshold)
+        return false;
 
-    /* Frame */
-    buf = c_buffer_new();
-    rmq_header_frame_write(&header_frame, buf);
+    /* Never compress data which is already encoded */
+    if (msg->properties.mask & RMQ_PROPERTY_CONTENT_ENCODING)
+        return false;
 
-    rmq_client_send_frame(client, RMQ_FRAME_TYPE_HEADER, client->channel,
-                          c_buffer_data(buf), c_buffer_length(buf));
+    instance = rmq_client_find_codec(client, codec->encoding);
+    assert(instance);
 
-    c_buffer_delete(buf);
-}
+    c_buffer_clear(client->codec_buf);
 
-void
-rmq_client_send_body(struct rmq_client *client,
-                     const void *data, size_t size) {
-    rmq_client_send_frame(client, RMQ_FRAME_TYPE_BODY, client->channel,
-                          data, size);
+    if (codec->compress(instance->context, msg->data, msg->data_sz,
+                        client->codec_buf) == -1) {
+        rmq_client_error(client, "cannot compress message body: %s",
+                         c_get_error());
+        return false;
+    }
+
+    return c_buffer_length(client->codec_buf) < msg->data_sz;
 }
 
-void
-rmq_client_connection_close(struct rmq_client *client,
-                            enum rmq_reply_code code, const char *fmt, ...) {
-    char text[256];
-    va_list ap;
+static void
+rmq_client_decompress_body(struct rmq_client *client, struct rmq_msg *msg) {
+    struct rmq_properties *properties;
+    struct rmq_codec_instance *instance;
+    const struct rmq_codec *codec;
 
-    assert(client->state != RMQ_CLIENT_STATE_DISCONNECTED);
+    properties = &msg->properties;
 
-    va_start(ap, fmt);
-    vsnprintf(text, sizeof(text), fmt, ap);
-    va_end(ap);
+    if (!(properties->mask & RMQ_PROPERTY_CONTENT_ENCODING))
+        return;
 
-    rmq_client_send_method_on_channel(client, 0, RMQ_METHOD_CONNECTION_CLOSE,
-                                      RMQ_FIELD_SHORT_UINT, code,
-                                      RMQ_FIELD_SHORT_STRING, text,
-                                      RMQ_FIELD_SHORT_UINT, 0, /* class id */
-                                      RMQ_FIELD_SHORT_UINT, 0, /* method id */
-                                      RMQ_FIELD_END);
+    instance = rmq_client_find_codec(client, properties->content_encoding);
+    if (!instance)
+        return;
 
-    client->state = RMQ_CLIENT_STATE_CLOSING;
-}
+    codec = instance->codec;
 
-void
-rmq_client_ack(struct rmq_client *client, uint64_t tag) {
-    uint8_t flags;
+    c_buffer_clear(client->codec_buf);
 
-    flags = 0x00; /* multiple = false */
+    if (codec->decompress(instance->context, msg->data, msg->data_sz,
+                          RMQ_CODEC_MAX_DECOMPRESSED_SIZE,
+                          client->codec_buf) == -1) {
+        /* The message is delivered as it is */
+        rmq_client_error(client, "cannot decompress %s message body: %s",
+                         codec->encoding, c_get_error());
+        return;
+    }
 
-    rmq_client_send_method(client, RMQ_METHOD_BASIC_ACK,
-                           RMQ_FIELD_LONG_LONG_UINT, tag,
-                           RMQ_FIELD_SHORT_SHORT_UINT, flags,
-                           RMQ_FIELD_END);
+    rmq_msg_set_data(msg, c_buffer_data(client->codec_buf),
+                     c_buffer_length(client->codec_buf));
+
+    c_free(properties->content_encoding);
+    properties->content_encoding = NULL;
+    properties->mask &= (uint16_t)~RMQ_PROPERTY_CONTENT_ENCODING;
 }
 
 void
-rmq_client_reject(struct rmq_client *client, uint64_t tag) {
-    uint8_t flags;
+rmq_client_set_socket_cfg(struct rmq_client *client,
+                          const struct rmq_socket_cfg *cfg) {
+    rmq_transport_set_socket_cfg(client->transport, cfg);
+}
 
-    flags = 0x00;
+int
+rmq_client_set_tune_cfg(struct rmq_client *client,
+                        const struct rmq_tune_cfg *cfg) {
+    if (cfg->frame_max > 0 && cfg->frame_max < RMQ_FRAME_MIN_SIZE) {
+        c_set_error("frame size lower than %u bytes", RMQ_FRAME_MIN_SIZE);
+        return -1;
+    }
 
-    rmq_client_send_method(client, RMQ_METHOD_BASIC_REJECT,
-                           RMQ_FIELD_LONG_LONG_UINT, tag,
-                           RMQ_FIELD_SHORT_SHORT_UINT, flags,
-                           RMQ_FIELD_END);
+    client->tune_cfg = *cfg;
+    return 0;
 }
 
 void
-rmq_client_requeue(struct rmq_client *client, uint64_t tag) {
-    uint8_t flags;
-
-    flags = 0x01; /* requeue */
+rmq_client_set_dns_cache_ttl(struct rmq_client *client, uint64_t ttl) {
+    rmq_transport_set_dns_cache_ttl(client->transport, ttl);
+}
 
-    rmq_client_send_method(client, RMQ_METHOD_BASIC_REJECT,
-                           RMQ_FIELD_LONG_LONG_UINT, tag,
-                           RMQ_FIELD_SHORT_SHORT_UINT, flags,
-                           RMQ_FIELD_END);
+int
+rmq_client_enable_tls(struct rmq_client *client,
+                      const struct rmq_tls_cfg *cfg) {
+    return rmq_transport_enable_tls(client->transport, cfg);
 }
 
-void
-rmq_client_toggle_flow(struct rmq_client *client, bool active) {
-    uint8_t value;
+static int
+rmq_client_check_credentials(struct rmq_client *client) {
+    if (!client->login) {
+        c_set_error("missing login");
+        return -1;
+    }
 
-    value = 0x00;
-    if (active)
-        value |= 0x01;
+    if (!client->password) {
+        c_set_error("missing password");
+        return -1;
+    }
 
-    rmq_client_send_method(client, RMQ_METHOD_CHANNEL_FLOW,
-                           RMQ_FIELD_SHORT_SHORT_UINT, value,
-                           RMQ_FIELD_END);
+    return 0;
 }
 
-bool
-rmq_client_is_flow_active(const struct rmq_client *client) {
-    return client->flow_active;
+int
+rmq_client_connect(struct rmq_client *client,
+                   const char *host, uint16_t port) {
+    if (rmq_client_check_credentials(client) == -1)
+        return -1;
+
+    return rmq_transport_connect(client->transport, host, port);
 }
 
-void
-rmq_client_publish(struct rmq_client *client, struct rmq_msg *msg,
-                   const char *exchange, const char *routing_key,
-                   uint32_t options) {
+int
+rmq_client_connect_uri(struct rmq_client *client, const char *string) {
+    struct rmq_uri uri;
+    int ret;
+
+    rmq_uri_init(&uri);
+    uri.tune_cfg = client->tune_cfg;
+
+    if (rmq_uri_parse(&uri, string) == -1) {
+        c_set_error("invalid uri: %s", c_get_error());
+        return -1;
+    }
+
+    for (size_t i = 0; i < rmq_uri_nb_ignored_parameters(&uri); i++) {
+        rmq_client_trace(client, "ignoring unknown uri parameter '%s'",
+                         rmq_uri_ignored_parameter(&uri, i));
+    }
+
+    ret = -1;
+
+    if (uri.tls != (client->transport->ssl_ctx != NULL)) {
+        struct rmq_tls_cfg tls_cfg;
+
+        if (!uri.tls) {
+            c_set_error("tls is enabled but the uri does not use the "
+                        "amqps scheme");
+            goto end;
+        }
+
+        memset(&tls_cfg, 0, sizeof(struct rmq_tls_cfg));
+
+        if (rmq_client_enable_tls(client, &tls_cfg) == -1)
+            goto end;
+    }
+
+    if (rmq_client_set_tune_cfg(client, &uri.tune_cfg) == -1)
+        goto end;
+
+    if (uri.user)
+        rmq_client_set_credentials(client, uri.user, uri.password);
+
+    if (uri.vhost)
+        rmq_client_set_vhost(client, uri.vhost);
+
+    ret = rmq_client_connect(client, uri.host, uri.port);
+
+end:
+    rmq_uri_free(&uri);
+    return ret;
+}
+
+int
+rmq_client_connect_unix(struct rmq_client *client, const char *path) {
+    if (rmq_client_check_credentials(client) == -1)
+        return -1;
+
+    return rmq_transport_connect_unix(client->transport, path);
+}
+
+int
+rmq_client_connect_endpoints(struct rmq_client *client,
+                             const struct rmq_endpoint *endpoints,
+                             size_t nb_endpoints) {
+    if (rmq_client_check_credentials(client) == -1)
+        return -1;
+
+    return rmq_transport_connect_endpoints(client->transport,
+                                           endpoints, nb_endpoints);
+}
+
+void
+rmq_client_disconnect(struct rmq_client *client) {
+    if (!rmq_transport_is_connected(client->transport))
+        return;
+
+    rmq_client_connection_close(client, RMQ_REPLY_CODE_SUCCESS, "goodbye");
+
+    /* TODO Timeout in case the server never sends Connection.Close-Ok and
+     * does not close the connection */
+}
+
+int
+rmq_client_reconnect(struct rmq_client *client) {
+    return rmq_transport_reconnect(client->transport);
+}
+
+int
+rmq_client_hand_off(struct rmq_client *client, int sock,
+                    const void *data, size_t size) {
+    struct rmq_field_table *state;
+    struct c_buffer *buf;
+    int ret;
+
+    if (client->state != RMQ_CLIENT_STATE_READY) {
+        c_set_error("client not ready");
+        return -1;
+    }
+
+    if (client->transport->ssl) {
+        c_set_error("cannot hand off a tls connection");
+        return -1;
+    }
+
+    /* The successor could not complete a message being received or an
+     * operation whose callback lives in this process. */
+    if (client->has_current_delivery) {
+        c_set_error("message being received");
+        return -1;
+    }
+
+    if (client->first_op || client->first_get
+     || client->rpc_calls.nb_calls > 0) {
+        c_set_error("operations pending");
+        return -1;
+    }
+
+    state = rmq_client_export_state(client, data, size);
+
+    buf = c_buffer_new();
+    rmq_field_write_table(state, buf);
+    rmq_field_table_delete(state);
+
+    ret = rmq_handoff_send(sock, client->transport->sock,
+                           c_buffer_data(buf), c_buffer_length(buf));
+    c_buffer_delete(buf);
+
+    if (ret == -1)
+        return -1;
+
+    /* Replayed records which were not sent yet are part of the output
+     * transferred to the successor. */
+    if (client->spool)
+        rmq_spool_commit(client->spool, client->spool->replayed);
+
+    /* The connection belongs to the successor now: the socket is closed
+     * without sending anything to the server. */
+    close(rmq_transport_detach(client->transport));
+
+    rmq_client_trace(client, "connection handed off");
+
+    rmq_client_on_conn_closed(client);
+    return 0;
+}
+
+int
+rmq_client_take_over(struct rmq_client *client, int sock,
+                     const struct rmq_consumer_handler *handlers,
+                     size_t nb_handlers, struct c_buffer *data) {
+    struct rmq_field_table *state;
+    struct c_buffer *buf;
+    size_t sz;
+    int fd, ret;
+
+    if (client->state != RMQ_CLIENT_STATE_DISCONNECTED) {
+        c_set_error("client already connected");
+        return -1;
+    }
+
+    buf = c_buffer_new();
+
+    if (rmq_handoff_receive(sock, &fd, buf) == -1) {
+        c_buffer_delete(buf);
+        return -1;
+    }
+
+    ret = rmq_field_read_table(c_buffer_data(buf), c_buffer_length(buf),
+                               &state, &sz);
+    c_buffer_delete(buf);
+
+    if (ret == -1) {
+        c_set_error("invalid state: %s", c_get_error());
+        close(fd);
+        return -1;
+    }
+
+    ret = rmq_client_import_state(client, fd, state, handlers, nb_handlers,
+                                  data);
+    rmq_field_table_delete(state);
+
+    if (ret == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+rmq_client_add_state_field(struct rmq_field_table *state, const char *name,
+                           struct rmq_field *field) {
+    rmq_field_table_add_nocopy(state, c_strdup(name), field);
+}
+
+static void
+rmq_client_add_state_data(struct rmq_field_table *state, const char *name,
+                          const void *data, size_t size) {
+    if (size == 0)
+        return;
+
+    rmq_client_add_state_field(state, name,
+                               rmq_field_new_long_string(data, size));
+}
+
+static struct rmq_field_table *
+rmq_client_export_state(struct rmq_client *client,
+                        const void *data, size_t size) {
+    struct rmq_transport *transport;
+    struct rmq_field_table *state;
+    struct rmq_field *consumers, *endpoints;
+    struct c_hash_table_iterator *it;
+    struct rmq_consumer *consumer;
+    struct c_buffer *rbuf, *wbuf;
+
+    transport = client->transport;
+
+    state = rmq_field_table_new();
+
+    rmq_client_add_state_field(state, "version",
+                               rmq_field_new_long_uint(RMQ_HANDOFF_VERSION));
+
+    rmq_client_add_state_field(state, "frame_max",
+                               rmq_field_new_long_uint(client->frame_max));
+    rmq_client_add_state_field(state, "channel_max",
+                               rmq_field_new_short_uint(client->channel_max));
+    rmq_client_add_state_field(state, "heartbeat",
+        rmq_field_new_short_uint((uint16_t)(client->heartbeat_delay / 1000)));
+
+    rmq_client_add_state_field(state, "flow_active",
+                               rmq_field_new_boolean(client->flow_active));
+    rmq_client_add_state_field(state, "blocked",
+                               rmq_field_new_boolean(client->blocked));
+
+    rmq_client_add_state_field(state, "consumer_tag_id",
+        rmq_field_new_long_int((int32_t)client->consumer_tag_id));
+
+    /* Consumer callbacks cannot be transferred; the successor associates
+     * its own handlers with each queue. */
+    consumers = rmq_field_new_array();
+    consumers->u.array = c_ptr_vector_new();
+
+    it = c_hash_table_iterate(client->consumers_by_tag);
+    while (c_hash_table_iterator_next(it, NULL, (void **)&consumer) == 1) {
+        struct rmq_field *field;
+
+        field = rmq_field_new_table();
+        field->u.table = rmq_field_table_new();
+
+        rmq_client_add_state_field(field->u.table, "queue",
+                                   rmq_field_new_short_string(consumer->queue));
+        rmq_client_add_state_field(field->u.table, "tag",
+                                   rmq_field_new_short_string(consumer->tag));
+
+        c_ptr_vector_append(consumers->u.array, field);
+    }
+    c_hash_table_iterator_delete(it);
+
+    rmq_client_add_state_field(state, "consumers", consumers);
+
+    /* Endpoints are transferred so that the successor can reconnect */
+    endpoints = rmq_field_new_array();
+    endpoints->u.array = c_ptr_vector_new();
+
+    for (size_t i = 0; i < c_vector_length(transport->endpoints); i++) {
+        const struct rmq_transport_endpoint *endpoint;
+        struct rmq_field *field;
+
+        endpoint = c_vector_entry(transport->endpoints, i);
+
+        field = rmq_field_new_table();
+        field->u.table = rmq_field_table_new();
+
+        if (endpoint->path) {
+            rmq_client_add_state_field(field->u.table, "path",
+                rmq_field_new_short_string(endpoint->path));
+        } else {
+            rmq_client_add_state_field(field->u.table, "host",
+                rmq_field_new_short_string(endpoint->host));
+            rmq_client_add_state_field(field->u.table, "port",
+                rmq_field_new_short_uint(endpoint->port));
+        }
+
+        c_ptr_vector_append(endpoints->u.array, field);
+    }
+
+    rmq_client_add_state_field(state, "endpoints", endpoints);
+    rmq_client_add_state_field(state, "endpoint",
+        rmq_field_new_long_uint((uint32_t)transport->endpoint));
+
+    if (client->server_properties) {
+        struct c_buffer *buf;
+
+        buf = c_buffer_new();
+        rmq_field_write_table(client->server_properties, buf);
+
+        rmq_client_add_state_data(state, "server_properties",
+                                  c_buffer_data(buf), c_buffer_length(buf));
+        c_buffer_delete(buf);
+    }
+
+    /* Data read but not processed yet, including the beginning of an
+     * incomplete frame, and data not written yet. */
+    rbuf = rmq_transport_rbuf(transport);
+    wbuf = rmq_transport_wbuf(transport);
+
+    rmq_client_add_state_data(state, "input",
+                              c_buffer_data(rbuf), c_buffer_length(rbuf));
+    rmq_client_add_state_data(state, "output",
+                              c_buffer_data(wbuf), c_buffer_length(wbuf));
+
+    rmq_client_add_state_data(state, "data", data, size);
+
+    return state;
+}
+
+static struct rmq_field *
+rmq_client_state_field(const struct rmq_field_table *state,
+                       const char *name, enum rmq_field_type type) {
+    struct rmq_field *field;
+
+    field = rmq_field_table_get(state, name);
+    if (!field || field->type != type) {
+        c_set_error("missing or invalid field \"%s\"", name);
+        return NULL;
+    }
+
+    return field;
+}
+
+static const void *
+rmq_client_state_data(const struct rmq_field_table *state, const char *name,
+                      size_t *psize) {
+    const struct rmq_field *field;
+
+    field = rmq_field_table_get(state, name);
+    if (!field || field->type != RMQ_FIELD_LONG_STRING) {
+        *psize = 0;
+        return NULL;
+    }
+
+    return rmq_field_long_string_value(field, psize);
+}
+
+static const char *
+rmq_client_state_string(const struct rmq_field_table *state,
+                        const char *name) {
+    const struct rmq_field *field;
+
+    field = rmq_field_table_get(state, name);
+    if (!field || field->type != RMQ_FIELD_SHORT_STRING)
+        return NULL;
+
+    return field->u.short_string;
+}
+
+static bool
+rmq_client_find_handler(const struct rmq_consumer_handler *handlers,
+                        size_t nb_handlers, const char *queue,
+                        const struct rmq_consumer_handler **phandler) {
+    for (size_t i = 0; i < nb_handlers; i++) {
+        if (strcmp(handlers[i].queue, queue) == 0) {
+            if (phandler)
+                *phandler = handlers + i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int
+rmq_client_import_state(struct rmq_client *client, int sock,
+                        const struct rmq_field_table *state,
+                        const struct rmq_consumer_handler *handlers,
+                        size_t nb_handlers, struct c_buffer *data) {
+    const struct rmq_transport_endpoint *transport_endpoint;
+    struct rmq_transport *transport;
+    const struct rmq_field *field;
+    struct rmq_field_table *server_properties;
+    struct c_ptr_vector *consumers, *endpoint_fields;
+    struct rmq_endpoint *endpoints;
+    size_t nb_consumers, nb_endpoints, endpoint;
+    uint32_t frame_max;
+    uint16_t channel_max, heartbeat;
+    bool flow_active, blocked;
+    int32_t consumer_tag_id;
+    const void *ptr;
+    size_t size;
+    int ret;
+
+    transport = client->transport;
+
+    if (!(field = rmq_client_state_field(state, "version",
+                                         RMQ_FIELD_LONG_UINT))) {
+        return -1;
+    }
+
+    if (field->u.long_uint != RMQ_HANDOFF_VERSION) {
+        c_set_error("unsupported state version %" PRIu32, field->u.long_uint);
+        return -1;
+    }
+
+    if (!(field = rmq_client_state_field(state, "frame_max",
+                                         RMQ_FIELD_LONG_UINT))) {
+        return -1;
+    }
+    frame_max = field->u.long_uint;
+
+    if (!(field = rmq_client_state_field(state, "channel_max",
+                                         RMQ_FIELD_SHORT_UINT))) {
+        return -1;
+    }
+    channel_max = field->u.short_uint;
+
+    if (!(field = rmq_client_state_field(state, "heartbeat",
+                                         RMQ_FIELD_SHORT_UINT))) {
+        return -1;
+    }
+    heartbeat = field->u.short_uint;
+
+    if (!(field = rmq_client_state_field(state, "flow_active",
+                                         RMQ_FIELD_BOOLEAN))) {
+        return -1;
+    }
+    flow_active = field->u.boolean;
+
+    if (!(field = rmq_client_state_field(state, "blocked",
+                                         RMQ_FIELD_BOOLEAN))) {
+        return -1;
+    }
+    blocked = field->u.boolean;
+
+    if (!(field = rmq_client_state_field(state, "consumer_tag_id",
+                                         RMQ_FIELD_LONG_INT))) {
+        return -1;
+    }
+    consumer_tag_id = field->u.long_int;
+
+    /* Every consumer must have a handler before anything is modified */
+    if (!(field = rmq_client_state_field(state, "consumers",
+                                         RMQ_FIELD_ARRAY))) {
+        return -1;
+    }
+    consumers = field->u.array;
+    nb_consumers = consumers ? c_ptr_vector_length(consumers) : 0;
+
+    for (size_t i = 0; i < nb_consumers; i++) {
+        const char *queue, *tag;
+
+        field = c_ptr_vector_entry(consumers, i);
+        if (field->type != RMQ_FIELD_TABLE || !field->u.table) {
+            c_set_error("invalid consumer");
+            return -1;
+        }
+
+        queue = rmq_client_state_string(field->u.table, "queue");
+        tag = rmq_client_state_string(field->u.table, "tag");
+        if (!queue || !tag) {
+            c_set_error("invalid consumer");
+            return -1;
+        }
+
+        if (strcmp(queue, RMQ_RPC_REPLY_QUEUE) != 0
+         && !rmq_client_find_handler(handlers, nb_handlers, queue, NULL)) {
+            c_set_error("no handler for queue %s", queue);
+            return -1;
+        }
+    }
+
+    if (!(field = rmq_client_state_field(state, "endpoints",
+                                         RMQ_FIELD_ARRAY))) {
+        return -1;
+    }
+    endpoint_fields = field->u.array;
+    nb_endpoints = endpoint_fields ? c_ptr_vector_length(endpoint_fields) : 0;
+
+    if (!(field = rmq_client_state_field(state, "endpoint",
+                                         RMQ_FIELD_LONG_UINT))) {
+        return -1;
+    }
+    endpoint = field->u.long_uint;
+
+    if (nb_endpoints == 0) {
+        c_set_error("no endpoint");
+        return -1;
+    }
+
+    endpoints = c_calloc(nb_endpoints, sizeof(struct rmq_endpoint));
+
+    for (size_t i = 0; i < nb_endpoints; i++) {
+        field = c_ptr_vector_entry(endpoint_fields, i);
+        if (field->type != RMQ_FIELD_TABLE || !field->u.table) {
+            c_set_error("invalid endpoint");
+            c_free(endpoints);
+            return -1;
+        }
+
+        endpoints[i].host = rmq_client_state_string(field->u.table, "host");
+        endpoints[i].path = rmq_client_state_string(field->u.table, "path");
+
+        field = rmq_field_table_get(field->u.table, "port");
+        if (field && field->type == RMQ_FIELD_SHORT_UINT)
+            endpoints[i].port = field->u.short_uint;
+    }
+
+    server_properties = NULL;
+
+    ptr = rmq_client_state_data(state, "server_properties", &size);
+    if (ptr) {
+        size_t sz;
+
+        if (rmq_field_read_table(ptr, size, &server_properties, &sz) == -1) {
+            c_set_error("invalid server properties: %s", c_get_error());
+            c_free(endpoints);
+            return -1;
+        }
+    }
+
+    ret = rmq_transport_attach(transport, sock, endpoints, nb_endpoints,
+                               endpoint);
+    c_free(endpoints);
+
+    if (ret == -1) {
+        rmq_field_table_delete(server_properties);
+        return -1;
+    }
+
+    /* From now on, the socket belongs to the transport */
+    client->state = RMQ_CLIENT_STATE_READY;
+    client->channel_open_sent = true;
+
+    client->frame_max = frame_max;
+    client->channel_max = channel_max;
+
+    client->flow_active = flow_active;
+    client->blocked = blocked;
+
+    rmq_delivery_free(&client->current_delivery);
+    client->has_current_delivery = false;
+
+    if (server_properties)
+        rmq_client_read_server_properties(client, server_properties);
+
+    client->consumer_tag_id = consumer_tag_id;
+
+    for (size_t i = 0; i < nb_consumers; i++) {
+        const struct rmq_consumer_handler *handler;
+        struct rmq_consumer *consumer;
+        const char *queue, *tag;
+
+        field = c_ptr_vector_entry(consumers, i);
+
+        queue = rmq_client_state_string(field->u.table, "queue");
+        tag = rmq_client_state_string(field->u.table, "tag");
+
+        consumer = rmq_consumer_new(queue, c_strdup(tag));
+
+        if (strcmp(queue, RMQ_RPC_REPLY_QUEUE) == 0) {
+            consumer->msg_cb = rmq_client_on_rpc_reply;
+            client->rpc_consuming = true;
+        } else {
+            rmq_client_find_handler(handlers, nb_handlers, queue, &handler);
+            consumer->msg_cb = handler->cb;
+            consumer->msg_cb_arg = handler->cb_arg;
+        }
+
+        c_hash_table_insert(client->consumers_by_tag, consumer->tag,
+                            consumer);
+        c_hash_table_insert(client->consumers_by_queue, consumer->queue,
+                            consumer);
+    }
+
+    ptr = rmq_client_state_data(state, "data", &size);
+    if (data && size > 0)
+        c_buffer_add(data, ptr, size);
+
+    transport_endpoint = c_vector_entry(transport->endpoints,
+                                        transport->endpoint);
+    if (transport_endpoint->path) {
+        rmq_client_trace(client, "connection to %s taken over",
+                         transport_endpoint->path);
+    } else {
+        rmq_client_trace(client, "connection to %s:%u taken over",
+                         transport_endpoint->host, transport_endpoint->port);
+    }
+
+    if (heartbeat > 0) {
+        if (rmq_client_start_heartbeat(client, heartbeat) == -1) {
+            rmq_client_fatal(client, "cannot setup heartbeat: %s",
+                             c_get_error());
+            return 0;
+        }
+    }
+
+    if (transport->socket_cfg.auto_buffer_size) {
+        client->buffer_tuning_timer =
+            rmq_client_add_timer(client, RMQ_CLIENT_BUFFER_TUNING_INTERVAL,
+                                 rmq_client_on_buffer_tuning_timer, 0);
+        if (!client->buffer_tuning_timer) {
+            rmq_client_fatal(client, "cannot create buffer tuning timer: %s",
+                             c_get_error());
+            return 0;
+        }
+    }
+
+    ptr = rmq_client_state_data(state, "output", &size);
+    if (size > 0) {
+        c_buffer_add(rmq_transport_wbuf(transport), ptr, size);
+        rmq_transport_signal_data_written(transport);
+    }
+
+    if (client->spool && !rmq_spool_is_empty(client->spool))
+        rmq_client_replay_spool(client);
+
+    /* Frames read by the predecessor but not processed yet are handled
+     * immediately since the server may not send anything else for a
+     * while. */
+    ptr = rmq_client_state_data(state, "input", &size);
+    if (size > 0) {
+        c_buffer_add(rmq_transport_rbuf(transport), ptr, size);
+        rmq_client_on_data(client);
+    }
+
+    return 0;
+}
+
+bool
+rmq_client_is_ready(const struct rmq_client *client) {
+    return client->state == RMQ_CLIENT_STATE_READY;
+}
+
+size_t
+rmq_client_output_size(struct rmq_client *client) {
+    return c_buffer_length(rmq_transport_wbuf(client->transport))
+         + c_buffer_length(client->pending_wbuf);
+}
+
+static struct c_buffer *
+rmq_client_wbuf(struct rmq_client *client, uint16_t channel) {
+    if (channel != 0 && !client->channel_open_sent)
+        return client->pending_wbuf;
+
+    return rmq_transport_wbuf(client->transport);
+}
+
+void
+rmq_client_send_frame(struct rmq_client *client, enum rmq_frame_type type,
+                      uint16_t channel, const void *data, size_t size) {
+    struct rmq_frame frame;
+    struct c_buffer *wbuf;
+
+    assert(size <= UINT32_MAX);
+
+    rmq_frame_init(&frame);
+
+    frame.type = type;
+    frame.channel = channel;
+    frame.size = size;
+    frame.payload = data;
+    frame.end = RMQ_FRAME_END;
+
+    wbuf = rmq_client_wbuf(client, channel);
+    rmq_frame_write(&frame, wbuf);
+    rmq_transport_signal_data_written(client->transport);
+}
+
+static void
+rmq_client_vwrite_method(struct c_buffer *buf, uint16_t channel,
+                         enum rmq_method method, va_list ap) {
+    size_t offset;
+
+    offset = rmq_frame_write_start(RMQ_FRAME_TYPE_METHOD, channel, buf);
+
+    rmq_field_write_short_uint(method >> 16, buf);
+    rmq_field_write_short_uint(method & 0x0000ffff, buf);
+    rmq_fields_vwrite(buf, ap);
+
+    rmq_frame_write_end(offset, buf);
+}
+
+static void
+rmq_client_write_method(struct c_buffer *buf, uint16_t channel,
+                        enum rmq_method method, ...) {
+    va_list ap;
+
+    va_start(ap, method);
+    rmq_client_vwrite_method(buf, channel, method, ap);
+    va_end(ap);
+}
+
+void
+rmq_client_vsend_method_on_channel(struct rmq_client *client, uint16_t channel,
+                                   enum rmq_method method, va_list ap) {
+    struct c_buffer *wbuf;
+
+    wbuf = rmq_client_wbuf(client, channel);
+    rmq_client_vwrite_method(wbuf, channel, method, ap);
+    rmq_transport_signal_data_written(client->transport);
+}
+
+void
+rmq_client_send_method_on_channel(struct rmq_client *client, uint16_t channel,
+                                  enum rmq_method method, ...) {
+    va_list ap;
+
+    va_start(ap, method);
+    rmq_client_vsend_method_on_channel(client, channel, method, ap);
+    va_end(ap);
+}
+
+void
+rmq_client_send_method(struct rmq_client *client, enum rmq_method method, ...) {
+    va_list ap;
+
+    va_start(ap, method);
+    rmq_client_vsend_method_on_channel(client, client->channel, method, ap);
+    va_end(ap);
+}
+
+void
+rmq_client_send_header(struct rmq_client *client, uint16_t class_id,
+                       uint64_t body_size,
+                       const struct rmq_properties *properties) {
+    struct rmq_header_frame header_frame;
+    struct c_buffer *buf;
+
+    /* Header frame */
+    rmq_header_frame_init(&header_frame);
+
+    header_frame.class_id = class_id;
+    header_frame.body_size = body_size;
+    header_frame.properties = properties;
+
+    /* Frame */
+    buf = c_buffer_new();
+    rmq_header_frame_write(&header_frame, buf);
+
+    rmq_client_send_frame(client, RMQ_FRAME_TYPE_HEADER, client->channel,
+                          c_buffer_data(buf), c_buffer_length(buf));
+
+    c_buffer_delete(buf);
+}
+
+void
+rmq_client_send_body(struct rmq_client *client,
+                     const void *data, size_t size) {
+    rmq_client_send_frame(client, RMQ_FRAME_TYPE_BODY, client->channel,
+                          data, size);
+}
+
+void
+rmq_client_connection_close(struct rmq_client *client,
+                            enum rmq_reply_code code, const char *fmt, ...) {
+    char text[256];
+    va_list ap;
+
+    assert(client->state != RMQ_CLIENT_STATE_DISCONNECTED);
+
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+
+    rmq_client_send_method_on_channel(client, 0, RMQ_METHOD_CONNECTION_CLOSE,
+                                      RMQ_FIELD_SHORT_UINT, code,
+                                      RMQ_FIELD_SHORT_STRING, text,
+                                      RMQ_FIELD_SHORT_UINT, 0, /* class id */
+                                      RMQ_FIELD_SHORT_UINT, 0, /* method id */
+                                      RMQ_FIELD_END);
+
+    client->state = RMQ_CLIENT_STATE_CLOSING;
+}
+
+void
+rmq_client_ack(struct rmq_client *client, uint64_t tag) {
+    uint8_t flags;
+
+    flags = 0x00; /* multiple = false */
+
+    rmq_client_send_method(client, RMQ_METHOD_BASIC_ACK,
+                           RMQ_FIELD_LONG_LONG_UINT, tag,
+                           RMQ_FIELD_SHORT_SHORT_UINT, flags,
+                           RMQ_FIELD_END);
+}
+
+void
+rmq_client_ack_multiple(struct rmq_client *client, uint64_t tag) {
+    uint8_t flags;
+
+    flags = 0x01; /* multiple = true */
+
+    rmq_client_send_method(client, RMQ_METHOD_BASIC_ACK,
+                           RMQ_FIELD_LONG_LONG_UINT, tag,
+                           RMQ_FIELD_SHORT_SHORT_UINT, flags,
+                           RMQ_FIELD_END);
+}
+
+void
+rmq_client_reject(struct rmq_client *client, uint64_t tag) {
+    uint8_t flags;
+
+    flags = 0x00;
+
+    rmq_client_send_method(client, RMQ_METHOD_BASIC_REJECT,
+                           RMQ_FIELD_LONG_LONG_UINT, tag,
+                           RMQ_FIELD_SHORT_SHORT_UINT, flags,
+                           RMQ_FIELD_END);
+}
+
+void
+rmq_client_requeue(struct rmq_client *client, uint64_t tag) {
+    uint8_t flags;
+
+    flags = 0x01; /* requeue */
+
+    rmq_client_send_method(client, RMQ_METHOD_BASIC_REJECT,
+                           RMQ_FIELD_LONG_LONG_UINT, tag,
+                           RMQ_FIELD_SHORT_SHORT_UINT, flags,
+                           RMQ_FIELD_END);
+}
+
+void
+rmq_client_toggle_flow(struct rmq_client *client, bool active) {
+    uint8_t value;
+
+    value = 0x00;
+    if (active)
+        value |= 0x01;
+
+    rmq_client_send_method(client, RMQ_METHOD_CHANNEL_FLOW,
+                           RMQ_FIELD_SHORT_SHORT_UINT, value,
+                           RMQ_FIELD_END);
+}
+
+bool
+rmq_client_is_flow_active(const struct rmq_client *client) {
+    return client->flow_active;
+}
+
+bool
+rmq_client_is_blocked(const struct rmq_client *client) {
+    return client->blocked;
+}
+
+const struct rmq_field_table *
+rmq_client_server_properties(const struct rmq_client *client) {
+    return client->server_properties;
+}
+
+const char *
+rmq_client_server_product(const struct rmq_client *client) {
+    return client->server_product;
+}
+
+const char *
+rmq_client_server_version(const struct rmq_client *client) {
+    return client->server_version;
+}
+
+bool
+rmq_client_has_server_capability(const struct rmq_client *client,
+                                 enum rmq_capability capability) {
+    return (client->server_capabilities & capability) != 0;
+}
+
+void
+rmq_client_set_prefetch_count(struct rmq_client *client, uint16_t count,
+                              rmq_op_cb cb, void *cb_arg) {
+    uint8_t flags;
+
+    flags = 0x00; /* global = false */
+
+    rmq_client_push_op(client, RMQ_METHOD_BASIC_QOS, RMQ_METHOD_BASIC_QOS_OK,
+                       cb, cb_arg);
+
+    rmq_client_send_method(client, RMQ_METHOD_BASIC_QOS,
+                           RMQ_FIELD_LONG_UINT, 0, /* prefetch size */
+                           RMQ_FIELD_SHORT_UINT, count,
+                           RMQ_FIELD_SHORT_SHORT_UINT, flags,
+                           RMQ_FIELD_END);
+}
+
+static size_t
+rmq_client_max_body_frame_size(const struct rmq_client *client) {
+    uint32_t frame_max;
+
+    /* Frames buffered before Connection.Tune are encoded before the
+     * maximum frame size is negotiated; every peer accepts frames of the
+     * minimum size. */
+    if (client->channel_open_sent) {
+        frame_max = client->frame_max;
+    } else {
+        frame_max = RMQ_FRAME_MIN_SIZE;
+    }
+
+    /* The maximum frame size includes the frame header and the frame end
+     * marker. */
+    if (frame_max == 0 || frame_max > UINT32_MAX - 8)
+        return UINT32_MAX;
+
+    return frame_max - 8;
+}
+
+static size_t
+rmq_client_publish_size_hint(const struct rmq_client *client,
+                             const struct rmq_msg *msg,
+                             const char *exchange, const char *routing_key) {
+    size_t size, nb_body_frames;
+
+    /* Method frame */
+    size = 8 + 4 + 2 + 1 + strlen(exchange) + 1 + strlen(routing_key) + 1;
+
+    /* Header frame; we do not try to guess the size of properties, the
+     * buffer will grow if needed. */
+    size += 8 + 14;
+
+    /* Body frames */
+    nb_body_frames = msg->data_sz / rmq_client_max_body_frame_size(client) + 1;
+    size += nb_body_frames * 8 + msg->data_sz;
+
+    return size;
+}
+
+static void
+rmq_client_write_publish(struct rmq_client *client, struct c_buffer *buf,
+                         struct rmq_msg *msg, const char *exchange,
+                         const char *routing_key, uint32_t options) {
+    const struct c_buffer *header;
+    size_t offset;
+    bool compressed;
+
+    compressed = rmq_client_compress_body(client, msg);
+
+    /* Method frame */
+    rmq_client_write_method(buf, client->channel, RMQ_METHOD_BASIC_PUBLISH,
+                            RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                            RMQ_FIELD_SHORT_STRING, exchange,
+                            RMQ_FIELD_SHORT_STRING, routing_key,
+                            RMQ_FIELD_SHORT_SHORT_UINT, (uint8_t)options,
+                            RMQ_FIELD_END);
+
+    if (compressed) {
+        offset = rmq_frame_write_start(RMQ_FRAME_TYPE_HEADER,
+                                       client->channel, buf);
+        rmq_client_write_compressed_header(client, msg, buf);
+        rmq_frame_write_end(offset, buf);
+
+        rmq_client_write_body(client, buf, c_buffer_data(client->codec_buf),
+                              c_buffer_length(client->codec_buf));
+        return;
+    }
+
+    /* Header frame; the payload is kept in the message so that it is only
+     * encoded once if the message is published several times. */
+    header = rmq_msg_encoded_header(msg);
+
+    offset = rmq_frame_write_start(RMQ_FRAME_TYPE_HEADER, client->channel,
+                                   buf);
+    c_buffer_add(buf, c_buffer_data(header), c_buffer_length(header));
+    rmq_frame_write_end(offset, buf);
+
+    rmq_client_write_body(client, buf, msg->data, msg->data_sz);
+}
+
+static void
+rmq_client_write_compressed_header(struct rmq_client *client,
+                                   const struct rmq_msg *msg,
+                                   struct c_buffer *buf) {
+    struct rmq_header_frame header_frame;
+    struct rmq_properties properties;
+    const char *encoding;
+
+    /* The message may be shared with other clients: the encoding is set on
+     * a copy of its properties. */
+    encoding = client->compression_codec->encoding;
+
+    properties = msg->properties;
+    properties.content_encoding = NULL;
+    rmq_properties_set_content_encoding(&properties, encoding);
+
+    rmq_header_frame_init(&header_frame);
+
+    header_frame.class_id = RMQ_CLASS_BASIC;
+    header_frame.body_size = c_buffer_length(client->codec_buf);
+    header_frame.properties = &properties;
+
+    rmq_header_frame_write(&header_frame, buf);
+
+    c_free(properties.content_encoding);
+}
+
+static void
+rmq_client_write_body(struct rmq_client *client, struct c_buffer *buf,
+                      const void *body, size_t body_sz) {
+    const uint8_t *data;
+    size_t offset, data_sz, max_frame_size;
+
+    /* There is no body frame for an empty body */
+    max_frame_size = rmq_client_max_body_frame_size(client);
+
+    data = body;
+    data_sz = body_sz;
+
+    while (data_sz > 0) {
+        size_t frame_size;
+
+        frame_size = data_sz;
+        if (frame_size > max_frame_size)
+            frame_size = max_frame_size;
+
+        offset = rmq_frame_write_start(RMQ_FRAME_TYPE_BODY, client->channel,
+                                       buf);
+        c_buffer_add(buf, data, frame_size);
+        rmq_frame_write_end(offset, buf);
+
+        data += frame_size;
+        data_sz -= frame_size;
+    }
+}
+
+void
+rmq_client_publish_template(struct rmq_client *client,
+                            struct rmq_publish_template *template,
+                            const void *data, size_t size) {
+    struct c_buffer *wbuf;
+    size_t nb_body_frames;
+
+    /* The sent message callback is not called since there is no message
+     * object to pass to it. */
+
+    /* Same rule as rmq_client_publish_batch(): the template already
+     * contains the payloads stored in spool records. */
+    if (client->spool && (client->state != RMQ_CLIENT_STATE_READY
+                          || !rmq_spool_is_replayed(client->spool))) {
+        rmq_publish_template_set_body_size(template, size);
+
+        if (rmq_spool_append(client->spool,
+                             c_buffer_data(template->method),
+                             c_buffer_length(template->method),
+                             c_buffer_data(template->header),
+                             c_buffer_length(template->header),
+                             data, size) == -1) {
+            rmq_client_error(client, "cannot spool message: %s",
+                             c_get_error());
+        }
+
+        return;
+    }
+
+    wbuf = rmq_client_wbuf(client, client->channel);
+
+    nb_body_frames = size / rmq_client_max_body_frame_size(client) + 1;
+    c_buffer_reserve(wbuf, 8 + c_buffer_length(template->method)
+                         + 8 + c_buffer_length(template->header)
+                         + nb_body_frames * 8 + size);
+
+    rmq_publish_template_write(template, client->channel, size, wbuf);
+    rmq_client_write_body(client, wbuf, data, size);
+
+    rmq_transport_signal_data_written(client->transport);
+}
+
+void
+rmq_client_publish(struct rmq_client *client, struct rmq_msg *msg,
+                   const char *exchange, const char *routing_key,
+                   uint32_t options) {
+    struct rmq_publish_entry entry;
+
+    entry.msg = msg;
+    entry.exchange = exchange;
+    entry.routing_key = routing_key;
+    entry.options = options;
+
+    rmq_client_publish_batch(client, &entry, 1);
+}
+
+void
+rmq_client_publish_batch(struct rmq_client *client,
+                         const struct rmq_publish_entry *entries,
+                         size_t nb_entries) {
+    struct c_buffer *wbuf;
+    size_t size;
+
+    /* If the client is not ready, or if there are publications waiting to
+     * be replayed, messages are spooled so that they are sent in order
+     * later. */
+    if (client->spool && (client->state != RMQ_CLIENT_STATE_READY
+                          || !rmq_spool_is_replayed(client->spool))) {
+        for (size_t i = 0; i < nb_entries; i++) {
+            const struct rmq_publish_entry *entry;
+
+            entry = entries + i;
+
+            rmq_client_spool_publish(client, entry->msg, entry->exchange,
+                                     entry->routing_key
+                                     ? entry->routing_key : "",
+                                     entry->options);
+            rmq_msg_unref(entry->msg);
+        }
+
+        return;
+    }
+
+    wbuf = rmq_client_wbuf(client, client->channel);
+
+    /* Reserve space for the whole batch so that frames are encoded one
+     * after the other without the buffer having to grow. */
+    size = 0;
+    for (size_t i = 0; i < nb_entries; i++) {
+        const struct rmq_publish_entry *entry;
+
+        entry = entries + i;
+
+        size += rmq_client_publish_size_hint(client, entry->msg,
+                                             entry->exchange,
+                                             entry->routing_key
+                                             ? entry->routing_key : "");
+    }
+
+    c_buffer_reserve(wbuf, size);
+
+    for (size_t i = 0; i < nb_entries; i++) {
+        const struct rmq_publish_entry *entry;
+        const char *routing_key;
+
+        entry = entries + i;
+
+        routing_key = entry->routing_key;
+        if (!routing_key)
+            routing_key = "";
+
+        if (client->sent_msg_cb) {
+            client->sent_msg_cb(client, entry->msg, entry->exchange,
+                                routing_key, client->sent_msg_cb_arg);
+        }
+
+        rmq_client_write_publish(client, wbuf, entry->msg, entry->exchange,
+                                 routing_key, entry->options);
+
+        rmq_msg_unref(entry->msg);
+    }
+
+    rmq_transport_signal_data_written(client->transport);
+}
+
+void
+rmq_client_subscribe(struct rmq_client *client, const char *queue,
+                     uint8_t options, rmq_msg_cb cb, void *cb_arg) {
+    struct rmq_field_table *arguments;
+    struct rmq_consumer *consumer;
+    char *tag;
+
+    assert(c_hash_table_get(client->consumers_by_queue, queue,
+                            (void **)&consumer) == 0);
+
+    c_asprintf(&tag, "consumer-%d", ++client->consumer_tag_id);
+
+    consumer = rmq_consumer_new(queue, tag);
+    consumer->msg_cb = cb;
+    consumer->msg_cb_arg = cb_arg;
+
+    c_hash_table_insert(client->consumers_by_tag, consumer->tag, consumer);
+    c_hash_table_insert(client->consumers_by_queue, consumer->queue, consumer);
+
+    options |= 0x08; /* no-wait */
+
+    arguments = rmq_field_table_new();
+
+    rmq_client_send_method(client, RMQ_METHOD_BASIC_CONSUME,
+                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                           RMQ_FIELD_SHORT_STRING, consumer->queue,
+                           RMQ_FIELD_SHORT_STRING, consumer->tag,
+                           RMQ_FIELD_SHORT_SHORT_UINT, options,
+                           RMQ_FIELD_TABLE, arguments,
+                           RMQ_FIELD_END);
+
+    rmq_field_table_delete(arguments);
+}
+
+void
+rmq_client_unsubscribe(struct rmq_client *client, const char *queue) {
+    struct rmq_consumer *consumer;
+    uint8_t options;
+
+    if (c_hash_table_get(client->consumers_by_queue, queue,
+                         (void **)&consumer) == 0) {
+        assert(false);
+    }
+
+    c_hash_table_remove(client->consumers_by_tag, consumer->tag);
+    c_hash_table_remove(client->consumers_by_queue, consumer->queue);
+
+    rmq_consumer_delete(consumer);
+
+    options = RMQ_UNSUBSCRIBE_NO_WAIT;
+
+    rmq_client_send_method(client, RMQ_METHOD_BASIC_CANCEL,
+                           RMQ_FIELD_SHORT_STRING, consumer->tag,
+                           RMQ_FIELD_SHORT_SHORT_UINT, options,
+                           RMQ_FIELD_END);
+}
+
+void
+rmq_client_get(struct rmq_client *client, const char *queue,
+               uint8_t options, rmq_msg_cb cb, void *cb_arg) {
+    rmq_client_send_get(client, queue, options, rmq_get_new(cb, cb_arg));
+}
+
+static void
+rmq_client_send_drain_get(struct rmq_client *client,
+                          struct rmq_get_drain *drain) {
+    struct rmq_get *get;
+
+    assert(drain->nb_left > 0);
+
+    get = rmq_get_new(drain->msg_cb, drain->msg_cb_arg);
+    get->drain = drain;
+
+    drain->nb_left--;
+    drain->nb_in_flight++;
+
+    rmq_client_send_get(client, drain->queue, drain->options, get);
+}
+
+void
+rmq_client_drain_queue(struct rmq_client *client, const char *queue,
+                       uint8_t options, unsigned int max,
+                       unsigned int window, rmq_msg_cb cb, void *cb_arg) {
+    struct rmq_get_drain *drain;
+
+    assert(max > 0);
+    assert(window > 0);
+
+    drain = rmq_get_drain_new(queue, options, max, cb, cb_arg);
+
+    for (unsigned int i = 0; i < window && drain->nb_left > 0; i++)
+        rmq_client_send_drain_get(client, drain);
+}
+
+int
+rmq_client_call(struct rmq_client *client, struct rmq_msg *msg,
+                const char *exchange, const char *routing_key,
+                uint64_t timeout, rmq_rpc_cb cb, void *cb_arg) {
+    struct rmq_rpc_call call;
+    struct c_buffer *wbuf;
+    char correlation_id[17];
+
+    if (client->state != RMQ_CLIENT_STATE_READY) {
+        c_set_error("client not ready");
+        rmq_msg_unref(msg);
+        return -1;
+    }
+
+    if (!routing_key)
+        routing_key = "";
+
+    /* The pseudo-queue used for direct reply-to must be consumed, in no-ack
+     * mode, before the first request is published on the channel. */
+    if (!client->rpc_consuming) {
+        rmq_client_subscribe(client, RMQ_RPC_REPLY_QUEUE,
+                             RMQ_SUBSCRIBE_NO_ACK,
+                             rmq_client_on_rpc_reply, NULL);
+        client->rpc_consuming = true;
+    }
+
+    memset(&call, 0, sizeof(struct rmq_rpc_call));
+
+    call.id = ++client->last_rpc_id;
+
+    call.cb = cb;
+    call.cb_arg = cb_arg;
+
+    if (timeout > 0) {
+        call.timer = rmq_client_add_timer(client, timeout,
+                                          rmq_client_on_rpc_timeout, call.id);
+        if (!call.timer) {
+            rmq_msg_unref(msg);
+            return -1;
+        }
+    }
+
+    rmq_rpc_table_insert(&client->rpc_calls, &call);
+
+    /* Correlation ids are only compared with our own ids, the shortest
+     * representation is enough. */
+    snprintf(correlation_id, sizeof(correlation_id), "%"PRIx64, call.id);
+
+    rmq_msg_set_correlation_id(msg, correlation_id);
+    rmq_msg_set_reply_to(msg, RMQ_RPC_REPLY_QUEUE);
+
+    /* Requests are sent directly, even if messages are being spooled: a
+     * reply can only be routed to the connection which sent the request. */
+    wbuf = rmq_client_wbuf(client, client->channel);
+
+    c_buffer_reserve(wbuf, rmq_client_publish_size_hint(client, msg,
+                                                        exchange,
+                                                        routing_key));
+
+    if (client->sent_msg_cb) {
+        client->sent_msg_cb(client, msg, exchange, routing_key,
+                            client->sent_msg_cb_arg);
+    }
+
+    rmq_client_write_publish(client, wbuf, msg, exchange, routing_key, 0);
+    rmq_transport_signal_data_written(client->transport);
+
+    rmq_msg_unref(msg);
+    return 0;
+}
+
+int
+rmq_exchange_type_parse(const char *string, enum rmq_exchange_type *ptype) {
+    if (strcmp(string, "direct") == 0) {
+        *ptype = RMQ_EXCHANGE_TYPE_DIRECT;
+    } else if (strcmp(string, "fanout") == 0) {
+        *ptype = RMQ_EXCHANGE_TYPE_FANOUT;
+    } else if (strcmp(string, "topic") == 0) {
+        *ptype = RMQ_EXCHANGE_TYPE_TOPIC;
+    } else if (strcmp(string, "headers") == 0) {
+        *ptype = RMQ_EXCHANGE_TYPE_HEADERS;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+const char *
+rmq_exchange_type_to_string(enum rmq_exchange_type type) {
+    switch (type) {
+    case RMQ_EXCHANGE_TYPE_DIRECT:
+        return "direct";
+    case RMQ_EXCHANGE_TYPE_FANOUT:
+        return "fanout";
+    case RMQ_EXCHANGE_TYPE_TOPIC:
+        return "topic";
+    case RMQ_EXCHANGE_TYPE_HEADERS:
+        return "headers";
+    }
+
+    return NULL;
+}
+
+static void
+rmq_client_send_exchange_declare(struct rmq_client *client, const char *name,
+                                 enum rmq_exchange_type type, uint8_t options,
+                                 const struct rmq_field_table *args,
+                                 bool no_wait) {
+    struct rmq_field_table *empty_table;
+    const char *type_string;
+
+    type_string = rmq_exchange_type_to_string(type);
+    assert(type_string);
+
+    if (no_wait)
+        options |= 0x10;
+
+    if (args) {
+        empty_table = NULL;
+    } else {
+        empty_table = rmq_field_table_new();
+        args = empty_table;
+    }
+
+    rmq_client_send_method(client, RMQ_METHOD_EXCHANGE_DECLARE,
+                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                           RMQ_FIELD_SHORT_STRING, name,
+                           RMQ_FIELD_SHORT_STRING, type_string,
+                           RMQ_FIELD_SHORT_SHORT_UINT, options,
+                           RMQ_FIELD_TABLE, args,
+                           RMQ_FIELD_END);
+
+    rmq_field_table_delete(empty_table);
+}
+
+void
+rmq_client_declare_exchange(struct rmq_client *client, const char *name,
+                            enum rmq_exchange_type type, uint8_t options,
+                            const struct rmq_field_table *args) {
+    rmq_client_send_exchange_declare(client, name, type, options, args, true);
+}
+
+void
+rmq_client_declare_exchange_sync(struct rmq_client *client, const char *name,
+                                 enum rmq_exchange_type type, uint8_t options,
+                                 const struct rmq_field_table *args,
+                                 rmq_op_cb cb, void *cb_arg) {
+    rmq_client_push_op(client, RMQ_METHOD_EXCHANGE_DECLARE,
+                       RMQ_METHOD_EXCHANGE_DECLARE_OK, cb, cb_arg);
+    rmq_client_send_exchange_declare(client, name, type, options, args,
+                                     false);
+}
+
+static void
+rmq_client_send_exchange_delete(struct rmq_client *client, const char *name,
+                                uint8_t options, bool no_wait) {
+    if (no_wait)
+        options |= 0x02;
+
+    rmq_client_send_method(client, RMQ_METHOD_EXCHANGE_DELETE,
+                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                           RMQ_FIELD_SHORT_STRING, name,
+                           RMQ_FIELD_SHORT_SHORT_UINT, options,
+                           RMQ_FIELD_END);
+}
+
+void
+rmq_client_delete_exchange(struct rmq_client *client, const char *name,
+                           uint8_t options) {
+    rmq_client_send_exchange_delete(client, name, options, true);
+}
+
+void
+rmq_client_delete_exchange_sync(struct rmq_client *client, const char *name,
+                                uint8_t options, rmq_op_cb cb, void *cb_arg) {
+    rmq_client_push_op(client, RMQ_METHOD_EXCHANGE_DELETE,
+                       RMQ_METHOD_EXCHANGE_DELETE_OK, cb, cb_arg);
+    rmq_client_send_exchange_delete(client, name, options, false);
+}
+
+static void
+rmq_client_send_queue_declare(struct rmq_client *client, const char *name,
+                              uint8_t options,
+                              const struct rmq_field_table *args,
+                              bool no_wait) {
+    struct rmq_field_table *empty_table;
+
+    if (no_wait)
+        options |= 0x10;
+
+    if (args) {
+        empty_table = NULL;
+    } else {
+        empty_table = rmq_field_table_new();
+        args = empty_table;
+    }
+
+    rmq_client_send_method(client, RMQ_METHOD_QUEUE_DECLARE,
+                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                           RMQ_FIELD_SHORT_STRING, name,
+                           RMQ_FIELD_SHORT_SHORT_UINT, options,
+                           RMQ_FIELD_TABLE, args,
+                           RMQ_FIELD_END);
+
+    rmq_field_table_delete(empty_table);
+}
+
+void
+rmq_client_declare_queue(struct rmq_client *client, const char *name,
+                         uint8_t options, const struct rmq_field_table *args) {
+    rmq_client_send_queue_declare(client, name, options, args, true);
+}
+
+void
+rmq_client_declare_queue_sync(struct rmq_client *client, const char *name,
+                              uint8_t options,
+                              const struct rmq_field_table *args,
+                              rmq_op_cb cb, void *cb_arg) {
+    /* The name can be empty, in which case the server generates it and
+     * returns it in Queue.Declare-Ok. */
+    rmq_client_push_op(client, RMQ_METHOD_QUEUE_DECLARE,
+                       RMQ_METHOD_QUEUE_DECLARE_OK, cb, cb_arg);
+    rmq_client_send_queue_declare(client, name, options, args, false);
+}
+
+static void
+rmq_client_send_queue_delete(struct rmq_client *client, const char *name,
+                             uint8_t options, bool no_wait) {
+    if (no_wait)
+        options |= 0x04;
+
+    rmq_client_send_method(client, RMQ_METHOD_QUEUE_DELETE,
+                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                           RMQ_FIELD_SHORT_STRING, name,
+                           RMQ_FIELD_SHORT_SHORT_UINT, options,
+                           RMQ_FIELD_END);
+}
+
+void
+rmq_client_delete_queue(struct rmq_client *client, const char *name,
+                        uint8_t options) {
+    rmq_client_send_queue_delete(client, name, options, true);
+}
+
+void
+rmq_client_delete_queue_sync(struct rmq_client *client, const char *name,
+                             uint8_t options, rmq_op_cb cb, void *cb_arg) {
+    rmq_client_push_op(client, RMQ_METHOD_QUEUE_DELETE,
+                       RMQ_METHOD_QUEUE_DELETE_OK, cb, cb_arg);
+    rmq_client_send_queue_delete(client, name, options, false);
+}
+
+static void
+rmq_client_send_queue_bind(struct rmq_client *client, const char *queue,
+                           const char *exchange, const char *routing_key,
+                           const struct rmq_field_table *args, bool no_wait) {
+    struct rmq_field_table *empty_table;
+    uint8_t options;
+
+    options = 0x00;
+    if (no_wait)
+        options |= 0x01;
+
+    if (args) {
+        empty_table = NULL;
+    } else {
+        empty_table = rmq_field_table_new();
+        args = empty_table;
+    }
+
     if (!routing_key)
         routing_key = "";
 
-    if (client->sent_msg_cb) {
-        client->sent_msg_cb(client, msg, exchange, routing_key,
-                            client->sent_msg_cb_arg);
+    rmq_client_send_method(client, RMQ_METHOD_QUEUE_BIND,
+                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                           RMQ_FIELD_SHORT_STRING, queue,
+                           RMQ_FIELD_SHORT_STRING, exchange,
+                           RMQ_FIELD_SHORT_STRING, routing_key,
+                           RMQ_FIELD_SHORT_SHORT_UINT, options,
+                           RMQ_FIELD_TABLE, args,
+                           RMQ_FIELD_END);
+
+    rmq_field_table_delete(empty_table);
+}
+
+void
+rmq_client_bind_queue(struct rmq_client *client, const char *queue,
+                      const char *exchange, const char *routing_key,
+                      const struct rmq_field_table *args) {
+    rmq_client_send_queue_bind(client, queue, exchange, routing_key, args,
+                               true);
+}
+
+void
+rmq_client_bind_queue_sync(struct rmq_client *client, const char *queue,
+                           const char *exchange, const char *routing_key,
+                           const struct rmq_field_table *args,
+                           rmq_op_cb cb, void *cb_arg) {
+    rmq_client_push_op(client, RMQ_METHOD_QUEUE_BIND,
+                       RMQ_METHOD_QUEUE_BIND_OK, cb, cb_arg);
+    rmq_client_send_queue_bind(client, queue, exchange, routing_key, args,
+                               false);
+}
+
+void
+rmq_client_unbind_queue(struct rmq_client *client, const char *queue,
+                        const char *exchange, const char *routing_key,
+                        const struct rmq_field_table *args) {
+    rmq_client_unbind_queue_sync(client, queue, exchange, routing_key, args,
+                                 NULL, NULL);
+}
+
+void
+rmq_client_unbind_queue_sync(struct rmq_client *client, const char *queue,
+                             const char *exchange, const char *routing_key,
+                             const struct rmq_field_table *args,
+                             rmq_op_cb cb, void *cb_arg) {
+    struct rmq_field_table *empty_table;
+
+    /* Queue.Unbind has no no-wait flag: the reply is always expected, and
+     * must be tracked even without callback so that replies to other
+     * operations are not mismatched. */
+    rmq_client_push_op(client, RMQ_METHOD_QUEUE_UNBIND,
+                       RMQ_METHOD_QUEUE_UNBIND_OK, cb, cb_arg);
+
+    if (args) {
+        empty_table = NULL;
+    } else {
+        empty_table = rmq_field_table_new();
+        args = empty_table;
     }
 
-    rmq_client_send_method(client, RMQ_METHOD_BASIC_PUBLISH,
+    if (!routing_key)
+        routing_key = "";
+
+    rmq_client_send_method(client, RMQ_METHOD_QUEUE_UNBIND,
                            RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                           RMQ_FIELD_SHORT_STRING, queue,
                            RMQ_FIELD_SHORT_STRING, exchange,
                            RMQ_FIELD_SHORT_STRING, routing_key,
-                           RMQ_FIELD_SHORT_SHORT_UINT, (uint8_t)options,
+                           RMQ_FIELD_TABLE, args,
                            RMQ_FIELD_END);
 
-    rmq_client_send_header(client, RMQ_CLASS_BASIC, msg->data_sz,
-                           &msg->properties);
+    rmq_field_table_delete(empty_table);
+}
 
-    rmq_client_send_body(client, msg->data, msg->data_sz);
+static void
+rmq_client_signal_event(struct rmq_client *client,
+                        enum rmq_client_event event, void *arg) {
+    if (!client->event_cb)
+        return;
 
-    rmq_msg_delete(msg);
+    client->event_cb(client, event, arg, client->event_cb_arg);
 }
 
-void
-rmq_client_subscribe(struct rmq_client *client, const char *queue,
-                     uint8_t options, rmq_msg_cb cb, void *cb_arg) {
-    struct rmq_field_table *arguments;
-    struct rmq_consumer *consumer;
-    char *tag;
+static void
+rmq_client_trace(struct rmq_client *client, const char *fmt, ...) {
+    char buf[C_ERROR_BUFSZ];
+    va_list ap;
 
-    assert(c_hash_table_get(client->consumers_by_queue, queue,
-                            (void **)&consumer) == 0);
+    va_start(ap, fmt);
+    vsnprintf(buf, C_ERROR_BUFSZ, fmt, ap);
+    va_end(ap);
 
-    c_asprintf(&tag, "consumer-%d", ++client->consumer_tag_id);
+    rmq_client_signal_event(client, RMQ_CLIENT_EVENT_TRACE, buf);
+}
 
-    consumer = rmq_consumer_new(queue, tag);
-    consumer->msg_cb = cb;
-    consumer->msg_cb_arg = cb_arg;
+static void
+rmq_client_error(struct rmq_client *client, const char *fmt, ...) {
+    char buf[C_ERROR_BUFSZ];
+    va_list ap;
 
-    c_hash_table_insert(client->consumers_by_tag, consumer->tag, consumer);
-    c_hash_table_insert(client->consumers_by_queue, consumer->queue, consumer);
+    va_start(ap, fmt);
+    vsnprintf(buf, C_ERROR_BUFSZ, fmt, ap);
+    va_end(ap);
 
-    options |= 0x08; /* no-wait */
+    rmq_client_signal_event(client, RMQ_CLIENT_EVENT_ERROR, buf);
+}
 
-    arguments = rmq_field_table_new();
+static void
+rmq_client_fatal(struct rmq_client *client, const char *fmt, ...) {
+    char buf[C_ERROR_BUFSZ];
+    va_list ap;
 
-    rmq_client_send_method(client, RMQ_METHOD_BASIC_CONSUME,
-                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
-                           RMQ_FIELD_SHORT_STRING, consumer->queue,
-                           RMQ_FIELD_SHORT_STRING, consumer->tag,
-                           RMQ_FIELD_SHORT_SHORT_UINT, options,
-                           RMQ_FIELD_TABLE, arguments,
-                           RMQ_FIELD_END);
+    va_start(ap, fmt);
+    vsnprintf(buf, C_ERROR_BUFSZ, fmt, ap);
+    va_end(ap);
 
-    rmq_field_table_delete(arguments);
+    rmq_client_signal_event(client, RMQ_CLIENT_EVENT_ERROR, buf);
+    rmq_transport_disconnect(client->transport);
 }
 
-void
-rmq_client_unsubscribe(struct rmq_client *client, const char *queue) {
-    struct rmq_consumer *consumer;
-    uint8_t options;
+static int
+rmq_client_start_heartbeat(struct rmq_client *client, uint16_t delay) {
+    assert(!client->heartbeat_timer);
+
+    client->heartbeat_delay = (uint64_t)delay * 1000;
+
+    client->heartbeat_timer =
+        rmq_client_add_timer(client, client->heartbeat_delay,
+                             rmq_client_on_heartbeat_timer, 0);
+    if (!client->heartbeat_timer)
+        return -1;
+
+    return 0;
+}
+
+static void
+rmq_client_stop_heartbeat(struct rmq_client *client) {
+    rmq_client_remove_timer(client, &client->heartbeat_timer);
+}
+
+static void
+rmq_client_on_heartbeat_timer(void *arg, uint64_t value) {
+    struct rmq_client *client;
+
+    client = arg;
+
+    client->heartbeat_timer =
+        rmq_client_add_timer(client, client->heartbeat_delay,
+                             rmq_client_on_heartbeat_timer, 0);
+    if (!client->heartbeat_timer) {
+        rmq_client_fatal(client, "cannot create heartbeat timer: %s",
+                         c_get_error());
+        return;
+    }
+
+    rmq_client_send_frame(client, RMQ_FRAME_TYPE_HEARTBEAT, 0, NULL, 0);
+}
+
+static void
+rmq_client_on_buffer_tuning_timer(void *arg, uint64_t value) {
+    struct rmq_client *client;
+
+    client = arg;
+
+    client->buffer_tuning_timer =
+        rmq_client_add_timer(client, RMQ_CLIENT_BUFFER_TUNING_INTERVAL,
+                             rmq_client_on_buffer_tuning_timer, 0);
+    if (!client->buffer_tuning_timer) {
+        rmq_client_fatal(client, "cannot create buffer tuning timer: %s",
+                         c_get_error());
+        return;
+    }
+
+    rmq_transport_tune_buffers(client->transport, rmq_now_ms());
+}
+
+static struct rmq_timer *
+rmq_client_add_timer(struct rmq_client *client, uint64_t delay,
+                     rmq_timer_cb cb, uint64_t value) {
+    struct rmq_timer *timer;
+
+    /* All the timers of the client are stored in a timer wheel, driven by
+     * a single io_base timer armed for the earliest expiry of the wheel. */
+    timer = rmq_timer_wheel_add(&client->timer_wheel, rmq_now_ms(), delay,
+                                cb, client, value);
+
+    if (client->timer_wheel_timer == -1
+     || timer->expiry < client->timer_wheel_expiry) {
+        if (rmq_client_schedule_timer_wheel(client, timer->expiry) == -1) {
+            rmq_timer_wheel_remove(&client->timer_wheel, timer);
+            return NULL;
+        }
+    }
+
+    return timer;
+}
+
+static void
+rmq_client_remove_timer(struct rmq_client *client, struct rmq_timer **ptimer) {
+    if (!*ptimer)
+        return;
+
+    /* The io_base timer is left as it is; waking up for nothing once is
+     * cheaper than looking for the next expiry. */
+    rmq_timer_wheel_remove(&client->timer_wheel, *ptimer);
+    *ptimer = NULL;
+}
+
+static int
+rmq_client_schedule_timer_wheel(struct rmq_client *client, uint64_t expiry) {
+    uint64_t now, deadline, delay;
+    int timer;
+
+    /* The io_base timer is recurrent so that removing it is valid whether
+     * it has fired or not; it is replaced each time it fires. */
+    if (client->timer_wheel_timer >= 0) {
+        io_base_remove_timer(client->io_base, client->timer_wheel_timer);
+        client->timer_wheel_timer = -1;
+    }
+
+    if (expiry == 0)
+        return 0;
+
+    now = rmq_now_ms();
+    deadline = expiry * RMQ_TIMER_WHEEL_TICK;
+    delay = (deadline > now) ? deadline - now : 1;
+
+    timer = io_base_add_timer(client->io_base, delay, IO_TIMER_RECURRENT,
+                              rmq_client_on_timer_wheel_timer, client);
+    if (timer == -1) {
+        c_set_error("cannot create timer: %s", c_get_error());
+        return -1;
+    }
+
+    client->timer_wheel_timer = timer;
+    client->timer_wheel_expiry = expiry;
+    return 0;
+}
+
+static void
+rmq_client_on_timer_wheel_timer(int timer, uint64_t delay, void *arg) {
+    struct rmq_client *client;
+    uint64_t expiry;
+
+    client = arg;
+
+    rmq_timer_wheel_advance(&client->timer_wheel, rmq_now_ms());
+
+    expiry = rmq_timer_wheel_next_expiry(&client->timer_wheel);
+    if (rmq_client_schedule_timer_wheel(client, expiry) == -1)
+        rmq_client_fatal(client, "%s", c_get_error());
+}
+
+static void
+rmq_client_on_handshake_timeout(void *arg, uint64_t value) {
+    struct rmq_client *client;
+
+    client = arg;
+
+    client->handshake_timer = NULL;
+
+    rmq_client_fatal(client, "handshake timeout");
+}
+
+static void
+rmq_client_spool_publish(struct rmq_client *client, struct rmq_msg *msg,
+                         const char *exchange, const char *routing_key,
+                         uint32_t options) {
+    const uint8_t *method, *header, *body;
+    size_t method_sz, header_sz, body_sz;
+    bool compressed;
+
+    /* The body is compressed before being stored so that replayed
+     * messages are identical to the ones sent directly. */
+    compressed = rmq_client_compress_body(client, msg);
+
+    /* Frames are encoded in a scratch buffer; only their payload is stored
+     * since the channel may change before they are replayed. */
+    c_buffer_clear(client->spool_buf);
+
+    rmq_client_write_method(client->spool_buf, 0, RMQ_METHOD_BASIC_PUBLISH,
+                            RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                            RMQ_FIELD_SHORT_STRING, exchange,
+                            RMQ_FIELD_SHORT_STRING, routing_key,
+                            RMQ_FIELD_SHORT_SHORT_UINT, (uint8_t)options,
+                            RMQ_FIELD_END);
+    method_sz = c_buffer_length(client->spool_buf);
+
+    if (compressed) {
+        rmq_client_write_compressed_header(client, msg, client->spool_buf);
+
+        header = (const uint8_t *)c_buffer_data(client->spool_buf)
+               + method_sz;
+        header_sz = c_buffer_length(client->spool_buf) - method_sz;
+
+        body = c_buffer_data(client->codec_buf);
+        body_sz = c_buffer_length(client->codec_buf);
+    } else {
+        const struct c_buffer *encoded_header;
+
+        encoded_header = rmq_msg_encoded_header(msg);
+
+        header = c_buffer_data(encoded_header);
+        header_sz = c_buffer_length(encoded_header);
+
+        body = msg->data;
+        body_sz = msg->data_sz;
+    }
+
+    method = c_buffer_data(client->spool_buf);
+
+    if (rmq_spool_append(client->spool, method + 7, method_sz - 8,
+                         header, header_sz, body, body_sz) == -1) {
+        rmq_client_error(client, "cannot spool message: %s", c_get_error());
+    }
+}
+
+static void
+rmq_client_replay_spool(struct rmq_client *client) {
+    struct rmq_spool_record record;
+    struct c_buffer *wbuf;
+    size_t offset;
+
+    wbuf = rmq_client_wbuf(client, client->channel);
+
+    /* Records are committed once they have been sent, i.e. once the write
+     * buffer they were copied to has been flushed. If the connection is
+     * closed before, they are replayed again on the next one. */
+    if (c_buffer_length(wbuf) == 0)
+        rmq_spool_commit(client->spool, client->spool->replayed);
+
+    /* Records are copied to the write buffer in chunks so that a large
+     * spool does not end up entirely in memory. */
+    while (c_buffer_length(wbuf) < RMQ_SPOOL_REPLAY_CHUNK_SIZE) {
+        if (rmq_spool_peek(client->spool, &record) == 0)
+            break;
+
+        if (client->sent_msg_cb)
+            rmq_client_signal_replayed_msg(client, &record);
+
+        offset = rmq_frame_write_start(RMQ_FRAME_TYPE_METHOD,
+                                       client->channel, wbuf);
+        c_buffer_add(wbuf, record.method, record.method_sz);
+        rmq_frame_write_end(offset, wbuf);
+
+        offset = rmq_frame_write_start(RMQ_FRAME_TYPE_HEADER,
+                                       client->channel, wbuf);
+        c_buffer_add(wbuf, record.header, record.header_sz);
+        rmq_frame_write_end(offset, wbuf);
+
+        rmq_client_write_body(client, wbuf, record.body, record.body_sz);
+
+        rmq_spool_skip(client->spool, &record);
+    }
+
+    rmq_transport_signal_data_written(client->transport);
+
+    /* The timer keeps running until the last records are committed */
+    if (rmq_spool_is_empty(client->spool)) {
+        rmq_client_stop_spool_replay(client);
+        return;
+    }
+
+    if (!client->spool_timer) {
+        client->spool_timer =
+            rmq_client_add_timer(client, RMQ_SPOOL_REPLAY_DELAY,
+                                 rmq_client_on_spool_timer, 0);
+        if (!client->spool_timer) {
+            rmq_client_error(client, "cannot create spool timer: %s",
+                             c_get_error());
+        }
+    }
+}
+
+static void
+rmq_client_signal_replayed_msg(struct rmq_client *client,
+                               const struct rmq_spool_record *record) {
+    struct rmq_header_frame header;
+    struct rmq_properties properties;
+    struct rmq_frame frame;
+    struct rmq_msg *msg;
+    char *exchange, *routing_key;
+    uint16_t reserved;
+
+    /* Records only contain encoded frames, the message is decoded again
+     * for the callback. Its body is passed as it is sent, compressed if a
+     * compression codec was applied. */
+    if (record->method_sz < 4
+     || rmq_fields_read(record->method + 4, record->method_sz - 4, NULL,
+                        RMQ_FIELD_SHORT_UINT, &reserved,
+                        RMQ_FIELD_SHORT_STRING, &exchange,
+                        RMQ_FIELD_SHORT_STRING, &routing_key,
+                        RMQ_FIELD_END) == -1) {
+        rmq_client_error(client, "cannot decode spooled method: %s",
+                         c_get_error());
+        return;
+    }
 
-    if (c_hash_table_get(client->consumers_by_queue, queue,
-                         (void **)&consumer) == 0) {
-        assert(false);
+    rmq_frame_init(&frame);
+
+    frame.type = RMQ_FRAME_TYPE_HEADER;
+    frame.size = (uint32_t)record->header_sz;
+    frame.payload = record->header;
+    frame.end = RMQ_FRAME_END;
+
+    if (rmq_header_frame_read(&header, &properties, &frame) == -1) {
+        rmq_client_error(client, "cannot decode spooled header: %s",
+                         c_get_error());
+        c_free(exchange);
+        c_free(routing_key);
+        return;
     }
 
-    c_hash_table_remove(client->consumers_by_tag, consumer->tag);
-    c_hash_table_remove(client->consumers_by_queue, consumer->queue);
+    msg = rmq_client_new_msg(client);
 
-    rmq_consumer_delete(consumer);
+    rmq_properties_free(&msg->properties);
+    msg->properties = properties;
 
-    options = RMQ_UNSUBSCRIBE_NO_WAIT;
+    rmq_msg_set_data(msg, record->body, record->body_sz);
 
-    rmq_client_send_method(client, RMQ_METHOD_BASIC_CANCEL,
-                           RMQ_FIELD_SHORT_STRING, consumer->tag,
-                           RMQ_FIELD_SHORT_SHORT_UINT, options,
-                           RMQ_FIELD_END);
-}
+    client->sent_msg_cb(client, msg, exchange, routing_key,
+                        client->sent_msg_cb_arg);
 
-int
-rmq_exchange_type_parse(const char *string, enum rmq_exchange_type *ptype) {
-    if (strcmp(string, "direct") == 0) {
-        *ptype = RMQ_EXCHANGE_TYPE_DIRECT;
-    } else if (strcmp(string, "fanout") == 0) {
-        *ptype = RMQ_EXCHANGE_TYPE_FANOUT;
-    } else if (strcmp(string, "topic") == 0) {
-        *ptype = RMQ_EXCHANGE_TYPE_TOPIC;
-    } else if (strcmp(string, "headers") == 0) {
-        *ptype = RMQ_EXCHANGE_TYPE_HEADERS;
-    } else {
-        return -1;
-    }
+    rmq_msg_unref(msg);
 
-    return 0;
+    c_free(exchange);
+    c_free(routing_key);
 }
 
-const char *
-rmq_exchange_type_to_string(enum rmq_exchange_type type) {
-    switch (type) {
-    case RMQ_EXCHANGE_TYPE_DIRECT:
-        return "direct";
-    case RMQ_EXCHANGE_TYPE_FANOUT:
-        return "fanout";
-    case RMQ_EXCHANGE_TYPE_TOPIC:
-        return "topic";
-    case RMQ_EXCHANGE_TYPE_HEADERS:
-        return "headers";
-    }
-
-    return NULL;
+static void
+rmq_client_stop_spool_replay(struct rmq_client *client) {
+    rmq_client_remove_timer(client, &client->spool_timer);
 }
 
-void
-rmq_client_declare_exchange(struct rmq_client *client, const char *name,
-                            enum rmq_exchange_type type, uint8_t options,
-                            const struct rmq_field_table *args) {
-    struct rmq_field_table *empty_table;
-    const char *type_string;
+static void
+rmq_client_on_spool_timer(void *arg, uint64_t value) {
+    struct rmq_client *client;
 
-    type_string = rmq_exchange_type_to_string(type);
-    assert(type_string);
+    client = arg;
 
-    options |= 0x10; /* no-wait */
+    client->spool_timer = NULL;
 
-    if (args) {
-        empty_table = NULL;
-    } else {
-        empty_table = rmq_field_table_new();
-        args = empty_table;
+    if (client->state != RMQ_CLIENT_STATE_READY)
+        return;
+
+    rmq_client_replay_spool(client);
+}
+
+static enum rmq_msg_action
+rmq_client_on_rpc_reply(struct rmq_client *client,
+                        const struct rmq_delivery *delivery,
+                        const struct rmq_msg *msg, void *arg) {
+    struct rmq_rpc_call call;
+    const char *correlation_id;
+    uint64_t id;
+    char *end;
+
+    correlation_id = rmq_msg_correlation_id(msg);
+    if (!correlation_id) {
+        rmq_client_error(client, "rpc reply without correlation id");
+        return RMQ_MSG_ACTION_NONE;
     }
 
-    rmq_client_send_method(client, RMQ_METHOD_EXCHANGE_DECLARE,
-                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
-                           RMQ_FIELD_SHORT_STRING, name,
-                           RMQ_FIELD_SHORT_STRING, type_string,
-                           RMQ_FIELD_SHORT_SHORT_UINT, options,
-                           RMQ_FIELD_TABLE, args,
-                           RMQ_FIELD_END);
+    errno = 0;
+    id = strtoull(correlation_id, &end, 16);
+    if (errno != 0 || *end != '\0' || end == correlation_id)
+        id = 0;
 
-    rmq_field_table_delete(empty_table);
-}
+    /* The call may have timed out */
+    if (rmq_rpc_table_remove(&client->rpc_calls, id, &call) == 0) {
+        rmq_client_trace(client, "ignoring rpc reply with unknown "
+                         "correlation id \"%s\"", correlation_id);
+        return RMQ_MSG_ACTION_NONE;
+    }
 
-void
-rmq_client_delete_exchange(struct rmq_client *client, const char *name,
-                           uint8_t options) {
-    options |= 0x02; /* no-wait */
+    rmq_client_remove_timer(client, &call.timer);
 
-    rmq_client_send_method(client, RMQ_METHOD_EXCHANGE_DELETE,
-                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
-                           RMQ_FIELD_SHORT_STRING, name,
-                           RMQ_FIELD_SHORT_SHORT_UINT, options,
-                           RMQ_FIELD_END);
+    if (call.cb)
+        call.cb(client, RMQ_RPC_STATUS_OK, delivery, msg, call.cb_arg);
+
+    /* Replies are consumed in no-ack mode */
+    return RMQ_MSG_ACTION_NONE;
 }
 
-void
-rmq_client_declare_queue(struct rmq_client *client, const char *name,
-                         uint8_t options, const struct rmq_field_table *args) {
-    struct rmq_field_table *empty_table;
+static void
+rmq_client_on_rpc_timeout(void *arg, uint64_t id) {
+    struct rmq_client *client;
+    struct rmq_rpc_call call;
 
-    options |= 0x10; /* no-wait */
+    client = arg;
 
-    if (args) {
-        empty_table = NULL;
-    } else {
-        empty_table = rmq_field_table_new();
-        args = empty_table;
-    }
+    if (rmq_rpc_table_remove(&client->rpc_calls, id, &call) == 0)
+        return;
 
-    rmq_client_send_method(client, RMQ_METHOD_QUEUE_DECLARE,
-                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
-                           RMQ_FIELD_SHORT_STRING, name,
-                           RMQ_FIELD_SHORT_SHORT_UINT, options,
-                           RMQ_FIELD_TABLE, args,
-                           RMQ_FIELD_END);
+    /* The timer has already been released by the wheel */
+    call.timer = NULL;
 
-    rmq_field_table_delete(empty_table);
+    if (call.cb)
+        call.cb(client, RMQ_RPC_STATUS_TIMEOUT, NULL, NULL, call.cb_arg);
 }
 
-void
-rmq_client_delete_queue(struct rmq_client *client, const char *name,
-                        uint8_t options) {
-    options |= 0x04; /* no-wait */
+static void
+rmq_client_abort_rpc_calls(struct rmq_client *client,
+                           enum rmq_rpc_status status) {
+    struct c_vector *calls;
 
-    rmq_client_send_method(client, RMQ_METHOD_QUEUE_DELETE,
-                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
-                           RMQ_FIELD_SHORT_STRING, name,
-                           RMQ_FIELD_SHORT_SHORT_UINT, options,
-                           RMQ_FIELD_END);
-}
+    if (client->rpc_calls.nb_calls == 0)
+        return;
 
-void
-rmq_client_bind_queue(struct rmq_client *client, const char *queue,
-                      const char *exchange, const char *routing_key,
-                      const struct rmq_field_table *args) {
-    struct rmq_field_table *empty_table;
-    uint8_t options;
+    calls = c_vector_new(sizeof(struct rmq_rpc_call));
 
-    options = 0x01; /* no-wait */
+    rmq_rpc_table_remove_all(&client->rpc_calls, calls);
 
-    if (args) {
-        empty_table = NULL;
-    } else {
-        empty_table = rmq_field_table_new();
-        args = empty_table;
+    for (size_t i = 0; i < c_vector_length(calls); i++) {
+        struct rmq_rpc_call *call;
+
+        call = c_vector_entry(calls, i);
+        rmq_client_remove_timer(client, &call->timer);
     }
 
-    if (!routing_key)
-        routing_key = "";
+    for (size_t i = 0; i < c_vector_length(calls); i++) {
+        struct rmq_rpc_call *call;
 
-    rmq_client_send_method(client, RMQ_METHOD_QUEUE_BIND,
-                           RMQ_FIELD_SHORT_UINT, 0, /* reserved */
-                           RMQ_FIELD_SHORT_STRING, queue,
-                           RMQ_FIELD_SHORT_STRING, exchange,
-                           RMQ_FIELD_SHORT_STRING, routing_key,
-                           RMQ_FIELD_SHORT_SHORT_UINT, options,
-                           RMQ_FIELD_TABLE, args,
-                           RMQ_FIELD_END);
+        call = c_vector_entry(calls, i);
+        if (call->cb)
+            call->cb(client, status, NULL, NULL, call->cb_arg);
+    }
 
-    rmq_field_table_delete(empty_table);
+    c_vector_delete(calls);
 }
 
-void
-rmq_client_unbind_queue(struct rmq_client *client, const char *queue,
-                        const char *exchange, const char *routing_key,
-                        const struct rmq_field_table *args) {
-    struct rmq_field_table *empty_table;
+static void
+rmq_client_send_get(struct rmq_client *client, const char *queue,
+                    uint8_t options, struct rmq_get *get) {
+    uint8_t flags;
 
-    if (args) {
-        empty_table = NULL;
+    flags = 0x00;
+    if (options & RMQ_GET_NO_ACK) {
+        flags |= 0x01;
+        get->no_ack = true;
+    }
+
+    if (client->last_get) {
+        client->last_get->next = get;
     } else {
-        empty_table = rmq_field_table_new();
-        args = empty_table;
+        client->first_get = get;
     }
 
-    if (!routing_key)
-        routing_key = "";
+    client->last_get = get;
 
-    rmq_client_send_method(client, RMQ_METHOD_QUEUE_UNBIND,
+    rmq_client_send_method(client, RMQ_METHOD_BASIC_GET,
                            RMQ_FIELD_SHORT_UINT, 0, /* reserved */
                            RMQ_FIELD_SHORT_STRING, queue,
-                           RMQ_FIELD_SHORT_STRING, exchange,
-                           RMQ_FIELD_SHORT_STRING, routing_key,
-                           RMQ_FIELD_TABLE, args,
+                           RMQ_FIELD_SHORT_SHORT_UINT, flags,
                            RMQ_FIELD_END);
-
-    rmq_field_table_delete(empty_table);
 }
 
-static void
-rmq_client_signal_event(struct rmq_client *client,
-                        enum rmq_client_event event, void *arg) {
-    if (!client->event_cb)
-        return;
+static struct rmq_get *
+rmq_client_pop_get(struct rmq_client *client) {
+    struct rmq_get *get;
 
-    client->event_cb(client, event, arg, client->event_cb_arg);
+    get = client->first_get;
+    if (!get)
+        return NULL;
+
+    client->first_get = get->next;
+    if (!client->first_get)
+        client->last_get = NULL;
+
+    get->next = NULL;
+    return get;
 }
 
 static void
-rmq_client_trace(struct rmq_client *client, const char *fmt, ...) {
-    char buf[C_ERROR_BUFSZ];
-    va_list ap;
+rmq_client_delete_gets(struct rmq_client *client) {
+    struct rmq_get *get;
 
-    va_start(ap, fmt);
-    vsnprintf(buf, C_ERROR_BUFSZ, fmt, ap);
-    va_end(ap);
-
-    rmq_client_signal_event(client, RMQ_CLIENT_EVENT_TRACE, buf);
+    while ((get = rmq_client_pop_get(client)))
+        rmq_get_delete(get);
 }
 
 static void
-rmq_client_error(struct rmq_client *client, const char *fmt, ...) {
-    char buf[C_ERROR_BUFSZ];
-    va_list ap;
+rmq_client_push_op(struct rmq_client *client, enum rmq_method method,
+                   enum rmq_method reply_method, rmq_op_cb cb, void *cb_arg) {
+    struct rmq_op *op;
 
-    va_start(ap, fmt);
-    vsnprintf(buf, C_ERROR_BUFSZ, fmt, ap);
-    va_end(ap);
+    op = rmq_op_new(method, reply_method, cb, cb_arg);
 
-    rmq_client_signal_event(client, RMQ_CLIENT_EVENT_ERROR, buf);
+    if (client->last_op) {
+        client->last_op->next = op;
+    } else {
+        client->first_op = op;
+    }
+
+    client->last_op = op;
 }
 
-static void
-rmq_client_fatal(struct rmq_client *client, const char *fmt, ...) {
-    char buf[C_ERROR_BUFSZ];
-    va_list ap;
+static struct rmq_op *
+rmq_client_pop_op(struct rmq_client *client) {
+    struct rmq_op *op;
 
-    va_start(ap, fmt);
-    vsnprintf(buf, C_ERROR_BUFSZ, fmt, ap);
-    va_end(ap);
+    op = client->first_op;
+    if (!op)
+        return NULL;
 
-    rmq_client_signal_event(client, RMQ_CLIENT_EVENT_ERROR, buf);
-    io_tcp_client_disconnect(client->tcp_client);
+    client->first_op = op->next;
+    if (!client->first_op)
+        client->last_op = NULL;
+
+    op->next = NULL;
+    return op;
 }
 
 static int
-rmq_client_start_heartbeat(struct rmq_client *client, uint16_t delay) {
-    int timer;
+rmq_client_on_op_reply(struct rmq_client *client, enum rmq_method method,
+                       const struct rmq_op_result *result) {
+    struct rmq_op *op;
 
-    assert(client->heartbeat_timer == -1);
-
-    timer = io_base_add_timer(client->io_base, delay * 1000, IO_TIMER_RECURRENT,
-                              rmq_client_on_heartbeat_timer, client);
-    if (timer == -1)
+    op = client->first_op;
+    if (!op || op->reply_method != method) {
+        c_set_error("unexpected method");
         return -1;
+    }
+
+    rmq_client_pop_op(client);
 
-    client->heartbeat_timer = timer;
+    if (op->cb)
+        op->cb(client, result, op->cb_arg);
+
+    rmq_op_delete(op);
     return 0;
 }
 
 static void
-rmq_client_stop_heartbeat(struct rmq_client *client) {
-    if (client->heartbeat_timer >= 0) {
-        io_base_remove_timer(client->io_base, client->heartbeat_timer);
-        client->heartbeat_timer = -1;
+rmq_client_abort_ops(struct rmq_client *client, const char *error) {
+    struct rmq_op_result result;
+    struct rmq_op *op;
+
+    memset(&result, 0, sizeof(struct rmq_op_result));
+    result.error = error;
+
+    while ((op = rmq_client_pop_op(client))) {
+        if (op->cb)
+            op->cb(client, &result, op->cb_arg);
+
+        rmq_op_delete(op);
     }
 }
 
 static void
-rmq_client_on_heartbeat_timer(int timer, uint64_t delay, void *arg) {
-    struct rmq_client *client;
+rmq_client_on_get_done(struct rmq_client *client, struct rmq_get *get,
+                       bool empty) {
+    struct rmq_get_drain *drain;
 
-    client = arg;
+    drain = get->drain;
+    if (!drain) {
+        rmq_get_delete(get);
+        return;
+    }
 
-    rmq_client_send_frame(client, RMQ_FRAME_TYPE_HEARTBEAT, 0, NULL, 0);
+    if (empty)
+        drain->empty = true;
+
+    if (!drain->empty && drain->nb_left > 0) {
+        /* Keep the window full; the new request holds a reference on the
+         * drain, so it survives the deletion of the current one. */
+        rmq_client_send_drain_get(client, drain);
+    } else if (drain->nb_in_flight == 1) {
+        if (drain->msg_cb)
+            drain->msg_cb(client, NULL, NULL, drain->msg_cb_arg);
+    }
+
+    rmq_get_delete(get);
 }
 
 static void
-rmq_client_on_tcp_event(struct io_tcp_client *tcp_client,
-                        enum io_tcp_client_event event,
-                        void *arg) {
+rmq_client_on_transport_event(struct rmq_transport *transport,
+                              enum rmq_transport_event event,
+                              void *arg) {
     struct rmq_client *client;
 
     client = arg;
 
     switch (event) {
-    case IO_TCP_CLIENT_EVENT_CONN_ESTABLISHED:
+    case RMQ_TRANSPORT_EVENT_CONN_ESTABLISHED:
         rmq_client_on_conn_established(client);
         break;
 
-    case IO_TCP_CLIENT_EVENT_CONN_FAILED:
+    case RMQ_TRANSPORT_EVENT_CONN_FAILED:
         rmq_client_signal_event(client, RMQ_CLIENT_EVENT_CONN_FAILED, NULL);
         break;
 
-    case IO_TCP_CLIENT_EVENT_CONN_CLOSED:
+    case RMQ_TRANSPORT_EVENT_CONN_CLOSED:
         rmq_client_on_conn_closed(client);
         break;
 
-    case IO_TCP_CLIENT_EVENT_ERROR:
+    case RMQ_TRANSPORT_EVENT_ERROR:
         rmq_client_error(client, "%s", c_get_error());
         break;
 
-    case IO_TCP_CLIENT_EVENT_DATA_READ:
+    case RMQ_TRANSPORT_EVENT_DATA_READ:
         rmq_client_on_data(client);
         break;
     }
@@ -822,8 +2926,22 @@ rmq_client_on_conn_closed(struct rmq_client *client) {
     client->state = RMQ_CLIENT_STATE_DISCONNECTED;
 
     client->flow_active = false;
+    client->blocked = false;
+
+    /* Frames buffered during the handshake belong to operations which are
+     * aborted below. */
+    client->channel_open_sent = false;
+    c_buffer_clear(client->pending_wbuf);
 
+    rmq_client_remove_timer(client, &client->handshake_timer);
+    rmq_client_remove_timer(client, &client->buffer_tuning_timer);
     rmq_client_stop_heartbeat(client);
+    rmq_client_stop_spool_replay(client);
+
+    /* Replayed records which were not sent are replayed again on the next
+     * connection. */
+    if (client->spool)
+        rmq_spool_rewind(client->spool);
 
     it = c_hash_table_iterate(client->consumers_by_tag);
     while (c_hash_table_iterator_next(it, NULL, (void **)&consumer) == 1)
@@ -833,30 +2951,80 @@ rmq_client_on_conn_closed(struct rmq_client *client) {
 
     c_hash_table_clear(client->consumers_by_queue);
 
+    rmq_client_delete_gets(client);
+    rmq_client_abort_ops(client, "connection closed");
+
+    /* Replies can only be received on the connection used to send the
+     * requests. */
+    client->rpc_consuming = false;
+    rmq_client_abort_rpc_calls(client, RMQ_RPC_STATUS_ABORTED);
+
     rmq_client_signal_event(client, RMQ_CLIENT_EVENT_CONN_CLOSED, NULL);
 }
 
 static void
 rmq_client_on_conn_established(struct rmq_client *client) {
+    const struct rmq_transport_endpoint *endpoint;
+
     client->state = RMQ_CLIENT_STATE_CONNECTED;
 
-    client->channel = 0;
+    client->channel_open_sent = false;
+    client->frame_max = 0;
+    client->channel_max = 0;
 
     rmq_delivery_free(&client->current_delivery);
     client->has_current_delivery = false;
 
+    client->handshake_timer =
+        rmq_client_add_timer(client, RMQ_CLIENT_HANDSHAKE_TIMEOUT,
+                             rmq_client_on_handshake_timeout, 0);
+    if (!client->handshake_timer) {
+        rmq_client_fatal(client, "cannot create handshake timer: %s",
+                         c_get_error());
+        return;
+    }
+
+    if (client->transport->socket_cfg.auto_buffer_size) {
+        client->buffer_tuning_timer =
+            rmq_client_add_timer(client, RMQ_CLIENT_BUFFER_TUNING_INTERVAL,
+                                 rmq_client_on_buffer_tuning_timer, 0);
+        if (!client->buffer_tuning_timer) {
+            rmq_client_fatal(client, "cannot create buffer tuning timer: %s",
+                             c_get_error());
+            return;
+        }
+    }
+
     rmq_client_signal_event(client, RMQ_CLIENT_EVENT_CONN_ESTABLISHED, NULL);
 
+    endpoint = c_vector_entry(client->transport->endpoints,
+                              client->transport->endpoint);
+    if (endpoint->path) {
+        rmq_client_trace(client, "connected to %s", endpoint->path);
+    } else {
+        rmq_client_trace(client, "connected to %s:%u",
+                         endpoint->host, endpoint->port);
+    }
+
+    if (rmq_transport_is_tls_session_reused(client->transport))
+        rmq_client_trace(client, "tls session resumed");
+    if (client->transport->ktls_send || client->transport->ktls_recv) {
+        rmq_client_trace(client, "kernel tls enabled (send: %s, receive: %s)",
+                         client->transport->ktls_send ? "yes" : "no",
+                         client->transport->ktls_recv ? "yes" : "no");
+    }
+
     /* Protocol header */
-    io_tcp_client_write(client->tcp_client, "AMQP\x00\x00\x09\x01", 8);
+    rmq_transport_write(client->transport, "AMQP\x00\x00\x09\x01", 8);
 }
 
 static void
 rmq_client_on_data(struct rmq_client *client) {
-    struct c_buffer *rbuf;
-
-    rbuf = io_tcp_client_rbuf(client->tcp_client);
+    rmq_client_process_data(client, rmq_transport_rbuf(client->transport));
+}
 
+void
+rmq_client_process_data(struct rmq_client *client, struct c_buffer *rbuf) {
     while (c_buffer_length(rbuf) > 0) {
         struct rmq_frame frame;
         int ret;
@@ -938,11 +3106,145 @@ rmq_client_on_frame(struct rmq_client *client, const struct rmq_frame *frame) {
         break;
 
     default:
-        c_set_error("unknown frame type %d", frame->type);
-        return -1;
+        c_set_error("unknown frame type %d", frame->type);
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct rmq_field_table *
+rmq_client_properties(void) {
+    static const char *capability_names[] = {
+        "publisher_confirms",
+        "exchange_exchange_bindings",
+        "basic.nack",
+        "consumer_cancel_notify",
+        "connection.blocked",
+        "per_consumer_qos",
+    };
+    static const char *product = "librabbitmq";
+    static const char *platform = "C";
+    size_t nb_capabilities = sizeof(capability_names) / sizeof(char *);
+
+    struct rmq_field_table *properties;
+    struct rmq_field *capabilities;
+
+    capabilities = rmq_field_new_table();
+    capabilities->u.table = rmq_field_table_new();
+
+    for (size_t i = 0; i < nb_capabilities; i++) {
+        rmq_field_table_add_nocopy(capabilities->u.table,
+                                   c_strdup(capability_names[i]),
+                                   rmq_field_new_boolean(true));
+    }
+
+    properties = rmq_field_table_new();
+
+    rmq_field_table_add_nocopy(properties, c_strdup("product"),
+                               rmq_field_new_long_string(product,
+                                                         strlen(product)));
+    rmq_field_table_add_nocopy(properties, c_strdup("platform"),
+                               rmq_field_new_long_string(platform,
+                                                         strlen(platform)));
+    rmq_field_table_add_nocopy(properties, c_strdup("capabilities"),
+                               capabilities);
+
+    return properties;
+}
+
+static char *
+rmq_client_read_server_string(const struct rmq_field_table *properties,
+                              const char *name) {
+    const struct rmq_field *field;
+    const void *data;
+    size_t size;
+
+    field = rmq_field_table_get(properties, name);
+    if (!field)
+        return NULL;
+
+    switch (field->type) {
+    case RMQ_FIELD_SHORT_STRING:
+        return c_strdup(field->u.short_string);
+
+    case RMQ_FIELD_LONG_STRING:
+        data = rmq_field_long_string_value(field, &size);
+        return c_strndup(data, size);
+
+    default:
+        return NULL;
     }
+}
 
-    return 0;
+static void
+rmq_client_read_server_properties(struct rmq_client *client,
+                                  struct rmq_field_table *properties) {
+    static const struct {
+        const char *name;
+        enum rmq_capability capability;
+    } capabilities[] = {
+        {"publisher_confirms", RMQ_CAPABILITY_PUBLISHER_CONFIRMS},
+        {"exchange_exchange_bindings",
+         RMQ_CAPABILITY_EXCHANGE_EXCHANGE_BINDINGS},
+        {"basic.nack", RMQ_CAPABILITY_BASIC_NACK},
+        {"consumer_cancel_notify", RMQ_CAPABILITY_CONSUMER_CANCEL_NOTIFY},
+        {"connection.blocked", RMQ_CAPABILITY_CONNECTION_BLOCKED},
+        {"consumer_priorities", RMQ_CAPABILITY_CONSUMER_PRIORITIES},
+        {"authentication_failure_close",
+         RMQ_CAPABILITY_AUTHENTICATION_FAILURE_CLOSE},
+        {"per_consumer_qos", RMQ_CAPABILITY_PER_CONSUMER_QOS},
+        {"direct_reply_to", RMQ_CAPABILITY_DIRECT_REPLY_TO},
+    };
+
+    size_t nb_capabilities = sizeof(capabilities) / sizeof(capabilities[0]);
+    const struct rmq_field *field;
+
+    rmq_client_clear_server_properties(client);
+
+    client->server_properties = properties;
+
+    client->server_product =
+        rmq_client_read_server_string(properties, "product");
+    client->server_version =
+        rmq_client_read_server_string(properties, "version");
+
+    field = rmq_field_table_get(properties, "capabilities");
+    if (!field || field->type != RMQ_FIELD_TABLE || !field->u.table)
+        return;
+
+    for (size_t i = 0; i < nb_capabilities; i++) {
+        const struct rmq_field *value;
+
+        value = rmq_field_table_get(field->u.table, capabilities[i].name);
+        if (value && value->type == RMQ_FIELD_BOOLEAN && value->u.boolean)
+            client->server_capabilities |= capabilities[i].capability;
+    }
+}
+
+static void
+rmq_client_clear_server_properties(struct rmq_client *client) {
+    rmq_field_table_delete(client->server_properties);
+    client->server_properties = NULL;
+
+    c_free(client->server_product);
+    client->server_product = NULL;
+
+    c_free(client->server_version);
+    client->server_version = NULL;
+
+    client->server_capabilities = 0;
+}
+
+static uint32_t
+rmq_client_negotiate_tune_value(uint32_t server_value, uint32_t value) {
+    /* For both peers, 0 means that there is no limit */
+    if (server_value == 0)
+        return value;
+    if (value == 0)
+        return server_value;
+
+    return (value < server_value) ? value : server_value;
 }
 
 /* ---------------------------------------------------------------------------
@@ -980,10 +3282,17 @@ RMQ_METHOD_HANDLER(connection_start) {
 
     rmq_long_string_free(&mechanisms);
     rmq_long_string_free(&locales);
-    rmq_field_table_delete(server_properties);
+
+    rmq_client_read_server_properties(client, server_properties);
+
+    if (client->server_product) {
+        rmq_client_trace(client, "server: %s %s", client->server_product,
+                         client->server_version ? client->server_version
+                                                : "(unknown version)");
+    }
 
     /* Response */
-    client_properties = rmq_field_table_new();
+    client_properties = rmq_client_properties();
 
     mechanism = "PLAIN"; /* TODO */
 
@@ -1000,12 +3309,13 @@ RMQ_METHOD_HANDLER(connection_start) {
 
     locale = "en_US"; /* TODO */
 
-    rmq_client_send_method(client, RMQ_METHOD_CONNECTION_START_OK,
-                           RMQ_FIELD_TABLE, client_properties,
-                           RMQ_FIELD_SHORT_STRING, mechanism,
-                           RMQ_FIELD_LONG_STRING, &response,
-                           RMQ_FIELD_SHORT_STRING, locale,
-                           RMQ_FIELD_END);
+    rmq_client_send_method_on_channel(client, 0,
+                                      RMQ_METHOD_CONNECTION_START_OK,
+                                      RMQ_FIELD_TABLE, client_properties,
+                                      RMQ_FIELD_SHORT_STRING, mechanism,
+                                      RMQ_FIELD_LONG_STRING, &response,
+                                      RMQ_FIELD_SHORT_STRING, locale,
+                                      RMQ_FIELD_END);
 
     rmq_field_table_delete(client_properties);
     rmq_long_string_free(&response);
@@ -1015,6 +3325,7 @@ RMQ_METHOD_HANDLER(connection_start) {
 }
 
 RMQ_METHOD_HANDLER(connection_tune) {
+    const struct rmq_tune_cfg *cfg;
     uint16_t channel_max, heartbeat;
     uint32_t frame_max;
 
@@ -1034,13 +3345,32 @@ RMQ_METHOD_HANDLER(connection_tune) {
     }
 
     /* Response */
-    channel_max = 1; /* We do not support multiplexing for the moment */
+    cfg = &client->tune_cfg;
 
-    rmq_client_send_method(client, RMQ_METHOD_CONNECTION_TUNE_OK,
-                           RMQ_FIELD_SHORT_UINT, channel_max,
-                           RMQ_FIELD_LONG_UINT, frame_max,
-                           RMQ_FIELD_SHORT_UINT, heartbeat,
-                           RMQ_FIELD_END);
+    frame_max = rmq_client_negotiate_tune_value(frame_max, cfg->frame_max);
+    channel_max = (uint16_t)rmq_client_negotiate_tune_value(channel_max,
+                                                            cfg->channel_max);
+
+    if (cfg->disable_heartbeat) {
+        heartbeat = 0;
+    } else {
+        heartbeat = (uint16_t)rmq_client_negotiate_tune_value(heartbeat,
+                                                              cfg->heartbeat);
+    }
+
+    client->frame_max = frame_max;
+    client->channel_max = channel_max;
+
+    rmq_client_trace(client, "frame_max %" PRIu32 ", channel_max %" PRIu16
+                     ", heartbeat %" PRIu16 "s",
+                     frame_max, channel_max, heartbeat);
+
+    rmq_client_send_method_on_channel(client, 0,
+                                      RMQ_METHOD_CONNECTION_TUNE_OK,
+                                      RMQ_FIELD_SHORT_UINT, channel_max,
+                                      RMQ_FIELD_LONG_UINT, frame_max,
+                                      RMQ_FIELD_SHORT_UINT, heartbeat,
+                                      RMQ_FIELD_END);
 
     client->state = RMQ_CLIENT_STATE_TUNE_RECEIVED;
 
@@ -1051,26 +3381,42 @@ RMQ_METHOD_HANDLER(connection_tune) {
         }
     }
 
-    /* Select a vhost */
-    rmq_client_send_method(client, RMQ_METHOD_CONNECTION_OPEN,
-                           RMQ_FIELD_SHORT_STRING, client->vhost,
-                           RMQ_FIELD_SHORT_STRING, "",    /* deprecated */
-                           RMQ_FIELD_SHORT_SHORT_UINT, 0, /* deprecated */
+    /* The server processes methods in order, so there is no need to wait
+     * for each reply: the vhost is selected, the channel is opened and
+     * operations requested before the client was ready are sent in the
+     * same write. If one of these steps fails, the server closes the
+     * connection or the channel and ignores what follows. */
+    rmq_client_send_method_on_channel(client, 0, RMQ_METHOD_CONNECTION_OPEN,
+                                      RMQ_FIELD_SHORT_STRING, client->vhost,
+                                      RMQ_FIELD_SHORT_STRING, "",
+                                      RMQ_FIELD_SHORT_SHORT_UINT, 0,
+                                      RMQ_FIELD_END);
+
+    client->channel_open_sent = true;
+
+    rmq_client_send_method(client, RMQ_METHOD_CHANNEL_OPEN,
+                           RMQ_FIELD_SHORT_STRING, "", /* deprecated */
                            RMQ_FIELD_END);
+
+    if (c_buffer_length(client->pending_wbuf) > 0) {
+        rmq_transport_write(client->transport,
+                            c_buffer_data(client->pending_wbuf),
+                            c_buffer_length(client->pending_wbuf));
+        c_buffer_clear(client->pending_wbuf);
+    }
+
     return 0;
 }
 
 RMQ_METHOD_HANDLER(connection_open_ok) {
+    if (client->state != RMQ_CLIENT_STATE_TUNE_RECEIVED) {
+        c_set_error("unexpected method");
+        return -1;
+    }
+
     client->state = RMQ_CLIENT_STATE_CONNECTION_OPEN;
 
     rmq_client_trace(client, "selected vhost %s", client->vhost);
-
-    /* Open a channel */
-    client->channel = 1;
-
-    rmq_client_send_method(client, RMQ_METHOD_CHANNEL_OPEN,
-                           RMQ_FIELD_SHORT_STRING, "", /* deprecated */
-                           RMQ_FIELD_END);
     return 0;
 }
 
@@ -1117,7 +3463,7 @@ RMQ_METHOD_HANDLER(connection_close) {
     rmq_client_send_method_on_channel(client, 0, RMQ_METHOD_CONNECTION_CLOSE_OK,
                                       RMQ_FIELD_END);
 
-    io_tcp_client_disconnect(client->tcp_client);
+    rmq_transport_disconnect(client->transport);
     return 0;
 }
 
@@ -1129,7 +3475,33 @@ RMQ_METHOD_HANDLER(connection_close_ok) {
 
     client->flow_active = false;
 
-    io_tcp_client_disconnect(client->tcp_client);
+    rmq_transport_disconnect(client->transport);
+    return 0;
+}
+
+RMQ_METHOD_HANDLER(connection_blocked) {
+    char *reason;
+
+    if (rmq_fields_read(data, size, NULL,
+                        RMQ_FIELD_SHORT_STRING, &reason,
+                        RMQ_FIELD_END) == -1) {
+        /* TODO error 505 */
+        c_set_error("invalid arguments: %s", c_get_error());
+        return -1;
+    }
+
+    client->blocked = true;
+
+    rmq_client_signal_event(client, RMQ_CLIENT_EVENT_CONN_BLOCKED, reason);
+
+    c_free(reason);
+    return 0;
+}
+
+RMQ_METHOD_HANDLER(connection_unblocked) {
+    client->blocked = false;
+
+    rmq_client_signal_event(client, RMQ_CLIENT_EVENT_CONN_UNBLOCKED, NULL);
     return 0;
 }
 
@@ -1142,6 +3514,14 @@ RMQ_METHOD_HANDLER(channel_open_ok) {
     client->flow_active = true;
 
     client->state = RMQ_CLIENT_STATE_READY;
+
+    rmq_client_remove_timer(client, &client->handshake_timer);
+
+    /* Spooled publications are sent before anything published from the
+     * event callback. */
+    if (client->spool && !rmq_spool_is_empty(client->spool))
+        rmq_client_replay_spool(client);
+
     rmq_client_signal_event(client, RMQ_CLIENT_EVENT_READY, NULL);
 
     return 0;
@@ -1185,6 +3565,23 @@ RMQ_METHOD_HANDLER(channel_close) {
 
     c_free(reply_text);
 
+    /* If the method which failed is a pending synchronous operation, it is
+     * the first one since operations are processed in order. */
+    if (client->first_op && client->first_op->method == method) {
+        struct rmq_op_result result;
+        struct rmq_op *op;
+
+        op = rmq_client_pop_op(client);
+
+        memset(&result, 0, sizeof(struct rmq_op_result));
+        result.error = error;
+
+        if (op->cb)
+            op->cb(client, &result, op->cb_arg);
+
+        rmq_op_delete(op);
+    }
+
     rmq_client_signal_event(client, RMQ_CLIENT_EVENT_ERROR, error);
 
     rmq_client_send_method(client, RMQ_METHOD_CHANNEL_CLOSE_OK,
@@ -1253,12 +3650,14 @@ RMQ_METHOD_HANDLER(basic_deliver) {
                          (void **)&consumer) == 0) {
         c_set_error("unknown consumer '%s'", consumer_tag);
         c_free(consumer_tag);
+        c_free(exchange);
+        c_free(routing_key);
         return -1;
     }
 
     c_free(consumer_tag);
 
-    rmq_delivery_init(&delivery);
+    rmq_delivery_init(&delivery, client->msg_pool);
 
     delivery.type = RMQ_DELIVERY_TYPE_BASIC_DELIVER;
     delivery.state = RMQ_DELIVERY_STATE_METHOD_RECEIVED;
@@ -1306,7 +3705,7 @@ RMQ_METHOD_HANDLER(basic_return) {
                      reply_code, reply_text, exchange, routing_key);
 #endif
 
-    rmq_delivery_init(&delivery);
+    rmq_delivery_init(&delivery, client->msg_pool);
 
     delivery.type = RMQ_DELIVERY_TYPE_BASIC_RETURN;
     delivery.state = RMQ_DELIVERY_STATE_METHOD_RECEIVED;
@@ -1327,10 +3726,214 @@ RMQ_METHOD_HANDLER(basic_return) {
     return 0;
 }
 
-RMQ_METHOD_HANDLER(queue_unbind_ok) {
+RMQ_METHOD_HANDLER(basic_get_ok) {
+    struct rmq_delivery delivery;
+    struct rmq_get *get;
+    uint64_t delivery_tag;
+    uint32_t message_count;
+    uint8_t flags;
+    char *exchange, *routing_key;
+
+    if (client->has_current_delivery) {
+        c_set_error("delivery already in progress");
+        return -1;
+    }
+
+    if (!client->first_get) {
+        c_set_error("no get request in progress");
+        return -1;
+    }
+
+    if (rmq_fields_read(data, size, NULL,
+                        RMQ_FIELD_LONG_LONG_UINT, &delivery_tag,
+                        RMQ_FIELD_SHORT_SHORT_UINT, &flags,
+                        RMQ_FIELD_SHORT_STRING, &exchange,
+                        RMQ_FIELD_SHORT_STRING, &routing_key,
+                        RMQ_FIELD_LONG_UINT, &message_count,
+                        RMQ_FIELD_END) == -1) {
+        /* TODO error 505 */
+        c_set_error("invalid arguments: %s", c_get_error());
+        return -1;
+    }
+
+    get = rmq_client_pop_get(client);
+
+    rmq_delivery_init(&delivery, client->msg_pool);
+
+    delivery.type = RMQ_DELIVERY_TYPE_BASIC_GET_OK;
+    delivery.state = RMQ_DELIVERY_STATE_METHOD_RECEIVED;
+
+    delivery.u.basic_get_ok.tag = delivery_tag;
+    delivery.u.basic_get_ok.get = get;
+    delivery.u.basic_get_ok.redelivered = (flags & 0x1);
+    delivery.u.basic_get_ok.message_count = message_count;
+
+    delivery.exchange = exchange;
+    delivery.routing_key = routing_key;
+
+    client->current_delivery = delivery;
+    client->has_current_delivery = true;
+
+    return 0;
+}
+
+RMQ_METHOD_HANDLER(basic_get_empty) {
+    struct rmq_get *get;
+    char *cluster_id;
+
+    if (rmq_fields_read(data, size, NULL,
+                        RMQ_FIELD_SHORT_STRING, &cluster_id, /* reserved */
+                        RMQ_FIELD_END) == -1) {
+        /* TODO error 505 */
+        c_set_error("invalid arguments: %s", c_get_error());
+        return -1;
+    }
+
+    c_free(cluster_id);
+
+    get = rmq_client_pop_get(client);
+    if (!get) {
+        c_set_error("no get request in progress");
+        return -1;
+    }
+
+    /* Requests sent for a drain only report the end of the drain */
+    if (!get->drain && get->msg_cb)
+        get->msg_cb(client, NULL, NULL, get->msg_cb_arg);
+
+    rmq_client_on_get_done(client, get, true);
+    return 0;
+}
+
+RMQ_METHOD_HANDLER(basic_qos_ok) {
+    struct rmq_op_result result;
+
+    memset(&result, 0, sizeof(struct rmq_op_result));
+
+    return rmq_client_on_op_reply(client, RMQ_METHOD_BASIC_QOS_OK, &result);
+}
+
+RMQ_METHOD_HANDLER(basic_cancel) {
+    struct rmq_consumer *consumer;
+    char *consumer_tag;
+    uint8_t flags;
+
+    /* Sent by the server when a queue is deleted or fails over */
+    if (rmq_fields_read(data, size, NULL,
+                        RMQ_FIELD_SHORT_STRING, &consumer_tag,
+                        RMQ_FIELD_SHORT_SHORT_UINT, &flags,
+                        RMQ_FIELD_END) == -1) {
+        /* TODO error 505 */
+        c_set_error("invalid arguments: %s", c_get_error());
+        return -1;
+    }
+
+    if (!(flags & 0x01)) {
+        rmq_client_send_method(client, RMQ_METHOD_BASIC_CANCEL_OK,
+                               RMQ_FIELD_SHORT_STRING, consumer_tag,
+                               RMQ_FIELD_END);
+    }
+
+    if (c_hash_table_get(client->consumers_by_tag, consumer_tag,
+                         (void **)&consumer) == 0) {
+        /* The consumer may have been cancelled by the client */
+        c_free(consumer_tag);
+        return 0;
+    }
+
+    c_hash_table_remove(client->consumers_by_tag, consumer->tag);
+    c_hash_table_remove(client->consumers_by_queue, consumer->queue);
+
+    rmq_client_signal_event(client, RMQ_CLIENT_EVENT_CONSUMER_CANCELLED,
+                            consumer->queue);
+
+    rmq_consumer_delete(consumer);
+    c_free(consumer_tag);
     return 0;
 }
 
+RMQ_METHOD_HANDLER(exchange_declare_ok) {
+    struct rmq_op_result result;
+
+    memset(&result, 0, sizeof(struct rmq_op_result));
+
+    return rmq_client_on_op_reply(client, RMQ_METHOD_EXCHANGE_DECLARE_OK,
+                                  &result);
+}
+
+RMQ_METHOD_HANDLER(exchange_delete_ok) {
+    struct rmq_op_result result;
+
+    memset(&result, 0, sizeof(struct rmq_op_result));
+
+    return rmq_client_on_op_reply(client, RMQ_METHOD_EXCHANGE_DELETE_OK,
+                                  &result);
+}
+
+RMQ_METHOD_HANDLER(queue_declare_ok) {
+    struct rmq_op_result result;
+    uint32_t message_count, consumer_count;
+    char *queue;
+    int ret;
+
+    if (rmq_fields_read(data, size, NULL,
+                        RMQ_FIELD_SHORT_STRING, &queue,
+                        RMQ_FIELD_LONG_UINT, &message_count,
+                        RMQ_FIELD_LONG_UINT, &consumer_count,
+                        RMQ_FIELD_END) == -1) {
+        c_set_error("invalid arguments: %s", c_get_error());
+        return -1;
+    }
+
+    memset(&result, 0, sizeof(struct rmq_op_result));
+
+    result.queue = queue;
+    result.message_count = message_count;
+    result.consumer_count = consumer_count;
+
+    ret = rmq_client_on_op_reply(client, RMQ_METHOD_QUEUE_DECLARE_OK,
+                                 &result);
+
+    c_free(queue);
+    return ret;
+}
+
+RMQ_METHOD_HANDLER(queue_bind_ok) {
+    struct rmq_op_result result;
+
+    memset(&result, 0, sizeof(struct rmq_op_result));
+
+    return rmq_client_on_op_reply(client, RMQ_METHOD_QUEUE_BIND_OK, &result);
+}
+
+RMQ_METHOD_HANDLER(queue_delete_ok) {
+    struct rmq_op_result result;
+    uint32_t message_count;
+
+    if (rmq_fields_read(data, size, NULL,
+                        RMQ_FIELD_LONG_UINT, &message_count,
+                        RMQ_FIELD_END) == -1) {
+        c_set_error("invalid arguments: %s", c_get_error());
+        return -1;
+    }
+
+    memset(&result, 0, sizeof(struct rmq_op_result));
+
+    result.message_count = message_count;
+
+    return rmq_client_on_op_reply(client, RMQ_METHOD_QUEUE_DELETE_OK,
+                                  &result);
+}
+
+RMQ_METHOD_HANDLER(queue_unbind_ok) {
+    struct rmq_op_result result;
+
+    memset(&result, 0, sizeof(struct rmq_op_result));
+
+    return rmq_client_on_op_reply(client, RMQ_METHOD_QUEUE_UNBIND_OK,
+                                  &result);
+}
+
 #undef RMQ_METHOD_HANDLER
 
 /* ---------------------------------------------------------------------------
@@ -1377,14 +3980,26 @@ rmq_client_on_method(struct rmq_client *client,
     RMQ_HANDLER(CONNECTION_OPEN_OK, connection_open_ok);
     RMQ_HANDLER(CONNECTION_CLOSE, connection_close);
     RMQ_HANDLER(CONNECTION_CLOSE_OK, connection_close_ok);
+    RMQ_HANDLER(CONNECTION_BLOCKED, connection_blocked);
+    RMQ_HANDLER(CONNECTION_UNBLOCKED, connection_unblocked);
 
     RMQ_HANDLER(CHANNEL_OPEN_OK, channel_open_ok);
     RMQ_HANDLER(CHANNEL_CLOSE, channel_close);
     RMQ_HANDLER(CHANNEL_FLOW_OK, channel_flow_ok);
 
+    RMQ_HANDLER(BASIC_QOS_OK, basic_qos_ok);
+    RMQ_HANDLER(BASIC_CANCEL, basic_cancel);
     RMQ_HANDLER(BASIC_DELIVER, basic_deliver);
     RMQ_HANDLER(BASIC_RETURN, basic_return);
+    RMQ_HANDLER(BASIC_GET_OK, basic_get_ok);
+    RMQ_HANDLER(BASIC_GET_EMPTY, basic_get_empty);
+
+    RMQ_HANDLER(EXCHANGE_DECLARE_OK, exchange_declare_ok);
+    RMQ_HANDLER(EXCHANGE_DELETE_OK, exchange_delete_ok);
 
+    RMQ_HANDLER(QUEUE_DECLARE_OK, queue_declare_ok);
+    RMQ_HANDLER(QUEUE_BIND_OK, queue_bind_ok);
+    RMQ_HANDLER(QUEUE_DELETE_OK, queue_delete_ok);
     RMQ_HANDLER(QUEUE_UNBIND_OK, queue_unbind_ok);
 
 #undef RMQ_HANDLER
@@ -1441,6 +4056,11 @@ rmq_client_on_header(struct rmq_client *client,
         rmq_client_trace(client, "delivery Basic.Return: header");
     }
 #endif
+
+    /* The server does not send any content frame for an empty body */
+    if (delivery->data_size == 0)
+        rmq_client_on_delivery_done(client);
+
     return 0;
 }
 
@@ -1472,7 +4092,27 @@ rmq_client_on_content(struct rmq_client *client,
 #endif
 
     data_sz = delivery->msg->data_sz + frame->size;
-    data = c_realloc(delivery->msg->data, data_sz);
+    if (data_sz > delivery->data_size) {
+        c_set_error("content larger than announced size");
+        return -1;
+    }
+
+    /* Messages taken from the pool may already have a large enough buffer.
+     * Otherwise it grows geometrically up to the announced size; the
+     * announced size is not trusted for a single large allocation. */
+    data = delivery->msg->data;
+    if (delivery->msg->data_capacity < data_sz) {
+        size_t capacity;
+
+        capacity = delivery->msg->data_capacity * 2;
+        if (capacity < data_sz)
+            capacity = data_sz;
+        if (capacity > delivery->data_size)
+            capacity = delivery->data_size;
+
+        data = c_realloc(data, capacity);
+        delivery->msg->data_capacity = capacity;
+    }
 
     memcpy(data + delivery->msg->data_sz, frame->payload, frame->size);
 
@@ -1487,6 +4127,23 @@ rmq_client_on_content(struct rmq_client *client,
         return 0;
     }
 
+    rmq_client_on_delivery_done(client);
+    return 0;
+}
+
+static void
+rmq_client_on_delivery_done(struct rmq_client *client) {
+    struct rmq_delivery *delivery;
+    rmq_msg_cb msg_cb;
+    void *msg_cb_arg;
+    enum rmq_msg_action action;
+    struct rmq_get *get;
+    uint64_t tag;
+
+    delivery = &client->current_delivery;
+
+    rmq_client_decompress_body(client, delivery->msg);
+
 #if 0
     if (delivery->type == RMQ_DELIVERY_TYPE_BASIC_DELIVER) {
         rmq_client_trace(client, "delivery Basic.Deliver %"PRIu64": done",
@@ -1496,51 +4153,68 @@ rmq_client_on_content(struct rmq_client *client,
     }
 #endif
 
+    if (delivery->type == RMQ_DELIVERY_TYPE_BASIC_RETURN) {
+        if (client->undeliverable_msg_cb) {
+            client->undeliverable_msg_cb(client, delivery, delivery->msg,
+                                         client->undeliverable_msg_cb_arg);
+        }
+
+        rmq_delivery_free(&client->current_delivery);
+        client->has_current_delivery = false;
+        return;
+    }
+
+    get = NULL;
+
     if (delivery->type == RMQ_DELIVERY_TYPE_BASIC_DELIVER) {
         struct rmq_consumer *consumer;
-        enum rmq_msg_action action;
-        uint64_t tag;
 
         consumer = delivery->u.basic_deliver.consumer;
 
-        if (consumer->msg_cb) {
-            action = consumer->msg_cb(client, delivery, delivery->msg,
-                                      consumer->msg_cb_arg);
+        msg_cb = consumer->msg_cb;
+        msg_cb_arg = consumer->msg_cb_arg;
+    } else {
+        get = delivery->u.basic_get_ok.get;
+        delivery->u.basic_get_ok.get = NULL;
 
-        } else {
-            action = RMQ_MSG_ACTION_REQUEUE;
-        }
+        msg_cb = get->msg_cb;
+        msg_cb_arg = get->msg_cb_arg;
+    }
 
-        tag = delivery->u.basic_deliver.tag;
+    if (msg_cb) {
+        action = msg_cb(client, delivery, delivery->msg, msg_cb_arg);
+    } else {
+        action = RMQ_MSG_ACTION_REQUEUE;
+    }
 
-        rmq_delivery_free(&client->current_delivery);
-        client->has_current_delivery = false;
+    /* The server considers messages obtained in no-ack mode acknowledged as
+     * soon as they are sent; acknowledging them again would be a channel
+     * error. */
+    if (get && get->no_ack)
+        action = RMQ_MSG_ACTION_NONE;
 
-        switch (action) {
-        case RMQ_MSG_ACTION_NONE:
-            break;
+    tag = rmq_delivery_tag(delivery);
 
-        case RMQ_MSG_ACTION_ACK:
-            rmq_client_ack(client, tag);
-            break;
+    rmq_delivery_free(&client->current_delivery);
+    client->has_current_delivery = false;
 
-        case RMQ_MSG_ACTION_REJECT:
-            rmq_client_reject(client, tag);
-            break;
+    switch (action) {
+    case RMQ_MSG_ACTION_NONE:
+        break;
 
-        case RMQ_MSG_ACTION_REQUEUE:
-            rmq_client_requeue(client, tag);
-            break;
-        }
-    } else if (delivery->type == RMQ_DELIVERY_TYPE_BASIC_RETURN) {
-        if (client->undeliverable_msg_cb) {
-            client->undeliverable_msg_cb(client, delivery, delivery->msg,
-                                         client->undeliverable_msg_cb_arg);
-        }
+    case RMQ_MSG_ACTION_ACK:
+        rmq_client_ack(client, tag);
+        break;
 
-        rmq_delivery_free(&client->current_delivery);
-        client->has_current_delivery = false;
+    case RMQ_MSG_ACTION_REJECT:
+        rmq_client_reject(client, tag);
+        break;
+
+    case RMQ_MSG_ACTION_REQUEUE:
+        rmq_client_requeue(client, tag);
+        break;
     }
 
-    return 0;
+    if (get)
+        rmq_client_on_get_done(client, get, false);
 }
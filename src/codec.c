@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifdef RMQ_WITH_ZLIB
+#   include <zlib.h>
+#endif
+
+#include "internal.h"
+
+/* ---------------------------------------------------------------------------
+ *  Deflate
+ * ------------------------------------------------------------------------ */
+#ifdef RMQ_WITH_ZLIB
+struct rmq_deflate_context {
+    z_stream deflate;
+    z_stream inflate;
+};
+
+static void *rmq_deflate_context_new(void);
+static void rmq_deflate_context_delete(void *);
+static int rmq_deflate_compress(void *, const void *, size_t,
+                                struct c_buffer *);
+static int rmq_deflate_decompress(void *, const void *, size_t, size_t,
+                                  struct c_buffer *);
+
+static const struct rmq_codec rmq_codec_deflate_value = {
+    .encoding = "deflate",
+
+    .new_context = rmq_deflate_context_new,
+    .delete_context = rmq_deflate_context_delete,
+
+    .compress = rmq_deflate_compress,
+    .decompress = rmq_deflate_decompress,
+};
+
+const struct rmq_codec *
+rmq_codec_deflate(void) {
+    return &rmq_codec_deflate_value;
+}
+
+static void *
+rmq_deflate_context_new(void) {
+    struct rmq_deflate_context *context;
+    int ret;
+
+    context = c_malloc0(sizeof(struct rmq_deflate_context));
+
+    ret = deflateInit(&context->deflate, Z_DEFAULT_COMPRESSION);
+    if (ret != Z_OK) {
+        c_set_error("cannot initialize deflate stream: %s",
+                    context->deflate.msg ? context->deflate.msg : "unknown");
+        c_free0(context, sizeof(struct rmq_deflate_context));
+        return NULL;
+    }
+
+    ret = inflateInit(&context->inflate);
+    if (ret != Z_OK) {
+        c_set_error("cannot initialize inflate stream: %s",
+                    context->inflate.msg ? context->inflate.msg : "unknown");
+        deflateEnd(&context->deflate);
+        c_free0(context, sizeof(struct rmq_deflate_context));
+        return NULL;
+    }
+
+    return context;
+}
+
+static void
+rmq_deflate_context_delete(void *arg) {
+    struct rmq_deflate_context *context;
+
+    context = arg;
+    if (!context)
+        return;
+
+    deflateEnd(&context->deflate);
+    inflateEnd(&context->inflate);
+
+    c_free0(context, sizeof(struct rmq_deflate_context));
+}
+
+static int
+rmq_deflate_compress(void *arg, const void *data, size_t size,
+                     struct c_buffer *buf) {
+    struct rmq_deflate_context *context;
+    z_stream *stream;
+    size_t bound;
+    int ret;
+
+    context = arg;
+    stream = &context->deflate;
+
+    if (size > UINT32_MAX) {
+        c_set_error("data too large");
+        return -1;
+    }
+
+    /* Streams are reset instead of being created for each message */
+    deflateReset(stream);
+
+    bound = deflateBound(stream, (uLong)size);
+
+    stream->next_in = (Bytef *)data;
+    stream->avail_in = (uInt)size;
+    stream->next_out = c_buffer_reserve(buf, bound);
+    stream->avail_out = (uInt)bound;
+
+    ret = deflate(stream, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        c_set_error("cannot compress data: %s",
+                    stream->msg ? stream->msg : "unknown");
+        return -1;
+    }
+
+    c_buffer_increase_length(buf, bound - stream->avail_out);
+    return 0;
+}
+
+static int
+rmq_deflate_decompress(void *arg, const void *data, size_t size,
+                       size_t max_size, struct c_buffer *buf) {
+    struct rmq_deflate_context *context;
+    z_stream *stream;
+    size_t total;
+    int ret;
+
+    context = arg;
+    stream = &context->inflate;
+
+    if (size > UINT32_MAX) {
+        c_set_error("data too large");
+        return -1;
+    }
+
+    inflateReset(stream);
+
+    stream->next_in = (Bytef *)data;
+    stream->avail_in = (uInt)size;
+
+    total = 0;
+
+    do {
+        size_t chunk_size;
+
+        if (total >= max_size) {
+            c_set_error("decompressed data larger than %zu bytes", max_size);
+            return -1;
+        }
+
+        chunk_size = size * 4;
+        if (chunk_size < 4096)
+            chunk_size = 4096;
+        if (chunk_size > max_size - total)
+            chunk_size = max_size - total;
+        if (chunk_size > UINT32_MAX)
+            chunk_size = UINT32_MAX;
+
+        stream->next_out = c_buffer_reserve(buf, chunk_size);
+        stream->avail_out = (uInt)chunk_size;
+
+        ret = inflate(stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            if (ret == Z_BUF_ERROR && stream->avail_in == 0) {
+                c_set_error("truncated compressed data");
+            } else {
+                c_set_error("cannot decompress data: %s",
+                            stream->msg ? stream->msg : "invalid data");
+            }
+
+            return -1;
+        }
+
+        c_buffer_increase_length(buf, chunk_size - stream->avail_out);
+        total += chunk_size - stream->avail_out;
+    } while (ret != Z_STREAM_END);
+
+    return 0;
+}
+
+#else
+
+const struct rmq_codec *
+rmq_codec_deflate(void) {
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "internal.h"
+
+static int rmq_handoff_write(int, const void *, size_t);
+static int rmq_handoff_read(int, void *, size_t);
+
+int
+rmq_handoff_send(int sock, int fd, const void *data, size_t size) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    uint8_t header[8];
+    ssize_t ret;
+
+    if (size > RMQ_HANDOFF_MAX_STATE_SIZE) {
+        c_set_error("state too large");
+        return -1;
+    }
+
+    rmq_write_u32(RMQ_HANDOFF_MAGIC, header);
+    rmq_write_u32((uint32_t)size, header + 4);
+
+    /* The socket is sent with the header so that the receiver gets it
+     * before reading the state. */
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+
+    memset(&control, 0, sizeof(control));
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    do {
+        ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        c_set_error("cannot send socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if ((size_t)ret < sizeof(header)) {
+        if (rmq_handoff_write(sock, header + ret,
+                              sizeof(header) - (size_t)ret) == -1) {
+            return -1;
+        }
+    }
+
+    return rmq_handoff_write(sock, data, size);
+}
+
+int
+rmq_handoff_receive(int sock, int *pfd, struct c_buffer *buf) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    uint8_t header[8];
+    uint32_t magic, size;
+    ssize_t ret;
+    int fd;
+
+    iov.iov_base = header;
+    iov.iov_len = sizeof(header);
+
+    memset(&control, 0, sizeof(control));
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        ret = recvmsg(sock, &msg, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1) {
+        c_set_error("cannot receive socket: %s", strerror(errno));
+        return -1;
+    } else if (ret == 0) {
+        c_set_error("connection closed by peer");
+        return -1;
+    }
+
+    fd = -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET
+         && cmsg->cmsg_type == SCM_RIGHTS
+         && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            break;
+        }
+    }
+
+    if (fd == -1) {
+        c_set_error("missing socket");
+        return -1;
+    }
+
+    if ((size_t)ret < sizeof(header)) {
+        if (rmq_handoff_read(sock, header + ret,
+                             sizeof(header) - (size_t)ret) == -1) {
+            goto error;
+        }
+    }
+
+    magic = rmq_read_u32(header);
+    size = rmq_read_u32(header + 4);
+
+    if (magic != RMQ_HANDOFF_MAGIC) {
+        c_set_error("invalid header");
+        goto error;
+    }
+
+    if (size > RMQ_HANDOFF_MAX_STATE_SIZE) {
+        c_set_error("state too large");
+        goto error;
+    }
+
+    if (rmq_handoff_read(sock, c_buffer_reserve(buf, size), size) == -1)
+        goto error;
+    c_buffer_increase_length(buf, size);
+
+    *pfd = fd;
+    return 0;
+
+error:
+    close(fd);
+    return -1;
+}
+
+static int
+rmq_handoff_write(int sock, const void *data, size_t size) {
+    const uint8_t *ptr;
+
+    ptr = data;
+
+    while (size > 0) {
+        ssize_t ret;
+
+        ret = send(sock, ptr, size, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+
+            c_set_error("cannot send state: %s", strerror(errno));
+            return -1;
+        }
+
+        ptr += ret;
+        size -= (size_t)ret;
+    }
+
+    return 0;
+}
+
+static int
+rmq_handoff_read(int sock, void *data, size_t size) {
+    uint8_t *ptr;
+
+    ptr = data;
+
+    while (size > 0) {
+        ssize_t ret;
+
+        ret = recv(sock, ptr, size, 0);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+
+            c_set_error("cannot receive state: %s", strerror(errno));
+            return -1;
+        } else if (ret == 0) {
+            c_set_error("connection closed by peer");
+            return -1;
+        }
+
+        ptr += ret;
+        size -= (size_t)ret;
+    }
+
+    return 0;
+}
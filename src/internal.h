@@ -22,11 +22,25 @@
 #include <inttypes.h>
 #include <string.h>
 
+#include <netdb.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+
 #include "rabbitmq.h"
 
 /* ---------------------------------------------------------------------------
  *  Protocol
  * ------------------------------------------------------------------------ */
+/* Integers */
+uint32_t rmq_read_u32(const uint8_t *);
+uint64_t rmq_read_u64(const uint8_t *);
+
+void rmq_write_u32(uint32_t, uint8_t *);
+void rmq_write_u64(uint64_t, uint8_t *);
+
 /* Decimal */
 struct rmq_decimal {
     uint8_t scale;
@@ -177,6 +191,8 @@ void rmq_properties_set_app_id(struct rmq_properties *, const char *);
 /* Frame */
 #define RMQ_FRAME_END ((uint8_t)0xce)
 
+#define RMQ_FRAME_MIN_SIZE 4096
+
 enum rmq_frame_type {
     RMQ_FRAME_TYPE_METHOD     = 1,
     RMQ_FRAME_TYPE_HEADER     = 2,
@@ -199,8 +215,13 @@ void rmq_frame_init(struct rmq_frame *);
 int rmq_frame_read(struct rmq_frame *, const void *, size_t, size_t *);
 void rmq_frame_write(const struct rmq_frame *, struct c_buffer *);
 
+/* Frames can also be encoded in place: the payload is written to the
+ * buffer between the two calls. */
+size_t rmq_frame_write_start(enum rmq_frame_type, uint16_t, struct c_buffer *);
+void rmq_frame_write_end(size_t, struct c_buffer *);
+
 /* Method */
-#define RMQ_METHOD(class_, id_) (unsigned int)(((class_) << 16) | (id_))
+#define RMQ_METHOD(class_, id_) (((unsigned int)(class_) << 16) | (id_))
 
 enum rmq_class {
     RMQ_CLASS_CONNECTION = 10,
@@ -222,6 +243,8 @@ enum rmq_method {
     RMQ_METHOD_CONNECTION_OPEN_OK   = RMQ_METHOD(RMQ_CLASS_CONNECTION,  41),
     RMQ_METHOD_CONNECTION_CLOSE     = RMQ_METHOD(RMQ_CLASS_CONNECTION,  50),
     RMQ_METHOD_CONNECTION_CLOSE_OK  = RMQ_METHOD(RMQ_CLASS_CONNECTION,  51),
+    RMQ_METHOD_CONNECTION_BLOCKED   = RMQ_METHOD(RMQ_CLASS_CONNECTION,  60),
+    RMQ_METHOD_CONNECTION_UNBLOCKED = RMQ_METHOD(RMQ_CLASS_CONNECTION,  61),
 
     RMQ_METHOD_CHANNEL_OPEN         = RMQ_METHOD(RMQ_CLASS_CHANNEL,  10),
     RMQ_METHOD_CHANNEL_OPEN_OK      = RMQ_METHOD(RMQ_CLASS_CHANNEL,  11),
@@ -305,19 +328,139 @@ enum rmq_unsubscribe_option {
  *  Message
  * ------------------------------------------------------------------------ */
 struct rmq_msg {
+    unsigned int refcount;
+
     struct rmq_properties properties;
 
     void *data;
     size_t data_sz;
+    size_t data_capacity;
     bool data_owned;
+
+    /* Pool the message is returned to when released, if any */
+    struct rmq_msg_pool *pool;
+    struct rmq_msg *next_free;
+
+    /* Header frame payload, encoded the first time the message is published
+     * and reset when properties are modified. */
+    struct c_buffer *header;
+};
+
+const struct c_buffer *rmq_msg_encoded_header(struct rmq_msg *);
+
+/* Message pool; messages in use hold a reference on their pool, so that it
+ * survives the client they were acquired from. */
+struct rmq_msg_pool {
+    unsigned int refcount;
+    bool owned;
+
+    struct rmq_msg *free_msgs;
+    size_t nb_free_msgs;
+
+    size_t max_nb_msgs;
+    size_t max_data_size;
+
+    uint64_t nb_hits;
+    uint64_t nb_misses;
+};
+
+#define RMQ_MSG_POOL_DEFAULT_MAX_NB_MSGS   64
+#define RMQ_MSG_POOL_DEFAULT_MAX_DATA_SIZE (64 * 1024)
+
+struct rmq_msg_pool *rmq_msg_pool_new(size_t, size_t);
+void rmq_msg_pool_delete(struct rmq_msg_pool *);
+
+void rmq_msg_pool_set_limits(struct rmq_msg_pool *, size_t, size_t);
+
+struct rmq_msg *rmq_msg_pool_acquire(struct rmq_msg_pool *);
+void rmq_msg_pool_release(struct rmq_msg_pool *, struct rmq_msg *);
+
+/* ---------------------------------------------------------------------------
+ *  Codec
+ * ------------------------------------------------------------------------ */
+/* Bound on the size of decompressed bodies, so that a small compressed
+ * message cannot exhaust memory. */
+#define RMQ_CODEC_MAX_DECOMPRESSED_SIZE (256 * 1024 * 1024)
+
+struct rmq_codec_instance {
+    const struct rmq_codec *codec;
+    void *context;
+};
+
+/* ---------------------------------------------------------------------------
+ *  Spool
+ * ------------------------------------------------------------------------ */
+/* Append-only file of publications made while the broker is unreachable,
+ * replayed in order once the client is ready again. */
+struct rmq_spool {
+    char *path;
+    int fd;
+
+    uint8_t *data;
+    size_t size;
+
+    uint32_t generation;
+    size_t committed; /* offset of the first record not sent yet */
+    size_t replayed;  /* offset of the first record not replayed yet */
+    size_t end;
+};
+
+struct rmq_spool_record {
+    size_t size;
+
+    const void *method;
+    size_t method_sz;
+    const void *header;
+    size_t header_sz;
+    const void *body;
+    size_t body_sz;
+};
+
+/* Spooled publications are copied to the write buffer until it contains
+ * this many bytes, the rest being replayed by a timer. */
+#define RMQ_SPOOL_REPLAY_CHUNK_SIZE (1024 * 1024)
+#define RMQ_SPOOL_REPLAY_DELAY      10 /* milliseconds */
+
+struct rmq_spool *rmq_spool_open(const char *, size_t);
+void rmq_spool_close(struct rmq_spool *);
+
+bool rmq_spool_is_empty(const struct rmq_spool *);
+bool rmq_spool_is_replayed(const struct rmq_spool *);
+
+int rmq_spool_append(struct rmq_spool *, const void *, size_t,
+                     const void *, size_t, const void *, size_t);
+int rmq_spool_peek(const struct rmq_spool *, struct rmq_spool_record *);
+void rmq_spool_skip(struct rmq_spool *, const struct rmq_spool_record *);
+void rmq_spool_commit(struct rmq_spool *, size_t);
+void rmq_spool_rewind(struct rmq_spool *);
+
+/* ---------------------------------------------------------------------------
+ *  Publish template
+ * ------------------------------------------------------------------------ */
+struct rmq_publish_template {
+    /* Payloads of the method and header frames */
+    struct c_buffer *method;
+    struct c_buffer *header;
+
+    /* Offsets of patchable properties in the header payload, 0 if the
+     * property is not set */
+    size_t timestamp_offset;
+    size_t message_id_offset;
+    size_t message_id_length;
 };
 
+void rmq_publish_template_set_body_size(struct rmq_publish_template *,
+                                        uint64_t);
+void rmq_publish_template_write(struct rmq_publish_template *, uint16_t,
+                                uint64_t, struct c_buffer *);
+
 /* ---------------------------------------------------------------------------
  *  Delivery
  * ------------------------------------------------------------------------ */
 enum rmq_delivery_type {
     RMQ_DELIVERY_TYPE_BASIC_DELIVER,
     RMQ_DELIVERY_TYPE_BASIC_RETURN,
+    RMQ_DELIVERY_TYPE_BASIC_GET_OK,
 };
 
 enum rmq_delivery_state {
@@ -339,6 +482,12 @@ struct rmq_delivery {
             enum rmq_reply_code reply_code;
             char *reply_text;
         } basic_return;
+        struct {
+            uint64_t tag;
+            struct rmq_get *get;
+            bool redelivered;
+            uint32_t message_count;
+        } basic_get_ok;
     } u;
 
     char *exchange;
@@ -348,7 +497,7 @@ struct rmq_delivery {
     size_t data_size;
 };
 
-void rmq_delivery_init(struct rmq_delivery *);
+void rmq_delivery_init(struct rmq_delivery *, struct rmq_msg_pool *);
 void rmq_delivery_free(struct rmq_delivery *);
 
 /* ---------------------------------------------------------------------------
@@ -369,9 +518,471 @@ struct rmq_consumer {
 struct rmq_consumer *rmq_consumer_new(const char *, char *);
 void rmq_consumer_delete(struct rmq_consumer *);
 
+/* ---------------------------------------------------------------------------
+ *  Get
+ * ------------------------------------------------------------------------ */
+struct rmq_get_drain {
+    char *queue;
+    uint8_t options;
+
+    rmq_msg_cb msg_cb;
+    void *msg_cb_arg;
+
+    unsigned int nb_left; /* requests not sent yet */
+    unsigned int nb_in_flight;
+    bool empty;
+};
+
+struct rmq_get_drain *rmq_get_drain_new(const char *, uint8_t, unsigned int,
+                                        rmq_msg_cb, void *);
+void rmq_get_drain_delete(struct rmq_get_drain *);
+
+/* Basic.Get requests are answered in order on the channel, so pending
+ * requests are kept in a FIFO list. */
+struct rmq_get {
+    rmq_msg_cb msg_cb;
+    void *msg_cb_arg;
+
+    /* Messages obtained with RMQ_GET_NO_ACK must not be acknowledged */
+    bool no_ack;
+
+    struct rmq_get_drain *drain;
+
+    struct rmq_get *next;
+};
+
+struct rmq_get *rmq_get_new(rmq_msg_cb, void *);
+void rmq_get_delete(struct rmq_get *);
+
+/* ---------------------------------------------------------------------------
+ *  Timer wheel
+ * ------------------------------------------------------------------------ */
+#define RMQ_TIMER_WHEEL_TICK      10 /* milliseconds */
+#define RMQ_TIMER_WHEEL_SLOT_BITS 6
+#define RMQ_TIMER_WHEEL_NB_SLOTS  (1 << RMQ_TIMER_WHEEL_SLOT_BITS)
+#define RMQ_TIMER_WHEEL_NB_LEVELS 4
+
+/* About 46 hours with 10ms ticks; longer delays are truncated */
+#define RMQ_TIMER_WHEEL_MAX_DELAY                                       \
+    (((UINT64_C(1) << (RMQ_TIMER_WHEEL_SLOT_BITS                        \
+                       * RMQ_TIMER_WHEEL_NB_LEVELS)) - 1)               \
+     * RMQ_TIMER_WHEEL_TICK)
+
+typedef void (*rmq_timer_cb)(void *, uint64_t);
+
+struct rmq_timer {
+    uint64_t expiry; /* tick */
+
+    rmq_timer_cb cb;
+    void *arg;
+    uint64_t value;
+
+    struct rmq_timer **slot;
+    struct rmq_timer *prev;
+    struct rmq_timer *next;
+};
+
+struct rmq_timer_wheel {
+    uint64_t tick;
+
+    struct rmq_timer *slots[RMQ_TIMER_WHEEL_NB_LEVELS]
+                           [RMQ_TIMER_WHEEL_NB_SLOTS];
+    size_t nb_timers;
+
+    struct rmq_timer *free_timers;
+};
+
+void rmq_timer_wheel_init(struct rmq_timer_wheel *, uint64_t);
+void rmq_timer_wheel_free(struct rmq_timer_wheel *);
+
+struct rmq_timer *rmq_timer_wheel_add(struct rmq_timer_wheel *, uint64_t,
+                                      uint64_t, rmq_timer_cb, void *,
+                                      uint64_t);
+void rmq_timer_wheel_remove(struct rmq_timer_wheel *, struct rmq_timer *);
+
+void rmq_timer_wheel_advance(struct rmq_timer_wheel *, uint64_t);
+uint64_t rmq_timer_wheel_next_expiry(const struct rmq_timer_wheel *);
+
+uint64_t rmq_now_ms(void);
+
+/* ---------------------------------------------------------------------------
+ *  RPC
+ * ------------------------------------------------------------------------ */
+#define RMQ_RPC_REPLY_QUEUE "amq.rabbitmq.reply-to"
+
+struct rmq_rpc_call {
+    uint64_t id; /* 0 for a free slot */
+    struct rmq_timer *timer; /* NULL if there is no deadline */
+
+    rmq_rpc_cb cb;
+    void *cb_arg;
+};
+
+struct rmq_rpc_table {
+    struct rmq_rpc_call *calls;
+    size_t size; /* power of two */
+    size_t nb_calls;
+};
+
+void rmq_rpc_table_init(struct rmq_rpc_table *);
+void rmq_rpc_table_free(struct rmq_rpc_table *);
+
+void rmq_rpc_table_insert(struct rmq_rpc_table *,
+                          const struct rmq_rpc_call *);
+int rmq_rpc_table_remove(struct rmq_rpc_table *, uint64_t,
+                         struct rmq_rpc_call *);
+void rmq_rpc_table_remove_all(struct rmq_rpc_table *, struct c_vector *);
+
+/* ---------------------------------------------------------------------------
+ *  Router
+ * ------------------------------------------------------------------------ */
+#define RMQ_ROUTER_MAX_KEY_SIZE 255 /* short string */
+
+struct rmq_route {
+    char *pattern;
+
+    rmq_msg_cb msg_cb;
+    void *msg_cb_arg;
+};
+
+struct rmq_router_node {
+    char *word;
+
+    struct c_hash_table *children; /* word -> node */
+    struct rmq_router_node *star;
+    struct rmq_router_node *hash;
+    bool is_hash; /* set for the "#" child of its parent */
+
+    size_t route; /* index + 1 in the route vector, 0 if none */
+
+    uint64_t mark; /* last matching step the node was active in */
+};
+
+struct rmq_router {
+    struct rmq_router_node *root;
+    struct c_vector *routes; /* struct rmq_route */
+
+    /* Matching state, kept to avoid allocations on each delivery */
+    struct c_ptr_vector *active_nodes;
+    struct c_ptr_vector *next_nodes;
+    uint64_t step;
+
+    rmq_msg_cb default_msg_cb;
+    void *default_msg_cb_arg;
+};
+
+/* ---------------------------------------------------------------------------
+ *  Synchronous operation
+ * ------------------------------------------------------------------------ */
+/* Replies to synchronous methods are sent in order on the channel, so
+ * pending operations are kept in a FIFO list. */
+struct rmq_op {
+    enum rmq_method method;
+    enum rmq_method reply_method;
+
+    rmq_op_cb cb;
+    void *cb_arg;
+
+    struct rmq_op *next;
+};
+
+struct rmq_op *rmq_op_new(enum rmq_method, enum rmq_method,
+                          rmq_op_cb, void *);
+void rmq_op_delete(struct rmq_op *);
+
+/* ---------------------------------------------------------------------------
+ *  Resolver
+ * ------------------------------------------------------------------------ */
+/* getaddrinfo() does not expose the TTL of DNS records, so results are cached
+ * for a fixed duration. Failures are cached for a shorter time so that a
+ * transient error does not prevent reconnection for too long. */
+#define RMQ_RESOLVER_DEFAULT_TTL 60000 /* milliseconds */
+#define RMQ_RESOLVER_NEGATIVE_TTL 5000 /* milliseconds */
+
+/* The address list is NULL if resolution failed, in which case the error is
+ * available with c_get_error(). */
+typedef void (*rmq_resolver_cb)(const char *, uint16_t,
+                                const struct addrinfo *, void *);
+
+struct rmq_resolver_query {
+    char *host;
+    uint16_t port;
+
+    struct addrinfo *res;
+    int error; /* getaddrinfo() error code */
+
+    struct rmq_resolver_query *next;
+};
+
+struct rmq_resolver_entry {
+    char *key; /* <host>:<port> */
+
+    struct addrinfo *res;
+    int error;
+
+    uint64_t expiration; /* milliseconds */
+};
+
+/* Queries are processed by a detached thread started on the first query;
+ * results are sent back to the event loop through a pipe. The state shared
+ * with the thread is freed by the last of the resolver and the thread to
+ * release it, so that deleting the resolver never waits for getaddrinfo(). */
+struct rmq_resolver_worker {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* Protected by the mutex */
+    unsigned int nb_refs;
+    bool stopping;
+    struct rmq_resolver_query *first_query;
+    struct rmq_resolver_query *last_query;
+    struct rmq_resolver_query *first_result;
+    struct rmq_resolver_query *last_result;
+
+    int pipe[2];
+};
+
+struct rmq_resolver {
+    struct io_base *io_base;
+
+    rmq_resolver_cb cb;
+    void *cb_arg;
+
+    struct rmq_resolver_worker *worker; /* NULL until the first query */
+
+    /* The pipe is only watched while queries are running, so that an idle
+     * resolver does not keep the event loop busy. */
+    unsigned int nb_pending_queries;
+
+    struct c_hash_table *cache; /* key -> struct rmq_resolver_entry */
+    uint64_t ttl; /* milliseconds, 0 to disable caching */
+};
+
+struct rmq_resolver *rmq_resolver_new(struct io_base *,
+                                      rmq_resolver_cb, void *);
+void rmq_resolver_delete(struct rmq_resolver *);
+
+void rmq_resolver_set_ttl(struct rmq_resolver *, uint64_t);
+
+int rmq_resolver_lookup(struct rmq_resolver *, const char *, uint16_t,
+                        const struct addrinfo **);
+int rmq_resolver_resolve(struct rmq_resolver *, const char *, uint16_t);
+
+/* ---------------------------------------------------------------------------
+ *  Transport
+ * ------------------------------------------------------------------------ */
+#define RMQ_TRANSPORT_READ_SIZE (64 * 1024)
+
+/* Maximum duration of the TLS handshake; a server which accepts connections
+ * but never answers would otherwise block the connection forever. */
+#define RMQ_TRANSPORT_TLS_HANDSHAKE_TIMEOUT 10000 /* milliseconds */
+
+#define RMQ_TRANSPORT_DEFAULT_MAX_BUFFER_SIZE (16 * 1024 * 1024)
+
+/* Maximum number of connection attempts running in parallel, and delay
+ * before starting a new one while the previous ones are still running */
+#define RMQ_TRANSPORT_MAX_ATTEMPTS 4
+#define RMQ_TRANSPORT_ATTEMPT_DELAY 250 /* milliseconds */
+
+/* Maximum duration of a connection attempt; the system timeout can be
+ * several minutes long when packets are dropped. */
+#define RMQ_TRANSPORT_CONNECT_TIMEOUT 10000 /* milliseconds */
+
+/* Delay before an endpoint is used again after a failure, doubled after
+ * each consecutive failure */
+#define RMQ_TRANSPORT_MIN_BACKOFF 1000 /* milliseconds */
+#define RMQ_TRANSPORT_MAX_BACKOFF 60000 /* milliseconds */
+
+enum rmq_transport_state {
+    RMQ_TRANSPORT_STATE_DISCONNECTED,
+    RMQ_TRANSPORT_STATE_CONNECTING,
+    RMQ_TRANSPORT_STATE_TLS_HANDSHAKE,
+    RMQ_TRANSPORT_STATE_CONNECTED,
+    RMQ_TRANSPORT_STATE_DISCONNECTING,
+};
+
+enum rmq_transport_event {
+    RMQ_TRANSPORT_EVENT_CONN_ESTABLISHED,
+    RMQ_TRANSPORT_EVENT_CONN_FAILED,
+    RMQ_TRANSPORT_EVENT_CONN_CLOSED,
+    RMQ_TRANSPORT_EVENT_ERROR,
+    RMQ_TRANSPORT_EVENT_DATA_READ,
+};
+
+struct rmq_transport;
+
+struct rmq_transport_endpoint {
+    char *host;
+    uint16_t port;
+    char *path; /* unix socket */
+
+    /* The last session negotiated with the endpoint, used to resume the
+     * session on the next connection. */
+    SSL_SESSION *ssl_session;
+
+    unsigned int nb_failures;
+    uint64_t retry_time; /* milliseconds */
+
+    /* Set while the address of the endpoint is being resolved for the
+     * current connection */
+    bool resolving;
+};
+
+struct rmq_transport_address {
+    size_t endpoint;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+};
+
+struct rmq_transport_attempt {
+    struct rmq_transport *transport;
+
+    size_t endpoint;
+    int sock; /* -1 if the attempt is not running */
+    int timer;
+};
+
+typedef void (*rmq_transport_event_cb)(struct rmq_transport *,
+                                       enum rmq_transport_event, void *);
+
+struct rmq_transport {
+    struct io_base *io_base;
+
+    enum rmq_transport_state state;
+
+    int sock;
+    uint32_t events; /* enum io_fd_event */
+
+    struct c_vector *endpoints; /* struct rmq_transport_endpoint */
+    size_t endpoint; /* current endpoint, or the next one to try */
+
+    struct c_vector *addresses; /* struct rmq_transport_address */
+    size_t next_address;
+
+    struct rmq_resolver *resolver;
+    size_t nb_resolving_endpoints;
+
+    struct rmq_transport_attempt attempts[RMQ_TRANSPORT_MAX_ATTEMPTS];
+    int attempt_timer;
+
+    struct rmq_socket_cfg socket_cfg;
+
+    struct c_buffer *rbuf;
+    struct c_buffer *wbuf;
+
+    rmq_transport_event_cb event_cb;
+    void *event_cb_arg;
+
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;
+    char *ssl_server_name;
+    bool ssl_verify;
+    int handshake_timer;
+
+    /* Kernel TLS offload, set once the handshake is done */
+    bool ktls_send;
+    bool ktls_recv;
+
+    /* Statistics used to size socket buffers */
+    uint64_t nb_bytes_sent;
+    uint64_t nb_bytes_received;
+
+    uint64_t tuning_time; /* milliseconds */
+    uint64_t tuning_nb_bytes_sent;
+    uint64_t tuning_nb_bytes_received;
+
+    uint32_t send_buffer_size;
+    uint32_t receive_buffer_size;
+};
+
+struct rmq_transport *rmq_transport_new(struct io_base *,
+                                        rmq_transport_event_cb, void *);
+void rmq_transport_delete(struct rmq_transport *);
+
+int rmq_transport_enable_tls(struct rmq_transport *,
+                             const struct rmq_tls_cfg *);
+
+void rmq_transport_set_socket_cfg(struct rmq_transport *,
+                                  const struct rmq_socket_cfg *);
+void rmq_transport_set_dns_cache_ttl(struct rmq_transport *, uint64_t);
+
+int rmq_transport_connect(struct rmq_transport *, const char *, uint16_t);
+int rmq_transport_connect_unix(struct rmq_transport *, const char *);
+int rmq_transport_connect_endpoints(struct rmq_transport *,
+                                    const struct rmq_endpoint *, size_t);
+int rmq_transport_attach(struct rmq_transport *, int,
+                         const struct rmq_endpoint *, size_t, size_t);
+int rmq_transport_detach(struct rmq_transport *);
+int rmq_transport_reconnect(struct rmq_transport *);
+void rmq_transport_disconnect(struct rmq_transport *);
+void rmq_transport_close(struct rmq_transport *);
+
+bool rmq_transport_is_connected(const struct rmq_transport *);
+bool rmq_transport_is_tls_session_reused(const struct rmq_transport *);
+
+void rmq_transport_tune_buffers(struct rmq_transport *, uint64_t);
+
+struct c_buffer *rmq_transport_rbuf(const struct rmq_transport *);
+struct c_buffer *rmq_transport_wbuf(const struct rmq_transport *);
+void rmq_transport_signal_data_written(struct rmq_transport *);
+void rmq_transport_write(struct rmq_transport *, const void *, size_t);
+
+/* ---------------------------------------------------------------------------
+ *  URI
+ * ------------------------------------------------------------------------ */
+struct rmq_uri {
+    bool tls;
+
+    char *user;     /* NULL if not set */
+    char *password; /* NULL if not set */
+
+    char *host;
+    uint16_t port;
+
+    char *vhost;    /* NULL if not set */
+
+    /* Only fields set by query parameters are modified */
+    struct rmq_tune_cfg tune_cfg;
+
+    /* Names of the query parameters which are not supported, NULL if there
+     * is none */
+    struct c_ptr_vector *ignored_parameters;
+};
+
+void rmq_uri_init(struct rmq_uri *);
+void rmq_uri_free(struct rmq_uri *);
+
+int rmq_uri_parse(struct rmq_uri *, const char *);
+
+size_t rmq_uri_nb_ignored_parameters(const struct rmq_uri *);
+const char *rmq_uri_ignored_parameter(const struct rmq_uri *, size_t);
+
+/* ---------------------------------------------------------------------------
+ *  Handoff
+ * ------------------------------------------------------------------------ */
+#define RMQ_HANDOFF_MAGIC 0x524d5148 /* "RMQH" */
+
+#define RMQ_HANDOFF_VERSION 1
+
+#define RMQ_HANDOFF_MAX_STATE_SIZE (64 * 1024 * 1024)
+
+int rmq_handoff_send(int, int, const void *, size_t);
+int rmq_handoff_receive(int, int *, struct c_buffer *);
+
 /* ---------------------------------------------------------------------------
  *  Client
  * ------------------------------------------------------------------------ */
+/* Delay between the establishment of the connection and the opening of the
+ * channel */
+#define RMQ_CLIENT_HANDSHAKE_TIMEOUT 10000 /* milliseconds */
+
+/* Channel used for all operations */
+#define RMQ_CLIENT_CHANNEL 1
+
+/* Interval between two adjustments of socket buffer sizes */
+#define RMQ_CLIENT_BUFFER_TUNING_INTERVAL 1000 /* milliseconds */
+
 enum rmq_client_state {
     RMQ_CLIENT_STATE_DISCONNECTED,
     RMQ_CLIENT_STATE_CONNECTED,
@@ -384,7 +995,7 @@ enum rmq_client_state {
 
 struct rmq_client {
     struct io_base *io_base;
-    struct io_tcp_client *tcp_client;
+    struct rmq_transport *transport;
 
     enum rmq_client_state state;
 
@@ -403,16 +1014,64 @@ struct rmq_client {
 
     uint16_t channel;
 
+    /* Frames sent on the channel before Channel.Open are buffered, and
+     * written right after it during the handshake. */
+    struct c_buffer *pending_wbuf;
+    bool channel_open_sent;
+
     struct c_hash_table *consumers_by_tag;
     struct c_hash_table *consumers_by_queue;
     int consumer_tag_id;
 
+    struct rmq_get *first_get;
+    struct rmq_get *last_get;
+
+    struct rmq_op *first_op;
+    struct rmq_op *last_op;
+
+    struct rmq_msg_pool *msg_pool;
+
+    struct c_vector *codecs; /* struct rmq_codec_instance */
+    const struct rmq_codec *compression_codec;
+    size_t compression_threshold;
+    struct c_buffer *codec_buf;
+
+    struct rmq_spool *spool;
+    struct c_buffer *spool_buf;
+    struct rmq_timer *spool_timer;
+
+    struct rmq_rpc_table rpc_calls;
+    uint64_t last_rpc_id;
+    bool rpc_consuming;
+
     bool has_current_delivery;
     struct rmq_delivery current_delivery;
 
-    int heartbeat_timer;
+    struct rmq_tune_cfg tune_cfg;
+
+    /* Negotiated with the server */
+    uint32_t frame_max;
+    uint16_t channel_max;
+
+    struct rmq_timer_wheel timer_wheel;
+    int timer_wheel_timer;
+    uint64_t timer_wheel_expiry; /* tick */
+
+    struct rmq_timer *handshake_timer;
+
+    struct rmq_timer *heartbeat_timer;
+    uint64_t heartbeat_delay; /* milliseconds */
+
+    struct rmq_timer *buffer_tuning_timer;
 
     bool flow_active;
+    bool blocked;
+
+    /* Sent by the server in Connection.Start */
+    struct rmq_field_table *server_properties;
+    char *server_product;
+    char *server_version;
+    uint32_t server_capabilities; /* enum rmq_capability */
 };
 
 void rmq_client_send_frame(struct rmq_client *, enum rmq_frame_type,
@@ -426,6 +1085,8 @@ void rmq_client_send_header(struct rmq_client *, uint16_t, uint64_t,
                             const struct rmq_properties *);
 void rmq_client_send_body(struct rmq_client *, const void *, size_t);
 
+void rmq_client_process_data(struct rmq_client *, struct c_buffer *);
+
 void rmq_client_connection_close(struct rmq_client *,
                                  enum rmq_reply_code, const char *, ...)
     __attribute__ ((format(printf, 3, 4)));
@@ -168,6 +168,8 @@ rmq_msg_new(void) {
 
     msg = c_malloc0(sizeof(struct rmq_msg));
 
+    msg->refcount = 1;
+
     rmq_properties_init(&msg->properties);
 
     return msg;
@@ -175,10 +177,33 @@ rmq_msg_new(void) {
 
 void
 rmq_msg_delete(struct rmq_msg *msg) {
+    rmq_msg_unref(msg);
+}
+
+struct rmq_msg *
+rmq_msg_ref(struct rmq_msg *msg) {
+    msg->refcount++;
+    return msg;
+}
+
+void
+rmq_msg_unref(struct rmq_msg *msg) {
     if (!msg)
         return;
 
+    assert(msg->refcount > 0);
+
+    msg->refcount--;
+    if (msg->refcount > 0)
+        return;
+
+    if (msg->pool) {
+        rmq_msg_pool_release(msg->pool, msg);
+        return;
+    }
+
     rmq_properties_free(&msg->properties);
+    c_buffer_delete(msg->header);
 
     if (msg->data_owned)
         c_free(msg->data);
@@ -186,6 +211,33 @@ rmq_msg_delete(struct rmq_msg *msg) {
     c_free0(msg, sizeof(struct rmq_msg));
 }
 
+const struct c_buffer *
+rmq_msg_encoded_header(struct rmq_msg *msg) {
+    struct rmq_header_frame header_frame;
+
+    if (!msg->header) {
+        rmq_header_frame_init(&header_frame);
+
+        header_frame.class_id = RMQ_CLASS_BASIC;
+        header_frame.body_size = 0;
+        header_frame.properties = &msg->properties;
+
+        msg->header = c_buffer_new();
+        rmq_header_frame_write(&header_frame, msg->header);
+    }
+
+    /* The body size follows the class id and the weight */
+    rmq_write_u64(msg->data_sz, (uint8_t *)c_buffer_data(msg->header) + 4);
+
+    return msg->header;
+}
+
+static void
+rmq_msg_reset_encoded_header(struct rmq_msg *msg) {
+    c_buffer_delete(msg->header);
+    msg->header = NULL;
+}
+
 const char *
 rmq_msg_content_type(const struct rmq_msg *msg) {
     return msg->properties.content_type;
@@ -256,67 +308,80 @@ rmq_msg_app_id(const struct rmq_msg *msg) {
 
 void
 rmq_msg_set_content_type(struct rmq_msg *msg, const char *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_content_type(&msg->properties, value);
 }
 
 void
 rmq_msg_set_content_encoding(struct rmq_msg *msg, const char *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_content_encoding(&msg->properties, value);
 }
 
 void
 rmq_msg_add_header_nocopy(struct rmq_msg *msg,
                              const char *name, struct rmq_field *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_add_header_nocopy(&msg->properties, name, value);
 }
 
 void
 rmq_msg_set_delivery_mode(struct rmq_msg *msg, enum rmq_delivery_mode value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_delivery_mode(&msg->properties, value);
 }
 
 void
 rmq_msg_set_priority(struct rmq_msg *msg, uint8_t value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_priority(&msg->properties, value);
 }
 
 void
 rmq_msg_set_correlation_id(struct rmq_msg *msg, const char *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_correlation_id(&msg->properties, value);
 }
 
 void
 rmq_msg_set_reply_to(struct rmq_msg *msg, const char *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_reply_to(&msg->properties, value);
 }
 
 void
 rmq_msg_set_expiration(struct rmq_msg *msg, const char *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_expiration(&msg->properties, value);
 }
 
 void
 rmq_msg_set_message_id(struct rmq_msg *msg, const char *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_message_id(&msg->properties, value);
 }
 
 void
 rmq_msg_set_timestamp(struct rmq_msg *msg, uint64_t value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_timestamp(&msg->properties, value);
 }
 
 void
 rmq_msg_set_type(struct rmq_msg *msg, const char *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_type(&msg->properties, value);
 }
 
 void
 rmq_msg_set_user_id(struct rmq_msg *msg, const char *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_user_id(&msg->properties, value);
 }
 
 void
 rmq_msg_set_app_id(struct rmq_msg *msg, const char *value) {
+    rmq_msg_reset_encoded_header(msg);
     rmq_properties_set_app_id(&msg->properties, value);
 }
 
@@ -333,15 +398,152 @@ rmq_msg_set_data_nocopy(struct rmq_msg *msg, void *data, size_t size) {
 
     msg->data = data;
     msg->data_sz = size;
+    msg->data_capacity = size;
     msg->data_owned = true;
 }
 
 void
 rmq_msg_set_data(struct rmq_msg *msg, const void *data, size_t size) {
+    /* Reuse the current buffer if it is large enough, which is usually the
+     * case for messages taken from a pool. */
+    if (msg->data_owned && msg->data_capacity >= size) {
+        if (size > 0)
+            memcpy(msg->data, data, size);
+        msg->data_sz = size;
+        return;
+    }
+
     if (msg->data_owned)
         c_free(msg->data);
 
     msg->data = c_memdup(data, size);
     msg->data_sz = size;
+    msg->data_capacity = size;
     msg->data_owned = true;
 }
+
+/* ---------------------------------------------------------------------------
+ *  Message pool
+ * ------------------------------------------------------------------------ */
+struct rmq_msg_pool *
+rmq_msg_pool_new(size_t max_nb_msgs, size_t max_data_size) {
+    struct rmq_msg_pool *pool;
+
+    pool = c_malloc0(sizeof(struct rmq_msg_pool));
+
+    pool->refcount = 1;
+    pool->owned = true;
+
+    pool->max_nb_msgs = max_nb_msgs;
+    pool->max_data_size = max_data_size;
+
+    return pool;
+}
+
+static void
+rmq_msg_pool_unref(struct rmq_msg_pool *pool) {
+    assert(pool->refcount > 0);
+
+    pool->refcount--;
+    if (pool->refcount > 0)
+        return;
+
+    assert(!pool->free_msgs);
+
+    c_free0(pool, sizeof(struct rmq_msg_pool));
+}
+
+static void
+rmq_msg_pool_clear(struct rmq_msg_pool *pool) {
+    while (pool->free_msgs) {
+        struct rmq_msg *msg;
+
+        msg = pool->free_msgs;
+        pool->free_msgs = msg->next_free;
+        pool->nb_free_msgs--;
+
+        /* Free messages do not hold any reference on the pool */
+        msg->pool = NULL;
+        msg->refcount = 1;
+        rmq_msg_unref(msg);
+    }
+}
+
+void
+rmq_msg_pool_delete(struct rmq_msg_pool *pool) {
+    if (!pool)
+        return;
+
+    /* Messages still in use keep the pool alive; they are freed instead
+     * of being returned to the pool once released. */
+    pool->owned = false;
+
+    rmq_msg_pool_clear(pool);
+    rmq_msg_pool_unref(pool);
+}
+
+void
+rmq_msg_pool_set_limits(struct rmq_msg_pool *pool,
+                        size_t max_nb_msgs, size_t max_data_size) {
+    pool->max_nb_msgs = max_nb_msgs;
+    pool->max_data_size = max_data_size;
+
+    rmq_msg_pool_clear(pool);
+}
+
+struct rmq_msg *
+rmq_msg_pool_acquire(struct rmq_msg_pool *pool) {
+    struct rmq_msg *msg;
+
+    if (pool->free_msgs) {
+        msg = pool->free_msgs;
+        pool->free_msgs = msg->next_free;
+        pool->nb_free_msgs--;
+
+        msg->next_free = NULL;
+        msg->refcount = 1;
+
+        pool->nb_hits++;
+    } else {
+        msg = rmq_msg_new();
+        msg->pool = pool;
+
+        pool->nb_misses++;
+    }
+
+    pool->refcount++;
+    return msg;
+}
+
+void
+rmq_msg_pool_release(struct rmq_msg_pool *pool, struct rmq_msg *msg) {
+    assert(msg->pool == pool);
+    assert(msg->refcount == 0);
+
+    if (!pool->owned || pool->nb_free_msgs >= pool->max_nb_msgs) {
+        msg->pool = NULL;
+        msg->refcount = 1;
+        rmq_msg_unref(msg);
+    } else {
+        rmq_properties_free(&msg->properties);
+        rmq_msg_reset_encoded_header(msg);
+
+        /* Keep the body buffer unless it is too large */
+        if (!msg->data_owned || msg->data_capacity > pool->max_data_size) {
+            if (msg->data_owned)
+                c_free(msg->data);
+
+            msg->data = NULL;
+            msg->data_capacity = 0;
+            msg->data_owned = false;
+        }
+
+        msg->data_sz = 0;
+
+        msg->next_free = pool->free_msgs;
+        pool->free_msgs = msg;
+        pool->nb_free_msgs++;
+    }
+
+    rmq_msg_pool_unref(pool);
+}
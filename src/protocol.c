@@ -18,13 +18,23 @@
 
 static uint8_t rmq_read_u8(const uint8_t *);
 static uint16_t rmq_read_u16(const uint8_t *);
-static uint32_t rmq_read_u32(const uint8_t *);
-static uint64_t rmq_read_u64(const uint8_t *);
 
 static void rmq_write_u8(uint8_t, uint8_t *);
 static void rmq_write_u16(uint16_t, uint8_t *);
-static void rmq_write_u32(uint32_t, uint8_t *);
-static void rmq_write_u64(uint64_t, uint8_t *);
+
+/* Arrays and tables can contain arrays and tables; nesting is bounded so that
+ * a malicious peer cannot exhaust the stack. */
+#define RMQ_FIELD_MAX_DEPTH 32
+
+static int rmq_field_read_array_nested(const void *, size_t, unsigned int,
+                                       struct c_ptr_vector **, size_t *);
+static int rmq_field_read_table_nested(const void *, size_t, unsigned int,
+                                       struct rmq_field_table **, size_t *);
+static struct rmq_field *rmq_field_read_nested(const void *, size_t,
+                                               enum rmq_field_type,
+                                               unsigned int, size_t *);
+static struct rmq_field *rmq_field_read_tagged_nested(const void *, size_t,
+                                                      unsigned int, size_t *);
 
 /* ---------------------------------------------------------------------------
  *  Long string
@@ -116,6 +126,9 @@ rmq_field_delete(struct rmq_field *field) {
         break;
 
     case RMQ_FIELD_ARRAY:
+        if (!field->u.array)
+            break;
+
         for (size_t i = 0; i < c_ptr_vector_length(field->u.array); i++)
             rmq_field_delete(c_ptr_vector_entry(field->u.array, i));
         c_ptr_vector_delete(field->u.array);
@@ -487,7 +500,7 @@ rmq_field_read_short_int(const void *data, size_t size,
     ptr = data;
     len = size;
 
-    if (len < 1) {
+    if (len < 2) {
         c_set_error("truncated short int");
         return -1;
     }
@@ -510,7 +523,7 @@ rmq_field_read_short_uint(const void *data, size_t size,
     ptr = data;
     len = size;
 
-    if (len < 1) {
+    if (len < 2) {
         c_set_error("truncated short uint");
         return -1;
     }
@@ -533,7 +546,7 @@ rmq_field_read_long_int(const void *data, size_t size,
     ptr = data;
     len = size;
 
-    if (len < 1) {
+    if (len < 4) {
         c_set_error("truncated long int");
         return -1;
     }
@@ -556,7 +569,7 @@ rmq_field_read_long_uint(const void *data, size_t size,
     ptr = data;
     len = size;
 
-    if (len < 1) {
+    if (len < 4) {
         c_set_error("truncated long uint");
         return -1;
     }
@@ -579,7 +592,7 @@ rmq_field_read_long_long_int(const void *data, size_t size,
     ptr = data;
     len = size;
 
-    if (len < 1) {
+    if (len < 8) {
         c_set_error("truncated long long int");
         return -1;
     }
@@ -602,7 +615,7 @@ rmq_field_read_long_long_uint(const void *data, size_t size,
     ptr = data;
     len = size;
 
-    if (len < 1) {
+    if (len < 8) {
         c_set_error("truncated long long uint");
         return -1;
     }
@@ -742,6 +755,12 @@ rmq_field_read_long_string(const void *data, size_t size,
 int
 rmq_field_read_array(const void *data, size_t size,
                      struct c_ptr_vector **pfields, size_t *psz) {
+    return rmq_field_read_array_nested(data, size, 0, pfields, psz);
+}
+
+static int
+rmq_field_read_array_nested(const void *data, size_t size, unsigned int depth,
+                            struct c_ptr_vector **pfields, size_t *psz) {
     const uint8_t *ptr;
     size_t len;
     struct c_ptr_vector *fields;
@@ -750,6 +769,11 @@ rmq_field_read_array(const void *data, size_t size,
     ptr = data;
     len = size;
 
+    if (depth >= RMQ_FIELD_MAX_DEPTH) {
+        c_set_error("too many nested arrays and tables");
+        return -1;
+    }
+
     if (len < 4) {
         c_set_error("truncated array size");
         return -1;
@@ -760,6 +784,11 @@ rmq_field_read_array(const void *data, size_t size,
     ptr += 4;
     len -= 4;
 
+    if (len < content_size) {
+        c_set_error("truncated array");
+        return -1;
+    }
+
     fields = c_ptr_vector_new();
 
     rest = content_size;
@@ -767,7 +796,8 @@ rmq_field_read_array(const void *data, size_t size,
         struct rmq_field *field;
         size_t value_size;
 
-        field = rmq_field_read_tagged(ptr, len, &value_size);
+        field = rmq_field_read_tagged_nested(ptr, rest, depth + 1,
+                                             &value_size);
         if (!field) {
             for (size_t i = 0; i < c_ptr_vector_length(fields); i++)
                 rmq_field_delete(c_ptr_vector_entry(fields, i));
@@ -798,7 +828,7 @@ rmq_field_read_timestamp(const void *data, size_t size,
     ptr = data;
     len = size;
 
-    if (len < 1) {
+    if (len < 8) {
         c_set_error("truncated timestamp");
         return -1;
     }
@@ -815,6 +845,12 @@ rmq_field_read_timestamp(const void *data, size_t size,
 int
 rmq_field_read_table(const void *data, size_t size,
                      struct rmq_field_table **pvalue, size_t *psz) {
+    return rmq_field_read_table_nested(data, size, 0, pvalue, psz);
+}
+
+static int
+rmq_field_read_table_nested(const void *data, size_t size, unsigned int depth,
+                            struct rmq_field_table **pvalue, size_t *psz) {
     const uint8_t *ptr;
     size_t len;
     struct rmq_field_table *table;
@@ -823,6 +859,11 @@ rmq_field_read_table(const void *data, size_t size,
     ptr = data;
     len = size;
 
+    if (depth >= RMQ_FIELD_MAX_DEPTH) {
+        c_set_error("too many nested arrays and tables");
+        return -1;
+    }
+
     if (len < 4) {
         c_set_error("missing table size");
         return -1;
@@ -833,6 +874,11 @@ rmq_field_read_table(const void *data, size_t size,
     ptr += 4;
     len -= 4;
 
+    if (len < content_size) {
+        c_set_error("truncated table");
+        return -1;
+    }
+
     table = rmq_field_table_new();
 
     rest = content_size;
@@ -851,7 +897,8 @@ rmq_field_read_table(const void *data, size_t size,
         rest -= value_size;
 
         /* Value */
-        value = rmq_field_read_tagged(ptr, rest, &value_size);
+        value = rmq_field_read_tagged_nested(ptr, rest, depth + 1,
+                                             &value_size);
         if (!value) {
             c_free(name);
             rmq_field_table_delete(table);
@@ -1055,6 +1102,12 @@ rmq_field_write_no_value(struct c_buffer *buf) {
 struct rmq_field *
 rmq_field_read(const void *data, size_t size,
                enum rmq_field_type type, size_t *psz) {
+    return rmq_field_read_nested(data, size, type, 0, psz);
+}
+
+static struct rmq_field *
+rmq_field_read_nested(const void *data, size_t size, enum rmq_field_type type,
+                      unsigned int depth, size_t *psz) {
     struct rmq_field *field;
     int ret;
 
@@ -1124,7 +1177,8 @@ rmq_field_read(const void *data, size_t size,
         break;
 
     case RMQ_FIELD_ARRAY:
-        ret = rmq_field_read_array(data, size, &field->u.array, psz);
+        ret = rmq_field_read_array_nested(data, size, depth,
+                                          &field->u.array, psz);
         break;
 
     case RMQ_FIELD_TIMESTAMP:
@@ -1132,7 +1186,8 @@ rmq_field_read(const void *data, size_t size,
         break;
 
     case RMQ_FIELD_TABLE:
-        ret = rmq_field_read_table(data, size, &field->u.table, psz);
+        ret = rmq_field_read_table_nested(data, size, depth,
+                                          &field->u.table, psz);
         break;
 
     case RMQ_FIELD_NO_VALUE:
@@ -1227,6 +1282,12 @@ rmq_field_write(const struct rmq_field *field, struct c_buffer *buf) {
 
 struct rmq_field *
 rmq_field_read_tagged(const void *data, size_t size, size_t *psz) {
+    return rmq_field_read_tagged_nested(data, size, 0, psz);
+}
+
+static struct rmq_field *
+rmq_field_read_tagged_nested(const void *data, size_t size,
+                             unsigned int depth, size_t *psz) {
     struct rmq_field *field;
     const uint8_t *ptr;
     size_t len;
@@ -1249,100 +1310,110 @@ rmq_field_read_tagged(const void *data, size_t size, size_t *psz) {
     switch (tag) {
     case 't':
         /* Boolean */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_BOOLEAN, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_BOOLEAN,
+                                      depth, &value_size);
         break;
 
     case 'b':
         /* Short short int*/
-        field = rmq_field_read(ptr, len, RMQ_FIELD_SHORT_SHORT_INT,
-                               &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_SHORT_SHORT_INT,
+                                      depth, &value_size);
         break;
 
     case 'B':
         /* Short short uint*/
-        field = rmq_field_read(ptr, len, RMQ_FIELD_SHORT_SHORT_UINT,
-                               &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_SHORT_SHORT_UINT,
+                                      depth, &value_size);
         break;
 
     case 'U':
         /* Short int*/
-        field = rmq_field_read(ptr, len, RMQ_FIELD_SHORT_INT,
-                               &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_SHORT_INT,
+                                      depth, &value_size);
         break;
 
     case 'u':
         /* Short uint*/
-        field = rmq_field_read(ptr, len, RMQ_FIELD_SHORT_UINT,
-                               &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_SHORT_UINT,
+                                      depth, &value_size);
         break;
 
     case 'I':
         /* Long int */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_LONG_INT,
-                               &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_LONG_INT,
+                                      depth, &value_size);
         break;
 
     case 'i':
         /* Long uint */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_LONG_UINT,
-                               &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_LONG_UINT,
+                                      depth, &value_size);
         break;
 
     case 'L':
         /* Long long int */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_LONG_LONG_INT,
-                               &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_LONG_LONG_INT,
+                                      depth, &value_size);
         break;
 
     case 'l':
         /* Long long uint */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_LONG_LONG_UINT,
-                               &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_LONG_LONG_UINT,
+                                      depth, &value_size);
         break;
 
     case 'f':
         /* Float */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_FLOAT, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_FLOAT,
+                                      depth, &value_size);
         break;
 
     case 'd':
         /* Double */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_DOUBLE, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_DOUBLE,
+                                      depth, &value_size);
         break;
 
     case 'D':
         /* Decimal */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_DECIMAL, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_DECIMAL,
+                                      depth, &value_size);
         break;
 
     case 's':
         /* Short string */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_SHORT_STRING, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_SHORT_STRING,
+                                      depth, &value_size);
         break;
 
     case 'S':
         /* Long string */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_LONG_STRING, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_LONG_STRING,
+                                      depth, &value_size);
         break;
 
     case 'A':
         /* Array */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_ARRAY, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_ARRAY,
+                                      depth, &value_size);
         break;
 
     case 'T':
         /* Timestamp */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_TIMESTAMP, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_TIMESTAMP,
+                                      depth, &value_size);
         break;
 
     case 'F':
         /* Table */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_TABLE, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_TABLE,
+                                      depth, &value_size);
         break;
 
     case 'V':
         /* No value */
-        field = rmq_field_read(ptr, len, RMQ_FIELD_NO_VALUE, &value_size);
+        field = rmq_field_read_nested(ptr, len, RMQ_FIELD_NO_VALUE,
+                                      depth, &value_size);
         break;
 
     default:
@@ -1555,15 +1626,20 @@ error:
         case RMQ_FIELD_FLOAT:
         case RMQ_FIELD_DOUBLE:
         case RMQ_FIELD_DECIMAL:
+            /* Skip the pointer to keep the argument list aligned */
+            va_arg(ap, void *);
             break;
 
         case RMQ_FIELD_SHORT_STRING:
-        case RMQ_FIELD_LONG_STRING:
             pstring = va_arg(ap, char **);
             c_free(*pstring);
             *pstring = NULL;
             break;
 
+        case RMQ_FIELD_LONG_STRING:
+            rmq_long_string_free(va_arg(ap, struct rmq_long_string *));
+            break;
+
         case RMQ_FIELD_ARRAY:
             pfields = va_arg(ap, struct c_ptr_vector **);
 
@@ -1575,6 +1651,7 @@ error:
             break;
 
         case RMQ_FIELD_TIMESTAMP:
+            va_arg(ap, uint64_t *);
             break;
 
         case RMQ_FIELD_TABLE:
@@ -1828,6 +1905,41 @@ rmq_frame_write(const struct rmq_frame *frame, struct c_buffer *buf) {
     c_buffer_increase_length(buf, 7 + frame->size + 1);
 }
 
+size_t
+rmq_frame_write_start(enum rmq_frame_type type, uint16_t channel,
+                      struct c_buffer *buf) {
+    uint8_t *ptr;
+    size_t offset;
+
+    offset = c_buffer_length(buf);
+
+    ptr = c_buffer_reserve(buf, 7);
+
+    rmq_write_u8(type, ptr);
+    rmq_write_u16(channel, ptr + 1);
+    rmq_write_u32(0, ptr + 3); /* set by rmq_frame_write_end() */
+
+    c_buffer_increase_length(buf, 7);
+
+    return offset;
+}
+
+void
+rmq_frame_write_end(size_t offset, struct c_buffer *buf) {
+    uint8_t *ptr;
+    size_t size;
+
+    size = c_buffer_length(buf) - offset - 7;
+    assert(size <= UINT32_MAX);
+
+    ptr = c_buffer_data(buf);
+    rmq_write_u32((uint32_t)size, ptr + offset + 3);
+
+    ptr = c_buffer_reserve(buf, 1);
+    *ptr = RMQ_FRAME_END;
+    c_buffer_increase_length(buf, 1);
+}
+
 /* ---------------------------------------------------------------------------
  *  Method frame
  * ------------------------------------------------------------------------ */
@@ -1844,6 +1956,8 @@ rmq_method_to_string(enum rmq_method method) {
         [RMQ_METHOD_CONNECTION_OPEN_OK]   = "Connection.Open-Ok",
         [RMQ_METHOD_CONNECTION_CLOSE]     = "Connection.Close",
         [RMQ_METHOD_CONNECTION_CLOSE_OK]  = "Connection.Close-Ok",
+        [RMQ_METHOD_CONNECTION_BLOCKED]   = "Connection.Blocked",
+        [RMQ_METHOD_CONNECTION_UNBLOCKED] = "Connection.Unblocked",
 
         [RMQ_METHOD_CHANNEL_OPEN]         = "Channel.Open",
         [RMQ_METHOD_CHANNEL_OPEN_OK]      = "Channel.Open-Ok",
@@ -2092,7 +2206,7 @@ rmq_read_u16(const uint8_t *ptr) {
     return (ptr[0] << 8) | ptr[1];
 }
 
-static uint32_t
+uint32_t
 rmq_read_u32(const uint8_t *ptr) {
     return ((uint32_t)ptr[0] << 24)
          | ((uint32_t)ptr[1] << 16)
@@ -2100,7 +2214,7 @@ rmq_read_u32(const uint8_t *ptr) {
          |  (uint32_t)ptr[3];
 }
 
-static uint64_t
+uint64_t
 rmq_read_u64(const uint8_t *ptr) {
     return  ((uint64_t)ptr[0] << 56)
           | ((uint64_t)ptr[1] << 48)
@@ -2123,7 +2237,7 @@ rmq_write_u16(uint16_t value, uint8_t *ptr) {
     ptr[1] =  value & 0x00ff;
 }
 
-static void
+void
 rmq_write_u32(uint32_t value, uint8_t *ptr) {
     ptr[0] = (value & 0xff000000) >> 24;
     ptr[1] = (value & 0x00ff0000) >> 16;
@@ -2131,7 +2245,7 @@ rmq_write_u32(uint32_t value, uint8_t *ptr) {
     ptr[3] =  value & 0x000000ff;
 }
 
-static void
+void
 rmq_write_u64(uint64_t value, uint8_t *ptr) {
     ptr[0] = (value & 0xff00000000000000) >> 56;
     ptr[1] = (value & 0x00ff000000000000) >> 48;
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+static void *rmq_resolver_main(void *);
+static int rmq_resolver_start(struct rmq_resolver *);
+static void rmq_resolver_on_pipe_event(int, uint32_t, void *);
+
+static struct rmq_resolver_worker *rmq_resolver_worker_new(void);
+static void rmq_resolver_worker_delete(struct rmq_resolver_worker *);
+static void rmq_resolver_worker_release(struct rmq_resolver_worker *);
+
+static struct rmq_resolver_entry *
+rmq_resolver_cache_result(struct rmq_resolver *, struct rmq_resolver_query *);
+static struct rmq_resolver_entry *
+rmq_resolver_cache_get(struct rmq_resolver *, const char *, uint16_t);
+static void rmq_resolver_entry_delete(struct rmq_resolver_entry *);
+static char *rmq_resolver_key(const char *, uint16_t);
+
+static void rmq_resolver_query_delete(struct rmq_resolver_query *);
+
+struct rmq_resolver *
+rmq_resolver_new(struct io_base *io_base, rmq_resolver_cb cb, void *cb_arg) {
+    struct rmq_resolver *resolver;
+
+    resolver = c_malloc0(sizeof(struct rmq_resolver));
+
+    resolver->io_base = io_base;
+
+    resolver->cb = cb;
+    resolver->cb_arg = cb_arg;
+
+    resolver->cache = c_hash_table_new(c_hash_string, c_equal_string);
+    resolver->ttl = RMQ_RESOLVER_DEFAULT_TTL;
+
+    return resolver;
+}
+
+void
+rmq_resolver_delete(struct rmq_resolver *resolver) {
+    struct c_hash_table_iterator *it;
+    struct rmq_resolver_entry *entry;
+    struct rmq_resolver_worker *worker;
+
+    if (!resolver)
+        return;
+
+    worker = resolver->worker;
+    if (worker) {
+        /* The thread may be blocked in getaddrinfo() for a long time: it
+         * is not waited for, and discards its result when it is done. */
+        if (resolver->nb_pending_queries > 0)
+            io_base_unwatch_fd(resolver->io_base, worker->pipe[0]);
+
+        pthread_mutex_lock(&worker->mutex);
+        worker->stopping = true;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->mutex);
+
+        rmq_resolver_worker_release(worker);
+    }
+
+    it = c_hash_table_iterate(resolver->cache);
+    while (c_hash_table_iterator_next(it, NULL, (void **)&entry) == 1)
+        rmq_resolver_entry_delete(entry);
+    c_hash_table_iterator_delete(it);
+    c_hash_table_delete(resolver->cache);
+
+    c_free0(resolver, sizeof(struct rmq_resolver));
+}
+
+void
+rmq_resolver_set_ttl(struct rmq_resolver *resolver, uint64_t ttl) {
+    resolver->ttl = ttl;
+}
+
+int
+rmq_resolver_lookup(struct rmq_resolver *resolver,
+                    const char *host, uint16_t port,
+                    const struct addrinfo **pres) {
+    struct rmq_resolver_entry *entry;
+
+    if (resolver->ttl == 0)
+        return 0;
+
+    entry = rmq_resolver_cache_get(resolver, host, port);
+    if (!entry)
+        return 0;
+
+    if (entry->error != 0) {
+        c_set_error("cannot resolve %s: %s", host, gai_strerror(entry->error));
+        return -1;
+    }
+
+    *pres = entry->res;
+    return 1;
+}
+
+int
+rmq_resolver_resolve(struct rmq_resolver *resolver,
+                     const char *host, uint16_t port) {
+    struct rmq_resolver_worker *worker;
+    struct rmq_resolver_query *query;
+
+    if (!resolver->worker) {
+        if (rmq_resolver_start(resolver) == -1)
+            return -1;
+    }
+
+    worker = resolver->worker;
+
+    if (resolver->nb_pending_queries == 0) {
+        if (io_base_watch_fd(resolver->io_base, worker->pipe[0],
+                             IO_EVENT_FD_READ,
+                             rmq_resolver_on_pipe_event, resolver) == -1) {
+            c_set_error("cannot watch pipe: %s", c_get_error());
+            return -1;
+        }
+    }
+
+    resolver->nb_pending_queries++;
+
+    query = c_malloc0(sizeof(struct rmq_resolver_query));
+
+    query->host = c_strdup(host);
+    query->port = port;
+
+    pthread_mutex_lock(&worker->mutex);
+
+    if (worker->last_query) {
+        worker->last_query->next = query;
+    } else {
+        worker->first_query = query;
+    }
+    worker->last_query = query;
+
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+
+    return 0;
+}
+
+static int
+rmq_resolver_start(struct rmq_resolver *resolver) {
+    struct rmq_resolver_worker *worker;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+
+    worker = rmq_resolver_worker_new();
+
+    if (pipe(worker->pipe) == -1) {
+        c_set_error("cannot create pipe: %s", strerror(errno));
+        worker->pipe[0] = -1;
+        worker->pipe[1] = -1;
+        goto error;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        int flags;
+
+        flags = fcntl(worker->pipe[i], F_GETFL, 0);
+        if (flags == -1
+         || fcntl(worker->pipe[i], F_SETFL, flags | O_NONBLOCK) == -1
+         || fcntl(worker->pipe[i], F_SETFD, FD_CLOEXEC) == -1) {
+            c_set_error("cannot configure pipe: %s", strerror(errno));
+            goto error;
+        }
+    }
+
+    /* One reference for the resolver and one for the thread */
+    worker->nb_refs = 2;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    ret = pthread_create(&thread, &attr, rmq_resolver_main, worker);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        c_set_error("cannot create thread: %s", strerror(ret));
+        goto error;
+    }
+
+    resolver->worker = worker;
+    return 0;
+
+error:
+    rmq_resolver_worker_delete(worker);
+    return -1;
+}
+
+static void *
+rmq_resolver_main(void *arg) {
+    struct rmq_resolver_worker *worker;
+
+    worker = arg;
+
+    pthread_mutex_lock(&worker->mutex);
+
+    for (;;) {
+        struct rmq_resolver_query *query;
+        struct addrinfo hints;
+        ssize_t nb_written;
+        char service[8];
+
+        while (!worker->stopping && !worker->first_query)
+            pthread_cond_wait(&worker->cond, &worker->mutex);
+
+        if (worker->stopping)
+            break;
+
+        query = worker->first_query;
+        worker->first_query = query->next;
+        if (!worker->first_query)
+            worker->last_query = NULL;
+        query->next = NULL;
+
+        pthread_mutex_unlock(&worker->mutex);
+
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        snprintf(service, sizeof(service), "%u", query->port);
+
+        query->error = getaddrinfo(query->host, service, &hints, &query->res);
+
+        pthread_mutex_lock(&worker->mutex);
+
+        if (worker->stopping) {
+            /* The resolver was deleted while the query was processed */
+            rmq_resolver_query_delete(query);
+            break;
+        }
+
+        if (worker->last_result) {
+            worker->last_result->next = query;
+        } else {
+            worker->first_result = query;
+        }
+        worker->last_result = query;
+
+        /* If the pipe is full, the event loop has not read previous
+         * notifications yet and will see this result as well, so write
+         * errors can be ignored. */
+        nb_written = write(worker->pipe[1], "", 1);
+        (void)nb_written;
+    }
+
+    pthread_mutex_unlock(&worker->mutex);
+
+    rmq_resolver_worker_release(worker);
+    return NULL;
+}
+
+static void
+rmq_resolver_on_pipe_event(int fd, uint32_t events, void *arg) {
+    struct rmq_resolver_query *query, *results;
+    struct rmq_resolver_worker *worker;
+    struct rmq_resolver *resolver;
+    char buf[64];
+
+    resolver = arg;
+    worker = resolver->worker;
+
+    while (read(worker->pipe[0], buf, sizeof(buf)) > 0)
+        continue;
+
+    pthread_mutex_lock(&worker->mutex);
+    results = worker->first_result;
+    worker->first_result = NULL;
+    worker->last_result = NULL;
+    pthread_mutex_unlock(&worker->mutex);
+
+    while (results) {
+        struct rmq_resolver_entry *entry;
+        const struct addrinfo *res;
+
+        query = results;
+        results = query->next;
+
+        res = query->res;
+
+        entry = rmq_resolver_cache_result(resolver, query);
+        if (entry) {
+            /* The result now belongs to the cache */
+            query->res = NULL;
+        }
+
+        if (query->error != 0) {
+            c_set_error("cannot resolve %s: %s",
+                        query->host, gai_strerror(query->error));
+        }
+
+        resolver->nb_pending_queries--;
+        if (resolver->nb_pending_queries == 0)
+            io_base_unwatch_fd(resolver->io_base, worker->pipe[0]);
+
+        resolver->cb(query->host, query->port, res, resolver->cb_arg);
+
+        rmq_resolver_query_delete(query);
+    }
+}
+
+static struct rmq_resolver_worker *
+rmq_resolver_worker_new(void) {
+    struct rmq_resolver_worker *worker;
+
+    worker = c_malloc0(sizeof(struct rmq_resolver_worker));
+
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+
+    worker->pipe[0] = -1;
+    worker->pipe[1] = -1;
+
+    return worker;
+}
+
+static void
+rmq_resolver_worker_delete(struct rmq_resolver_worker *worker) {
+    struct rmq_resolver_query *query;
+
+    if (!worker)
+        return;
+
+    while (worker->first_query) {
+        query = worker->first_query;
+        worker->first_query = query->next;
+        rmq_resolver_query_delete(query);
+    }
+
+    while (worker->first_result) {
+        query = worker->first_result;
+        worker->first_result = query->next;
+        rmq_resolver_query_delete(query);
+    }
+
+    if (worker->pipe[0] >= 0)
+        close(worker->pipe[0]);
+    if (worker->pipe[1] >= 0)
+        close(worker->pipe[1]);
+
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+
+    c_free0(worker, sizeof(struct rmq_resolver_worker));
+}
+
+static void
+rmq_resolver_worker_release(struct rmq_resolver_worker *worker) {
+    bool last;
+
+    pthread_mutex_lock(&worker->mutex);
+    last = (--worker->nb_refs == 0);
+    pthread_mutex_unlock(&worker->mutex);
+
+    if (last)
+        rmq_resolver_worker_delete(worker);
+}
+
+static struct rmq_resolver_entry *
+rmq_resolver_cache_result(struct rmq_resolver *resolver,
+                          struct rmq_resolver_query *query) {
+    struct rmq_resolver_entry *entry, *old;
+    uint64_t ttl;
+
+    ttl = resolver->ttl;
+    if (query->error != 0 && ttl > RMQ_RESOLVER_NEGATIVE_TTL)
+        ttl = RMQ_RESOLVER_NEGATIVE_TTL;
+
+    if (ttl == 0)
+        return NULL;
+
+    entry = c_malloc0(sizeof(struct rmq_resolver_entry));
+
+    entry->key = rmq_resolver_key(query->host, query->port);
+    entry->res = query->res;
+    entry->error = query->error;
+    entry->expiration = rmq_now_ms() + ttl;
+
+    /* An entry may already exist if the same host was resolved twice */
+    if (c_hash_table_get(resolver->cache, entry->key, (void **)&old) == 1) {
+        c_hash_table_remove(resolver->cache, entry->key);
+        rmq_resolver_entry_delete(old);
+    }
+
+    c_hash_table_insert(resolver->cache, entry->key, entry);
+    return entry;
+}
+
+static struct rmq_resolver_entry *
+rmq_resolver_cache_get(struct rmq_resolver *resolver,
+                       const char *host, uint16_t port) {
+    struct rmq_resolver_entry *entry;
+    char *key;
+    int ret;
+
+    key = rmq_resolver_key(host, port);
+    ret = c_hash_table_get(resolver->cache, key, (void **)&entry);
+    c_free(key);
+
+    if (ret == 0)
+        return NULL;
+
+    if (entry->expiration <= rmq_now_ms()) {
+        c_hash_table_remove(resolver->cache, entry->key);
+        rmq_resolver_entry_delete(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+static void
+rmq_resolver_entry_delete(struct rmq_resolver_entry *entry) {
+    if (!entry)
+        return;
+
+    c_free(entry->key);
+
+    if (entry->res)
+        freeaddrinfo(entry->res);
+
+    c_free0(entry, sizeof(struct rmq_resolver_entry));
+}
+
+static char *
+rmq_resolver_key(const char *host, uint16_t port) {
+    char *key;
+
+    c_asprintf(&key, "%s:%u", host, port);
+    return key;
+}
+
+static void
+rmq_resolver_query_delete(struct rmq_resolver_query *query) {
+    if (!query)
+        return;
+
+    c_free(query->host);
+
+    if (query->res)
+        freeaddrinfo(query->res);
+
+    c_free0(query, sizeof(struct rmq_resolver_query));
+}
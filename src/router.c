@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Topic patterns are stored in a trie of words. Each node has a table of
+ * children indexed by literal words, and optional children for the "*" and
+ * "#" wildcards. Routing keys are matched by walking the trie breadth-first,
+ * word by word, over the set of nodes matching the words read so far; each
+ * node is visited at most once per word, so that patterns with several "#"
+ * wildcards cannot make matching exponential. */
+
+static struct rmq_router_node *rmq_router_node_new(void);
+static void rmq_router_node_delete(struct rmq_router_node *);
+
+static size_t rmq_router_match(struct rmq_router *, char **, size_t);
+static void rmq_router_activate(struct rmq_router *, struct c_ptr_vector *,
+                                struct rmq_router_node *);
+static void rmq_router_match_route(const struct rmq_router_node *,
+                                   size_t *);
+
+/* ---------------------------------------------------------------------------
+ *  Router
+ * ------------------------------------------------------------------------ */
+struct rmq_router *
+rmq_router_new(void) {
+    struct rmq_router *router;
+
+    router = c_malloc0(sizeof(struct rmq_router));
+
+    router->root = rmq_router_node_new();
+    router->routes = c_vector_new(sizeof(struct rmq_route));
+
+    router->active_nodes = c_ptr_vector_new();
+    router->next_nodes = c_ptr_vector_new();
+
+    return router;
+}
+
+void
+rmq_router_delete(struct rmq_router *router) {
+    if (!router)
+        return;
+
+    rmq_router_node_delete(router->root);
+
+    for (size_t i = 0; i < c_vector_length(router->routes); i++) {
+        struct rmq_route *route;
+
+        route = c_vector_entry(router->routes, i);
+        c_free(route->pattern);
+    }
+    c_vector_delete(router->routes);
+
+    c_ptr_vector_delete(router->active_nodes);
+    c_ptr_vector_delete(router->next_nodes);
+
+    c_free0(router, sizeof(struct rmq_router));
+}
+
+void
+rmq_router_add(struct rmq_router *router, const char *pattern,
+               rmq_msg_cb cb, void *cb_arg) {
+    struct rmq_router_node *node;
+    struct rmq_route route;
+    const char *start;
+
+    node = router->root;
+
+    start = pattern;
+    for (;;) {
+        struct rmq_router_node *child;
+        const char *end;
+        size_t len;
+
+        end = strchr(start, '.');
+        len = end ? (size_t)(end - start) : strlen(start);
+
+        if (len == 1 && *start == '*') {
+            if (!node->star)
+                node->star = rmq_router_node_new();
+            child = node->star;
+        } else if (len == 1 && *start == '#') {
+            if (!node->hash) {
+                node->hash = rmq_router_node_new();
+                node->hash->is_hash = true;
+            }
+            child = node->hash;
+        } else {
+            char *word;
+
+            word = c_strndup(start, len);
+
+            if (c_hash_table_get(node->children, word,
+                                 (void **)&child) == 1) {
+                c_free(word);
+            } else {
+                child = rmq_router_node_new();
+                child->word = word;
+                c_hash_table_insert(node->children, child->word, child);
+            }
+        }
+
+        node = child;
+
+        if (!end)
+            break;
+        start = end + 1;
+    }
+
+    if (node->route > 0) {
+        struct rmq_route *existing;
+
+        /* Registering the same pattern again replaces the handler */
+        existing = c_vector_entry(router->routes, node->route - 1);
+        existing->msg_cb = cb;
+        existing->msg_cb_arg = cb_arg;
+        return;
+    }
+
+    route.pattern = c_strdup(pattern);
+    route.msg_cb = cb;
+    route.msg_cb_arg = cb_arg;
+
+    c_vector_append(router->routes, &route);
+    node->route = c_vector_length(router->routes);
+}
+
+void
+rmq_router_set_default(struct rmq_router *router,
+                       rmq_msg_cb cb, void *cb_arg) {
+    router->default_msg_cb = cb;
+    router->default_msg_cb_arg = cb_arg;
+}
+
+enum rmq_msg_action
+rmq_router_dispatch(struct rmq_client *client,
+                    const struct rmq_delivery *delivery,
+                    const struct rmq_msg *msg, void *arg) {
+    struct rmq_router *router;
+    const struct rmq_route *route;
+    const char *routing_key;
+    char key[RMQ_ROUTER_MAX_KEY_SIZE + 1];
+    char *words[RMQ_ROUTER_MAX_KEY_SIZE + 1]; /* a key of dots only */
+    size_t key_len, nb_words, route_index;
+
+    router = arg;
+
+    routing_key = rmq_delivery_routing_key(delivery);
+    if (!routing_key)
+        routing_key = "";
+
+    /* Routing keys are short strings; they are split in place in a copy
+     * so that words can be used as hash table keys. */
+    key_len = strlen(routing_key);
+    if (key_len > RMQ_ROUTER_MAX_KEY_SIZE)
+        key_len = RMQ_ROUTER_MAX_KEY_SIZE;
+
+    memcpy(key, routing_key, key_len);
+    key[key_len] = '\0';
+
+    nb_words = 0;
+    words[nb_words++] = key;
+
+    for (size_t i = 0; i < key_len; i++) {
+        if (key[i] == '.') {
+            key[i] = '\0';
+            words[nb_words++] = key + i + 1;
+        }
+    }
+
+    route_index = rmq_router_match(router, words, nb_words);
+
+    if (route_index > 0) {
+        route = c_vector_entry(router->routes, route_index - 1);
+        return route->msg_cb(client, delivery, msg, route->msg_cb_arg);
+    }
+
+    if (router->default_msg_cb) {
+        return router->default_msg_cb(client, delivery, msg,
+                                      router->default_msg_cb_arg);
+    }
+
+    /* Requeuing a message nobody handles would only cause it to be
+     * delivered again. */
+    return RMQ_MSG_ACTION_REJECT;
+}
+
+static size_t
+rmq_router_match(struct rmq_router *router, char **words, size_t nb_words) {
+    struct c_ptr_vector *active, *next, *tmp;
+    size_t route_index;
+
+    active = router->active_nodes;
+    next = router->next_nodes;
+
+    c_ptr_vector_clear(active);
+
+    router->step++;
+    rmq_router_activate(router, active, router->root);
+
+    for (size_t i = 0; i < nb_words; i++) {
+        c_ptr_vector_clear(next);
+
+        router->step++;
+
+        for (size_t j = 0; j < c_ptr_vector_length(active); j++) {
+            struct rmq_router_node *node, *child;
+
+            node = c_ptr_vector_entry(active, j);
+
+            if (c_hash_table_get(node->children, words[i],
+                                 (void **)&child) == 1) {
+                rmq_router_activate(router, next, child);
+            }
+
+            if (node->star)
+                rmq_router_activate(router, next, node->star);
+
+            /* "#" consumes any number of words */
+            if (node->is_hash)
+                rmq_router_activate(router, next, node);
+        }
+
+        tmp = active;
+        active = next;
+        next = tmp;
+
+        if (c_ptr_vector_length(active) == 0)
+            break;
+    }
+
+    route_index = 0;
+
+    for (size_t j = 0; j < c_ptr_vector_length(active); j++)
+        rmq_router_match_route(c_ptr_vector_entry(active, j), &route_index);
+
+    return route_index;
+}
+
+static void
+rmq_router_activate(struct rmq_router *router, struct c_ptr_vector *nodes,
+                    struct rmq_router_node *node) {
+    for (;;) {
+        if (node->mark == router->step)
+            return;
+
+        node->mark = router->step;
+        c_ptr_vector_append(nodes, node);
+
+        /* "#" also matches zero words */
+        if (!node->hash)
+            return;
+
+        node = node->hash;
+    }
+}
+
+static void
+rmq_router_match_route(const struct rmq_router_node *node,
+                       size_t *route_index) {
+    /* When several patterns match, the one registered first wins */
+    if (node->route == 0)
+        return;
+
+    if (*route_index == 0 || node->route < *route_index)
+        *route_index = node->route;
+}
+
+/* ---------------------------------------------------------------------------
+ *  Router node
+ * ------------------------------------------------------------------------ */
+static struct rmq_router_node *
+rmq_router_node_new(void) {
+    struct rmq_router_node *node;
+
+    node = c_malloc0(sizeof(struct rmq_router_node));
+
+    node->children = c_hash_table_new(c_hash_string, c_equal_string);
+
+    return node;
+}
+
+static void
+rmq_router_node_delete(struct rmq_router_node *node) {
+    struct c_hash_table_iterator *it;
+    struct rmq_router_node *child;
+
+    if (!node)
+        return;
+
+    it = c_hash_table_iterate(node->children);
+    while (c_hash_table_iterator_next(it, NULL, (void **)&child) == 1)
+        rmq_router_node_delete(child);
+    c_hash_table_iterator_delete(it);
+    c_hash_table_delete(node->children);
+
+    rmq_router_node_delete(node->star);
+    rmq_router_node_delete(node->hash);
+
+    c_free(node->word);
+
+    c_free0(node, sizeof(struct rmq_router_node));
+}
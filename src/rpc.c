@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Pending calls are stored in an open-addressing hash table with linear
+ * probing. Identifiers are never 0, so a slot with a null identifier is
+ * free. Entries are removed with backward shifting, so that the table never
+ * contains tombstones. */
+
+#define RMQ_RPC_TABLE_MIN_SIZE 64
+
+static size_t rmq_rpc_table_slot(const struct rmq_rpc_table *, uint64_t);
+static void rmq_rpc_table_resize(struct rmq_rpc_table *, size_t);
+static void rmq_rpc_table_remove_slot(struct rmq_rpc_table *, size_t);
+
+/* ---------------------------------------------------------------------------
+ *  Call table
+ * ------------------------------------------------------------------------ */
+void
+rmq_rpc_table_init(struct rmq_rpc_table *table) {
+    memset(table, 0, sizeof(struct rmq_rpc_table));
+}
+
+void
+rmq_rpc_table_free(struct rmq_rpc_table *table) {
+    if (!table)
+        return;
+
+    c_free(table->calls);
+
+    memset(table, 0, sizeof(struct rmq_rpc_table));
+}
+
+void
+rmq_rpc_table_insert(struct rmq_rpc_table *table,
+                     const struct rmq_rpc_call *call) {
+    size_t slot;
+
+    assert(call->id != 0);
+
+    /* Keep the load factor under 3/4 */
+    if ((table->nb_calls + 1) * 4 > table->size * 3) {
+        size_t size;
+
+        size = table->size * 2;
+        if (size < RMQ_RPC_TABLE_MIN_SIZE)
+            size = RMQ_RPC_TABLE_MIN_SIZE;
+
+        rmq_rpc_table_resize(table, size);
+    }
+
+    slot = rmq_rpc_table_slot(table, call->id);
+    while (table->calls[slot].id != 0) {
+        assert(table->calls[slot].id != call->id);
+        slot = (slot + 1) & (table->size - 1);
+    }
+
+    table->calls[slot] = *call;
+    table->nb_calls++;
+}
+
+int
+rmq_rpc_table_remove(struct rmq_rpc_table *table, uint64_t id,
+                     struct rmq_rpc_call *call) {
+    size_t slot;
+
+    if (table->nb_calls == 0 || id == 0)
+        return 0;
+
+    slot = rmq_rpc_table_slot(table, id);
+    while (table->calls[slot].id != 0) {
+        if (table->calls[slot].id == id) {
+            *call = table->calls[slot];
+            rmq_rpc_table_remove_slot(table, slot);
+            return 1;
+        }
+
+        slot = (slot + 1) & (table->size - 1);
+    }
+
+    return 0;
+}
+
+void
+rmq_rpc_table_remove_all(struct rmq_rpc_table *table,
+                         struct c_vector *calls) {
+    for (size_t slot = 0; slot < table->size; slot++) {
+        struct rmq_rpc_call *call;
+
+        call = table->calls + slot;
+        if (call->id != 0)
+            c_vector_append(calls, call);
+    }
+
+    if (table->size > 0)
+        memset(table->calls, 0, table->size * sizeof(struct rmq_rpc_call));
+
+    table->nb_calls = 0;
+}
+
+static size_t
+rmq_rpc_table_slot(const struct rmq_rpc_table *table, uint64_t id) {
+    /* Identifiers are sequential: Fibonacci hashing spreads them over the
+     * whole table. */
+    return (size_t)((id * UINT64_C(11400714819323198485)) >> 32)
+         & (table->size - 1);
+}
+
+static void
+rmq_rpc_table_resize(struct rmq_rpc_table *table, size_t size) {
+    struct rmq_rpc_call *calls;
+    size_t old_size;
+
+    calls = table->calls;
+    old_size = table->size;
+
+    table->calls = c_calloc(size, sizeof(struct rmq_rpc_call));
+    table->size = size;
+    table->nb_calls = 0;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (calls[i].id != 0)
+            rmq_rpc_table_insert(table, calls + i);
+    }
+
+    c_free(calls);
+}
+
+static void
+rmq_rpc_table_remove_slot(struct rmq_rpc_table *table, size_t slot) {
+    size_t mask, next;
+
+    mask = table->size - 1;
+
+    /* Shift back the following entries of the cluster which are not at
+     * their ideal position, so that lookups never stop too early. */
+    next = (slot + 1) & mask;
+    while (table->calls[next].id != 0) {
+        size_t ideal;
+
+        ideal = rmq_rpc_table_slot(table, table->calls[next].id);
+
+        if (((next - ideal) & mask) >= ((next - slot) & mask)) {
+            table->calls[slot] = table->calls[next];
+            slot = next;
+        }
+
+        next = (next + 1) & mask;
+    }
+
+    memset(table->calls + slot, 0, sizeof(struct rmq_rpc_call));
+    table->nb_calls--;
+}
@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+/* File layout:
+ *
+ * Header (32 bytes):
+ *   magic          8 bytes  "RMQSPOOL"
+ *   version        u32
+ *   generation     u32
+ *   committed      u64      offset of the first record not sent yet
+ *   reserved       u64
+ *
+ * Records:
+ *   size           u32      size of the payload
+ *   generation     u32
+ *   checksum       u32      FNV-1a of the generation and payload
+ *   payload:
+ *     method size  u32
+ *     method       Basic.Publish method frame payload
+ *     header size  u32
+ *     header       header frame payload
+ *     body
+ *
+ * The end of the spool is found by reading records from the committed offset
+ * until a record is truncated, belongs to another generation or has an
+ * invalid checksum. Incrementing the generation when the spool is rewound
+ * invalidates older records which have not been overwritten.
+ *
+ * Space is reclaimed when all records have been sent, or, once the committed
+ * offset passes the middle of the file, by moving the remaining records to
+ * the beginning of the file. */
+
+#define RMQ_SPOOL_MAGIC       "RMQSPOOL"
+#define RMQ_SPOOL_VERSION     1
+#define RMQ_SPOOL_HEADER_SIZE 32
+#define RMQ_SPOOL_RECORD_HEADER_SIZE 12
+
+static void rmq_spool_compact(struct rmq_spool *);
+static void rmq_spool_write_header(struct rmq_spool *);
+static int rmq_spool_read_record(const struct rmq_spool *, size_t,
+                                 struct rmq_spool_record *);
+static uint32_t rmq_spool_checksum(uint32_t, const void *, size_t);
+
+/* ---------------------------------------------------------------------------
+ *  Spool
+ * ------------------------------------------------------------------------ */
+struct rmq_spool *
+rmq_spool_open(const char *path, size_t size) {
+    struct rmq_spool *spool;
+    struct stat st;
+    uint8_t *data;
+    bool created;
+    int fd;
+
+    if (size < RMQ_SPOOL_HEADER_SIZE + RMQ_SPOOL_RECORD_HEADER_SIZE) {
+        c_set_error("spool size too small");
+        return NULL;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        c_set_error("cannot open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        c_set_error("cannot stat %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    created = (st.st_size == 0);
+
+    if ((size_t)st.st_size > size) {
+        /* Never shrink an existing spool, it may contain records */
+        size = (size_t)st.st_size;
+    } else if ((size_t)st.st_size < size) {
+        if (ftruncate(fd, (off_t)size) == -1) {
+            c_set_error("cannot resize %s: %s", path, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+    }
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        c_set_error("cannot map %s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    spool = c_malloc0(sizeof(struct rmq_spool));
+
+    spool->path = c_strdup(path);
+    spool->fd = fd;
+    spool->data = data;
+    spool->size = size;
+
+    if (created) {
+        spool->generation = 1;
+        spool->committed = RMQ_SPOOL_HEADER_SIZE;
+        spool->replayed = RMQ_SPOOL_HEADER_SIZE;
+        spool->end = RMQ_SPOOL_HEADER_SIZE;
+
+        memcpy(data, RMQ_SPOOL_MAGIC, 8);
+        rmq_spool_write_header(spool);
+    } else {
+        struct rmq_spool_record record;
+        uint32_t version, generation;
+        uint64_t committed;
+
+        if (memcmp(data, RMQ_SPOOL_MAGIC, 8) != 0) {
+            c_set_error("%s is not a spool file", path);
+            rmq_spool_close(spool);
+            return NULL;
+        }
+
+        version = rmq_read_u32(data + 8);
+        generation = rmq_read_u32(data + 12);
+        committed = rmq_read_u64(data + 16);
+
+        if (version != RMQ_SPOOL_VERSION) {
+            c_set_error("unsupported spool version %u", version);
+            rmq_spool_close(spool);
+            return NULL;
+        }
+
+        if (committed < RMQ_SPOOL_HEADER_SIZE || committed > size) {
+            c_set_error("invalid committed offset %"PRIu64, committed);
+            rmq_spool_close(spool);
+            return NULL;
+        }
+
+        spool->generation = generation;
+        spool->committed = (size_t)committed;
+        spool->replayed = spool->committed;
+        spool->end = spool->committed;
+
+        while (rmq_spool_read_record(spool, spool->end, &record) == 1)
+            spool->end += record.size;
+    }
+
+    return spool;
+}
+
+void
+rmq_spool_close(struct rmq_spool *spool) {
+    if (!spool)
+        return;
+
+    msync(spool->data, spool->size, MS_SYNC);
+    munmap(spool->data, spool->size);
+    close(spool->fd);
+
+    c_free(spool->path);
+
+    c_free0(spool, sizeof(struct rmq_spool));
+}
+
+bool
+rmq_spool_is_empty(const struct rmq_spool *spool) {
+    return spool->committed == spool->end;
+}
+
+bool
+rmq_spool_is_replayed(const struct rmq_spool *spool) {
+    return spool->replayed == spool->end;
+}
+
+int
+rmq_spool_append(struct rmq_spool *spool,
+                 const void *method, size_t method_sz,
+                 const void *header, size_t header_sz,
+                 const void *body, size_t body_sz) {
+    uint8_t *record, *payload;
+    size_t payload_sz, record_sz;
+    uint32_t checksum;
+
+    payload_sz = 4 + method_sz + 4 + header_sz + body_sz;
+    record_sz = RMQ_SPOOL_RECORD_HEADER_SIZE + payload_sz;
+
+    if (payload_sz > UINT32_MAX || record_sz > spool->size - spool->end) {
+        c_set_error("spool full");
+        return -1;
+    }
+
+    /* The payload is written before the record header; a record is only
+     * valid once its checksum has been written. */
+    record = spool->data + spool->end;
+    payload = record + RMQ_SPOOL_RECORD_HEADER_SIZE;
+
+    rmq_write_u32((uint32_t)method_sz, payload);
+    memcpy(payload + 4, method, method_sz);
+    rmq_write_u32((uint32_t)header_sz, payload + 4 + method_sz);
+    memcpy(payload + 4 + method_sz + 4, header, header_sz);
+    if (body_sz > 0)
+        memcpy(payload + 4 + method_sz + 4 + header_sz, body, body_sz);
+
+    checksum = rmq_spool_checksum(spool->generation, payload, payload_sz);
+
+    rmq_write_u32((uint32_t)payload_sz, record);
+    rmq_write_u32(spool->generation, record + 4);
+    rmq_write_u32(checksum, record + 8);
+
+    spool->end += record_sz;
+    return 0;
+}
+
+int
+rmq_spool_peek(const struct rmq_spool *spool,
+               struct rmq_spool_record *record) {
+    if (rmq_spool_is_replayed(spool))
+        return 0;
+
+    return rmq_spool_read_record(spool, spool->replayed, record);
+}
+
+void
+rmq_spool_skip(struct rmq_spool *spool,
+               const struct rmq_spool_record *record) {
+    assert(spool->replayed + record->size <= spool->end);
+
+    /* The record is only committed once it has been sent */
+    spool->replayed += record->size;
+}
+
+void
+rmq_spool_commit(struct rmq_spool *spool, size_t offset) {
+    assert(offset >= spool->committed && offset <= spool->replayed);
+
+    if (offset == spool->committed)
+        return;
+
+    spool->committed = offset;
+
+    if (rmq_spool_is_empty(spool)) {
+        /* Everything was sent, start again at the beginning of the file
+         * with a new generation. */
+        spool->generation++;
+        spool->committed = RMQ_SPOOL_HEADER_SIZE;
+        spool->replayed = RMQ_SPOOL_HEADER_SIZE;
+        spool->end = RMQ_SPOOL_HEADER_SIZE;
+    } else if (offset - RMQ_SPOOL_HEADER_SIZE
+               >= (spool->size - RMQ_SPOOL_HEADER_SIZE) / 2
+            && spool->end - offset <= offset - RMQ_SPOOL_HEADER_SIZE) {
+        /* A spool which is never entirely sent would end up full */
+        rmq_spool_compact(spool);
+    }
+
+    rmq_spool_write_header(spool);
+}
+
+void
+rmq_spool_rewind(struct rmq_spool *spool) {
+    /* Records replayed but not sent are replayed again */
+    spool->replayed = spool->committed;
+}
+
+static void
+rmq_spool_compact(struct rmq_spool *spool) {
+    uint32_t generation;
+    size_t offset, size;
+    uint8_t *dest;
+
+    /* Records are copied with a new generation to an area which does not
+     * overlap them: until the header is written, the spool still starts at
+     * the original records. */
+    generation = spool->generation + 1;
+
+    dest = spool->data + RMQ_SPOOL_HEADER_SIZE;
+    offset = spool->committed;
+
+    while (offset < spool->end) {
+        const uint8_t *record;
+        uint32_t payload_sz, checksum;
+
+        record = spool->data + offset;
+
+        payload_sz = rmq_read_u32(record);
+        size = RMQ_SPOOL_RECORD_HEADER_SIZE + payload_sz;
+
+        memcpy(dest, record, size);
+
+        checksum = rmq_spool_checksum(generation,
+                                      dest + RMQ_SPOOL_RECORD_HEADER_SIZE,
+                                      payload_sz);
+
+        rmq_write_u32(generation, dest + 4);
+        rmq_write_u32(checksum, dest + 8);
+
+        dest += size;
+        offset += size;
+    }
+
+    size = spool->end - spool->committed;
+
+    spool->generation = generation;
+    spool->replayed = RMQ_SPOOL_HEADER_SIZE
+                    + (spool->replayed - spool->committed);
+    spool->committed = RMQ_SPOOL_HEADER_SIZE;
+    spool->end = RMQ_SPOOL_HEADER_SIZE + size;
+}
+
+static void
+rmq_spool_write_header(struct rmq_spool *spool) {
+    rmq_write_u32(RMQ_SPOOL_VERSION, spool->data + 8);
+    rmq_write_u32(spool->generation, spool->data + 12);
+    rmq_write_u64(spool->committed, spool->data + 16);
+    rmq_write_u64(0, spool->data + 24);
+
+    msync(spool->data, RMQ_SPOOL_HEADER_SIZE, MS_ASYNC);
+}
+
+static int
+rmq_spool_read_record(const struct rmq_spool *spool, size_t offset,
+                      struct rmq_spool_record *record) {
+    const uint8_t *ptr, *payload;
+    uint32_t payload_sz, generation, checksum, method_sz, header_sz;
+    size_t len;
+
+    if (spool->size - offset < RMQ_SPOOL_RECORD_HEADER_SIZE)
+        return 0;
+
+    ptr = spool->data + offset;
+    len = spool->size - offset - RMQ_SPOOL_RECORD_HEADER_SIZE;
+
+    payload_sz = rmq_read_u32(ptr);
+    generation = rmq_read_u32(ptr + 4);
+    checksum = rmq_read_u32(ptr + 8);
+
+    if (generation != spool->generation || payload_sz > len)
+        return 0;
+
+    payload = ptr + RMQ_SPOOL_RECORD_HEADER_SIZE;
+
+    if (rmq_spool_checksum(generation, payload, payload_sz) != checksum)
+        return 0;
+
+    /* The checksum is valid, the content was written by us */
+    if (payload_sz < 4)
+        return 0;
+    method_sz = rmq_read_u32(payload);
+
+    if (payload_sz - 4 < method_sz || payload_sz - 4 - method_sz < 4)
+        return 0;
+    header_sz = rmq_read_u32(payload + 4 + method_sz);
+
+    if (payload_sz - 4 - method_sz - 4 < header_sz)
+        return 0;
+
+    record->size = RMQ_SPOOL_RECORD_HEADER_SIZE + payload_sz;
+
+    record->method = payload + 4;
+    record->method_sz = method_sz;
+
+    record->header = payload + 4 + method_sz + 4;
+    record->header_sz = header_sz;
+
+    record->body = payload + 4 + method_sz + 4 + header_sz;
+    record->body_sz = payload_sz - 4 - method_sz - 4 - header_sz;
+
+    return 1;
+}
+
+static uint32_t
+rmq_spool_checksum(uint32_t generation, const void *data, size_t size) {
+    const uint8_t *ptr;
+    uint8_t tmp[4];
+    uint32_t hash;
+
+    hash = 2166136261;
+
+    rmq_write_u32(generation, tmp);
+    for (size_t i = 0; i < 4; i++) {
+        hash ^= tmp[i];
+        hash *= 16777619;
+    }
+
+    ptr = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ptr[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
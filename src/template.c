@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "internal.h"
+
+static size_t rmq_property_offset(const struct rmq_properties *, uint16_t);
+
+/* ---------------------------------------------------------------------------
+ *  Publish template
+ * ------------------------------------------------------------------------ */
+struct rmq_publish_template *
+rmq_publish_template_new(const struct rmq_msg *msg, const char *exchange,
+                         const char *routing_key, uint32_t options) {
+    struct rmq_publish_template *template;
+    const struct rmq_properties *properties;
+    struct rmq_header_frame header_frame;
+
+    if (!routing_key)
+        routing_key = "";
+
+    properties = &msg->properties;
+
+    template = c_malloc0(sizeof(struct rmq_publish_template));
+
+    /* Method */
+    template->method = c_buffer_new();
+
+    rmq_fields_write(template->method,
+                     RMQ_FIELD_SHORT_UINT, RMQ_CLASS_BASIC,
+                     RMQ_FIELD_SHORT_UINT, RMQ_METHOD_BASIC_PUBLISH & 0xffff,
+                     RMQ_FIELD_SHORT_UINT, 0, /* reserved */
+                     RMQ_FIELD_SHORT_STRING, exchange,
+                     RMQ_FIELD_SHORT_STRING, routing_key,
+                     RMQ_FIELD_SHORT_SHORT_UINT, (uint8_t)options,
+                     RMQ_FIELD_END);
+
+    /* Header; the body size is set for each message */
+    rmq_header_frame_init(&header_frame);
+
+    header_frame.class_id = RMQ_CLASS_BASIC;
+    header_frame.body_size = 0;
+    header_frame.properties = properties;
+
+    template->header = c_buffer_new();
+    rmq_header_frame_write(&header_frame, template->header);
+
+    if (properties->mask & RMQ_PROPERTY_TIMESTAMP) {
+        template->timestamp_offset =
+            rmq_property_offset(properties, RMQ_PROPERTY_TIMESTAMP);
+    }
+
+    if (properties->mask & RMQ_PROPERTY_MESSAGE_ID) {
+        /* Skip the length of the short string */
+        template->message_id_offset =
+            rmq_property_offset(properties, RMQ_PROPERTY_MESSAGE_ID) + 1;
+        template->message_id_length = strlen(properties->message_id);
+    }
+
+    return template;
+}
+
+void
+rmq_publish_template_delete(struct rmq_publish_template *template) {
+    if (!template)
+        return;
+
+    c_buffer_delete(template->method);
+    c_buffer_delete(template->header);
+
+    c_free0(template, sizeof(struct rmq_publish_template));
+}
+
+int
+rmq_publish_template_set_timestamp(struct rmq_publish_template *template,
+                                   uint64_t timestamp) {
+    uint8_t *data;
+
+    if (template->timestamp_offset == 0) {
+        c_set_error("template does not contain any timestamp");
+        return -1;
+    }
+
+    data = c_buffer_data(template->header);
+    rmq_write_u64(timestamp, data + template->timestamp_offset);
+
+    return 0;
+}
+
+int
+rmq_publish_template_set_message_id(struct rmq_publish_template *template,
+                                    const char *id) {
+    uint8_t *data;
+    size_t length;
+
+    if (template->message_id_offset == 0) {
+        c_set_error("template does not contain any message id");
+        return -1;
+    }
+
+    /* The id is patched in place, it cannot change the size of the
+     * header frame */
+    length = strlen(id);
+    if (length != template->message_id_length) {
+        c_set_error("message id length is %zu instead of %zu",
+                    length, template->message_id_length);
+        return -1;
+    }
+
+    data = c_buffer_data(template->header);
+    memcpy(data + template->message_id_offset, id, length);
+
+    return 0;
+}
+
+void
+rmq_publish_template_set_body_size(struct rmq_publish_template *template,
+                                   uint64_t body_size) {
+    uint8_t *data;
+
+    /* The body size follows the class id and the weight */
+    data = c_buffer_data(template->header);
+    rmq_write_u64(body_size, data + 4);
+}
+
+void
+rmq_publish_template_write(struct rmq_publish_template *template,
+                           uint16_t channel, uint64_t body_size,
+                           struct c_buffer *buf) {
+    size_t offset;
+
+    offset = rmq_frame_write_start(RMQ_FRAME_TYPE_METHOD, channel, buf);
+    c_buffer_add(buf, c_buffer_data(template->method),
+                 c_buffer_length(template->method));
+    rmq_frame_write_end(offset, buf);
+
+    rmq_publish_template_set_body_size(template, body_size);
+
+    offset = rmq_frame_write_start(RMQ_FRAME_TYPE_HEADER, channel, buf);
+    c_buffer_add(buf, c_buffer_data(template->header),
+                 c_buffer_length(template->header));
+    rmq_frame_write_end(offset, buf);
+}
+
+static size_t
+rmq_property_offset(const struct rmq_properties *properties,
+                    uint16_t property) {
+    struct rmq_header_frame header_frame;
+    struct rmq_properties tmp;
+    struct c_buffer *buf;
+    size_t offset;
+
+    /* Properties are encoded in order of decreasing mask bits; the offset
+     * of a property is the size of a header containing only the properties
+     * which precede it. */
+    tmp = *properties;
+    tmp.mask &= (uint16_t)~((property << 1) - 1);
+
+    rmq_header_frame_init(&header_frame);
+
+    header_frame.class_id = RMQ_CLASS_BASIC;
+    header_frame.properties = &tmp;
+
+    buf = c_buffer_new();
+    rmq_header_frame_write(&header_frame, buf);
+    offset = c_buffer_length(buf);
+    c_buffer_delete(buf);
+
+    return offset;
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+
+#include "internal.h"
+
+/* Hierarchical timer wheel. Each level contains RMQ_TIMER_WHEEL_NB_SLOTS
+ * slots; a slot of level N covers RMQ_TIMER_WHEEL_NB_SLOTS^N ticks. Timers
+ * are stored in the slot of the lowest level able to contain them, and are
+ * moved down one level ("cascaded") when the level below wraps around.
+ * Adding, removing and expiring a timer are constant time operations. */
+
+#define RMQ_TIMER_WHEEL_SLOT_MASK (RMQ_TIMER_WHEEL_NB_SLOTS - 1)
+
+static struct rmq_timer *rmq_timer_wheel_alloc(struct rmq_timer_wheel *);
+static void rmq_timer_wheel_insert(struct rmq_timer_wheel *,
+                                   struct rmq_timer *);
+static void rmq_timer_wheel_unlink(struct rmq_timer_wheel *,
+                                   struct rmq_timer *);
+static void rmq_timer_wheel_cascade(struct rmq_timer_wheel *, unsigned int);
+
+/* ---------------------------------------------------------------------------
+ *  Timer wheel
+ * ------------------------------------------------------------------------ */
+void
+rmq_timer_wheel_init(struct rmq_timer_wheel *wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(struct rmq_timer_wheel));
+
+    wheel->tick = now / RMQ_TIMER_WHEEL_TICK;
+}
+
+void
+rmq_timer_wheel_free(struct rmq_timer_wheel *wheel) {
+    struct rmq_timer *timer, *next;
+
+    if (!wheel)
+        return;
+
+    for (unsigned int l = 0; l < RMQ_TIMER_WHEEL_NB_LEVELS; l++) {
+        for (unsigned int s = 0; s < RMQ_TIMER_WHEEL_NB_SLOTS; s++) {
+            timer = wheel->slots[l][s];
+            while (timer) {
+                next = timer->next;
+                c_free0(timer, sizeof(struct rmq_timer));
+                timer = next;
+            }
+        }
+    }
+
+    timer = wheel->free_timers;
+    while (timer) {
+        next = timer->next;
+        c_free0(timer, sizeof(struct rmq_timer));
+        timer = next;
+    }
+
+    memset(wheel, 0, sizeof(struct rmq_timer_wheel));
+}
+
+struct rmq_timer *
+rmq_timer_wheel_add(struct rmq_timer_wheel *wheel, uint64_t now,
+                    uint64_t delay, rmq_timer_cb cb, void *arg,
+                    uint64_t value) {
+    struct rmq_timer *timer;
+    uint64_t expiry;
+
+    if (delay > RMQ_TIMER_WHEEL_MAX_DELAY)
+        delay = RMQ_TIMER_WHEEL_MAX_DELAY;
+
+    /* The wheel may lag behind the clock, expiry is computed from the
+     * current time. A timer never expires during the current tick. */
+    expiry = (now + delay + RMQ_TIMER_WHEEL_TICK - 1) / RMQ_TIMER_WHEEL_TICK;
+    if (expiry <= wheel->tick)
+        expiry = wheel->tick + 1;
+
+    timer = rmq_timer_wheel_alloc(wheel);
+
+    timer->expiry = expiry;
+    timer->cb = cb;
+    timer->arg = arg;
+    timer->value = value;
+
+    rmq_timer_wheel_insert(wheel, timer);
+    wheel->nb_timers++;
+
+    return timer;
+}
+
+void
+rmq_timer_wheel_remove(struct rmq_timer_wheel *wheel,
+                       struct rmq_timer *timer) {
+    rmq_timer_wheel_unlink(wheel, timer);
+    wheel->nb_timers--;
+
+    timer->next = wheel->free_timers;
+    wheel->free_timers = timer;
+}
+
+void
+rmq_timer_wheel_advance(struct rmq_timer_wheel *wheel, uint64_t now) {
+    uint64_t target;
+
+    target = now / RMQ_TIMER_WHEEL_TICK;
+
+    while (wheel->tick < target) {
+        struct rmq_timer **slot;
+
+        if (wheel->nb_timers == 0) {
+            wheel->tick = target;
+            break;
+        }
+
+        wheel->tick++;
+
+        for (unsigned int l = 1; l < RMQ_TIMER_WHEEL_NB_LEVELS; l++) {
+            unsigned int shift;
+
+            shift = (l - 1) * RMQ_TIMER_WHEEL_SLOT_BITS;
+            if (((wheel->tick >> shift) & RMQ_TIMER_WHEEL_SLOT_MASK) != 0)
+                break;
+
+            rmq_timer_wheel_cascade(wheel, l);
+        }
+
+        /* Callbacks can add and remove timers, including the ones stored
+         * in the current slot, so timers are detached one at a time. */
+        slot = &wheel->slots[0][wheel->tick & RMQ_TIMER_WHEEL_SLOT_MASK];
+
+        while (*slot) {
+            struct rmq_timer *timer;
+            rmq_timer_cb cb;
+            void *arg;
+            uint64_t value;
+
+            timer = *slot;
+
+            cb = timer->cb;
+            arg = timer->arg;
+            value = timer->value;
+
+            rmq_timer_wheel_remove(wheel, timer);
+
+            cb(arg, value);
+        }
+    }
+}
+
+uint64_t
+rmq_timer_wheel_next_expiry(const struct rmq_timer_wheel *wheel) {
+    uint64_t next;
+
+    if (wheel->nb_timers == 0)
+        return 0;
+
+    /* The first non-empty slot of each level contains the earliest timer
+     * of this level; level 0 slots only contain timers expiring at the
+     * same tick, but slots of higher levels must be scanned. */
+    next = UINT64_MAX;
+
+    for (unsigned int l = 0; l < RMQ_TIMER_WHEEL_NB_LEVELS; l++) {
+        uint64_t base;
+
+        base = wheel->tick >> (l * RMQ_TIMER_WHEEL_SLOT_BITS);
+
+        for (unsigned int d = 1; d <= RMQ_TIMER_WHEEL_NB_SLOTS; d++) {
+            const struct rmq_timer *timer;
+
+            timer = wheel->slots[l][(base + d) & RMQ_TIMER_WHEEL_SLOT_MASK];
+            if (!timer)
+                continue;
+
+            for (; timer; timer = timer->next) {
+                if (timer->expiry < next)
+                    next = timer->expiry;
+            }
+
+            break;
+        }
+    }
+
+    return next;
+}
+
+static struct rmq_timer *
+rmq_timer_wheel_alloc(struct rmq_timer_wheel *wheel) {
+    struct rmq_timer *timer;
+
+    /* Timers are recycled; allocating one is a common operation when each
+     * message or call has its own deadline. */
+    timer = wheel->free_timers;
+    if (timer) {
+        wheel->free_timers = timer->next;
+        memset(timer, 0, sizeof(struct rmq_timer));
+    } else {
+        timer = c_malloc0(sizeof(struct rmq_timer));
+    }
+
+    return timer;
+}
+
+static void
+rmq_timer_wheel_insert(struct rmq_timer_wheel *wheel,
+                       struct rmq_timer *timer) {
+    struct rmq_timer **slot;
+    uint64_t delta;
+    unsigned int level, shift;
+
+    assert(timer->expiry >= wheel->tick);
+
+    delta = timer->expiry - wheel->tick;
+
+    level = 0;
+    while (level < RMQ_TIMER_WHEEL_NB_LEVELS - 1
+        && delta >= UINT64_C(1) << ((level + 1) * RMQ_TIMER_WHEEL_SLOT_BITS)) {
+        level++;
+    }
+
+    shift = level * RMQ_TIMER_WHEEL_SLOT_BITS;
+    slot = &wheel->slots[level][(timer->expiry >> shift)
+                                & RMQ_TIMER_WHEEL_SLOT_MASK];
+
+    timer->slot = slot;
+
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot)
+        (*slot)->prev = timer;
+    *slot = timer;
+}
+
+static void
+rmq_timer_wheel_unlink(struct rmq_timer_wheel *wheel,
+                       struct rmq_timer *timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    timer->slot = NULL;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+static void
+rmq_timer_wheel_cascade(struct rmq_timer_wheel *wheel, unsigned int level) {
+    struct rmq_timer *timer, *next;
+    unsigned int shift;
+    size_t index;
+
+    shift = level * RMQ_TIMER_WHEEL_SLOT_BITS;
+    index = (wheel->tick >> shift) & RMQ_TIMER_WHEEL_SLOT_MASK;
+
+    timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+
+    while (timer) {
+        next = timer->next;
+        rmq_timer_wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ *  Clock
+ * ------------------------------------------------------------------------ */
+uint64_t
+rmq_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,1878 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+/* The glibc version of netinet/tcp.h does not define struct tcp_info when
+ * _POSIX_C_SOURCE is set. */
+#ifdef RMQ_PLATFORM_LINUX
+#   include <linux/tcp.h>
+#else
+#   include <netinet/tcp.h>
+#endif
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "internal.h"
+
+/* Plain sockets are read in a loop until this amount of data has been read
+ * so that a fast server cannot fill the read buffer indefinitely. TLS
+ * connections are always drained since OpenSSL may buffer decrypted data
+ * which would not trigger another read event. */
+#define RMQ_TRANSPORT_MAX_READ_SIZE (1024 * 1024)
+
+static void rmq_transport_signal_event(struct rmq_transport *,
+                                       enum rmq_transport_event);
+static void rmq_transport_abort(struct rmq_transport *);
+
+static int rmq_transport_watch(struct rmq_transport *, uint32_t);
+static void rmq_transport_update_watch(struct rmq_transport *);
+
+static void rmq_transport_set_endpoints(struct rmq_transport *,
+                                        const struct rmq_endpoint *, size_t);
+static void rmq_transport_endpoint_free(struct rmq_transport_endpoint *);
+static struct rmq_transport_endpoint *
+rmq_transport_current_endpoint(const struct rmq_transport *);
+static void rmq_transport_on_endpoint_failure(struct rmq_transport *,
+                                              size_t);
+static int rmq_transport_check_endpoints(struct rmq_transport *,
+                                         const struct rmq_endpoint *,
+                                         size_t);
+
+static int rmq_transport_start(struct rmq_transport *);
+static size_t rmq_transport_resolve(struct rmq_transport *, bool);
+static int rmq_transport_resolve_endpoint(struct rmq_transport *, size_t);
+static void rmq_transport_add_addresses(struct rmq_transport *, size_t,
+                                        const struct addrinfo *);
+static void rmq_transport_on_resolved(const char *, uint16_t,
+                                      const struct addrinfo *, void *);
+static int rmq_transport_schedule_attempts(struct rmq_transport *);
+static void rmq_transport_check_attempts(struct rmq_transport *);
+static bool rmq_transport_start_attempt(struct rmq_transport *);
+static size_t rmq_transport_nb_attempts(const struct rmq_transport *);
+static void rmq_transport_close_attempt(struct rmq_transport_attempt *);
+static void rmq_transport_cancel_attempts(struct rmq_transport *);
+static void rmq_transport_on_attempt_event(int, uint32_t, void *);
+static void rmq_transport_on_attempt_timer(int, uint64_t, void *);
+static void rmq_transport_on_attempt_timeout(int, uint64_t, void *);
+static void rmq_transport_on_attempt_failure(struct rmq_transport_attempt *,
+                                             const char *);
+static void rmq_transport_on_attempt_connected(struct rmq_transport_attempt *);
+static void rmq_transport_init_connection(struct rmq_transport *, int);
+
+static int rmq_transport_open_socket(struct rmq_transport *, int,
+                                     const struct sockaddr *, socklen_t);
+static int rmq_transport_setup_socket(struct rmq_transport *, int, int);
+static int rmq_transport_set_socket_option(int, int, int, uint32_t);
+static uint32_t rmq_transport_socket_buffer_size(int, int);
+static void rmq_transport_grow_buffer(struct rmq_transport *, int,
+                                      uint32_t *, uint64_t);
+
+static void rmq_transport_on_fd_event(int, uint32_t, void *);
+static void rmq_transport_on_established(struct rmq_transport *);
+
+static int rmq_transport_start_tls(struct rmq_transport *);
+static void rmq_transport_tls_handshake(struct rmq_transport *);
+static void rmq_transport_on_handshake_timer(int, uint64_t, void *);
+static int rmq_transport_on_tls_session(SSL *, SSL_SESSION *);
+static const char *rmq_transport_tls_error(void);
+
+static void rmq_transport_read(struct rmq_transport *);
+static int rmq_transport_recv(struct rmq_transport *, void *, size_t,
+                              size_t *, bool *);
+static void rmq_transport_flush(struct rmq_transport *);
+static int rmq_transport_send(struct rmq_transport *, const void *, size_t,
+                              size_t *);
+
+struct rmq_transport *
+rmq_transport_new(struct io_base *io_base,
+                  rmq_transport_event_cb cb, void *cb_arg) {
+    struct rmq_transport *transport;
+
+    transport = c_malloc0(sizeof(struct rmq_transport));
+
+    transport->io_base = io_base;
+
+    transport->state = RMQ_TRANSPORT_STATE_DISCONNECTED;
+    transport->sock = -1;
+
+    transport->handshake_timer = -1;
+
+    transport->rbuf = c_buffer_new();
+    transport->wbuf = c_buffer_new();
+
+    transport->event_cb = cb;
+    transport->event_cb_arg = cb_arg;
+
+    transport->endpoints =
+        c_vector_new(sizeof(struct rmq_transport_endpoint));
+
+    transport->addresses = c_vector_new(sizeof(struct rmq_transport_address));
+
+    transport->resolver = rmq_resolver_new(io_base, rmq_transport_on_resolved,
+                                           transport);
+
+    for (size_t i = 0; i < RMQ_TRANSPORT_MAX_ATTEMPTS; i++) {
+        transport->attempts[i].transport = transport;
+        transport->attempts[i].sock = -1;
+        transport->attempts[i].timer = -1;
+    }
+
+    transport->attempt_timer = -1;
+
+    return transport;
+}
+
+void
+rmq_transport_delete(struct rmq_transport *transport) {
+    if (!transport)
+        return;
+
+    rmq_transport_close(transport);
+
+    rmq_transport_set_endpoints(transport, NULL, 0);
+    c_vector_delete(transport->endpoints);
+
+    c_vector_delete(transport->addresses);
+
+    rmq_resolver_delete(transport->resolver);
+
+    c_buffer_delete(transport->rbuf);
+    c_buffer_delete(transport->wbuf);
+
+    if (transport->ssl_ctx)
+        SSL_CTX_free(transport->ssl_ctx);
+    c_free(transport->ssl_server_name);
+
+    c_free0(transport, sizeof(struct rmq_transport));
+}
+
+int
+rmq_transport_enable_tls(struct rmq_transport *transport,
+                         const struct rmq_tls_cfg *cfg) {
+    const char *key_path;
+    SSL_CTX *ctx;
+
+    ERR_clear_error();
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        c_set_error("cannot create tls context: %s",
+                    rmq_transport_tls_error());
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    /* The write buffer can be reallocated between two attempts to write
+     * the same data. */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                        | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* RabbitMQ closes the connection without sending close_notify after
+     * Connection.Close-Ok. */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+#ifdef SSL_OP_ENABLE_KTLS
+    /* OpenSSL silently falls back to userspace encryption if the cipher
+     * or the kernel do not support offloading. */
+    if (!cfg->disable_kernel_tls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    /* Sessions are kept by the transport instead of the internal cache of
+     * the context; the callback is also the only way to obtain TLS 1.3
+     * tickets, which are sent after the handshake. */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT
+                                      | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, rmq_transport_on_tls_session);
+
+    if (cfg->ca_certificate_path) {
+        if (SSL_CTX_load_verify_locations(ctx, cfg->ca_certificate_path,
+                                          NULL) != 1) {
+            c_set_error("cannot load ca certificates from %s: %s",
+                        cfg->ca_certificate_path, rmq_transport_tls_error());
+            goto error;
+        }
+    } else {
+        if (SSL_CTX_set_default_verify_paths(ctx) != 1) {
+            c_set_error("cannot load default ca certificates: %s",
+                        rmq_transport_tls_error());
+            goto error;
+        }
+    }
+
+    if (cfg->certificate_path) {
+        key_path = cfg->private_key_path;
+        if (!key_path)
+            key_path = cfg->certificate_path;
+
+        if (SSL_CTX_use_certificate_chain_file(ctx,
+                                               cfg->certificate_path) != 1) {
+            c_set_error("cannot load certificate from %s: %s",
+                        cfg->certificate_path, rmq_transport_tls_error());
+            goto error;
+        }
+
+        if (SSL_CTX_use_PrivateKey_file(ctx, key_path,
+                                        SSL_FILETYPE_PEM) != 1) {
+            c_set_error("cannot load private key from %s: %s",
+                        key_path, rmq_transport_tls_error());
+            goto error;
+        }
+
+        if (SSL_CTX_check_private_key(ctx) != 1) {
+            c_set_error("invalid private key: %s",
+                        rmq_transport_tls_error());
+            goto error;
+        }
+    }
+
+    transport->ssl_verify = !cfg->skip_verification;
+    SSL_CTX_set_verify(ctx, transport->ssl_verify ? SSL_VERIFY_PEER
+                                                  : SSL_VERIFY_NONE, NULL);
+
+    if (transport->ssl_ctx)
+        SSL_CTX_free(transport->ssl_ctx);
+    transport->ssl_ctx = ctx;
+
+    c_free(transport->ssl_server_name);
+    transport->ssl_server_name = NULL;
+    if (cfg->server_name)
+        transport->ssl_server_name = c_strdup(cfg->server_name);
+
+    for (size_t i = 0; i < c_vector_length(transport->endpoints); i++) {
+        struct rmq_transport_endpoint *endpoint;
+
+        endpoint = c_vector_entry(transport->endpoints, i);
+        if (endpoint->ssl_session) {
+            SSL_SESSION_free(endpoint->ssl_session);
+            endpoint->ssl_session = NULL;
+        }
+    }
+
+    return 0;
+
+error:
+    SSL_CTX_free(ctx);
+    return -1;
+}
+
+void
+rmq_transport_set_socket_cfg(struct rmq_transport *transport,
+                             const struct rmq_socket_cfg *cfg) {
+    transport->socket_cfg = *cfg;
+}
+
+void
+rmq_transport_set_dns_cache_ttl(struct rmq_transport *transport,
+                                uint64_t ttl) {
+    rmq_resolver_set_ttl(transport->resolver, ttl);
+}
+
+int
+rmq_transport_connect(struct rmq_transport *transport,
+                      const char *host, uint16_t port) {
+    struct rmq_endpoint endpoint;
+
+    memset(&endpoint, 0, sizeof(struct rmq_endpoint));
+    endpoint.host = host;
+    endpoint.port = port;
+
+    return rmq_transport_connect_endpoints(transport, &endpoint, 1);
+}
+
+int
+rmq_transport_connect_unix(struct rmq_transport *transport,
+                           const char *path) {
+    struct rmq_endpoint endpoint;
+
+    memset(&endpoint, 0, sizeof(struct rmq_endpoint));
+    endpoint.path = path;
+
+    return rmq_transport_connect_endpoints(transport, &endpoint, 1);
+}
+
+int
+rmq_transport_connect_endpoints(struct rmq_transport *transport,
+                                const struct rmq_endpoint *endpoints,
+                                size_t nb_endpoints) {
+    if (transport->state != RMQ_TRANSPORT_STATE_DISCONNECTED) {
+        c_set_error("transport already connected");
+        return -1;
+    }
+
+    if (rmq_transport_check_endpoints(transport, endpoints,
+                                      nb_endpoints) == -1) {
+        return -1;
+    }
+
+    rmq_transport_set_endpoints(transport, endpoints, nb_endpoints);
+
+    return rmq_transport_start(transport);
+}
+
+int
+rmq_transport_attach(struct rmq_transport *transport, int sock,
+                     const struct rmq_endpoint *endpoints,
+                     size_t nb_endpoints, size_t endpoint) {
+    int flags;
+
+    if (transport->state != RMQ_TRANSPORT_STATE_DISCONNECTED) {
+        c_set_error("transport already connected");
+        return -1;
+    }
+
+    if (transport->ssl_ctx) {
+        c_set_error("cannot attach a socket to a tls transport");
+        return -1;
+    }
+
+    if (rmq_transport_check_endpoints(transport, endpoints,
+                                      nb_endpoints) == -1) {
+        return -1;
+    }
+
+    if (endpoint >= nb_endpoints) {
+        c_set_error("invalid endpoint index");
+        return -1;
+    }
+
+    flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        c_set_error("cannot set socket non-blocking: %s", strerror(errno));
+        return -1;
+    }
+
+    if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
+        c_set_error("cannot set close-on-exec flag: %s", strerror(errno));
+        return -1;
+    }
+
+    rmq_transport_set_endpoints(transport, endpoints, nb_endpoints);
+    transport->endpoint = endpoint;
+
+    c_buffer_clear(transport->rbuf);
+    c_buffer_clear(transport->wbuf);
+
+    rmq_transport_init_connection(transport, sock);
+
+    transport->state = RMQ_TRANSPORT_STATE_CONNECTED;
+
+    /* Unlike a new connection, no event is signaled: the caller already
+     * knows the state of the connection. */
+    if (rmq_transport_watch(transport, IO_EVENT_FD_READ) == -1) {
+        transport->sock = -1;
+        transport->state = RMQ_TRANSPORT_STATE_DISCONNECTED;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+rmq_transport_detach(struct rmq_transport *transport) {
+    int sock;
+
+    if (transport->state != RMQ_TRANSPORT_STATE_CONNECTED) {
+        c_set_error("transport not connected");
+        return -1;
+    }
+
+    if (transport->ssl) {
+        c_set_error("cannot detach the socket of a tls connection");
+        return -1;
+    }
+
+    if (transport->events != 0) {
+        io_base_unwatch_fd(transport->io_base, transport->sock);
+        transport->events = 0;
+    }
+
+    sock = transport->sock;
+    transport->sock = -1;
+
+    c_buffer_clear(transport->rbuf);
+    c_buffer_clear(transport->wbuf);
+
+    transport->state = RMQ_TRANSPORT_STATE_DISCONNECTED;
+    return sock;
+}
+
+int
+rmq_transport_reconnect(struct rmq_transport *transport) {
+    if (transport->state != RMQ_TRANSPORT_STATE_DISCONNECTED) {
+        c_set_error("transport already connected");
+        return -1;
+    }
+
+    if (c_vector_length(transport->endpoints) == 0) {
+        c_set_error("transport was never connected");
+        return -1;
+    }
+
+    return rmq_transport_start(transport);
+}
+
+void
+rmq_transport_disconnect(struct rmq_transport *transport) {
+    switch (transport->state) {
+    case RMQ_TRANSPORT_STATE_DISCONNECTED:
+    case RMQ_TRANSPORT_STATE_DISCONNECTING:
+        break;
+
+    case RMQ_TRANSPORT_STATE_CONNECTING:
+    case RMQ_TRANSPORT_STATE_TLS_HANDSHAKE:
+        rmq_transport_close(transport);
+        rmq_transport_signal_event(transport,
+                                   RMQ_TRANSPORT_EVENT_CONN_CLOSED);
+        break;
+
+    case RMQ_TRANSPORT_STATE_CONNECTED:
+        /* The connection is closed once the write buffer has been flushed.
+         * Waiting for the next write event means that the connection is
+         * never closed while the caller is processing data. */
+        transport->state = RMQ_TRANSPORT_STATE_DISCONNECTING;
+
+        if (rmq_transport_watch(transport, IO_EVENT_FD_WRITE) == -1)
+            rmq_transport_abort(transport);
+        break;
+    }
+}
+
+void
+rmq_transport_close(struct rmq_transport *transport) {
+    rmq_transport_cancel_attempts(transport);
+
+    if (transport->handshake_timer >= 0) {
+        io_base_remove_timer(transport->io_base, transport->handshake_timer);
+        transport->handshake_timer = -1;
+    }
+
+    if (transport->sock == -1) {
+        transport->state = RMQ_TRANSPORT_STATE_DISCONNECTED;
+        return;
+    }
+
+    if (transport->events != 0) {
+        io_base_unwatch_fd(transport->io_base, transport->sock);
+        transport->events = 0;
+    }
+
+    if (transport->ssl) {
+        SSL_free(transport->ssl);
+        transport->ssl = NULL;
+    }
+
+    transport->ktls_send = false;
+    transport->ktls_recv = false;
+
+    close(transport->sock);
+    transport->sock = -1;
+
+    transport->state = RMQ_TRANSPORT_STATE_DISCONNECTED;
+}
+
+bool
+rmq_transport_is_connected(const struct rmq_transport *transport) {
+    return transport->state == RMQ_TRANSPORT_STATE_CONNECTED;
+}
+
+bool
+rmq_transport_is_tls_session_reused(const struct rmq_transport *transport) {
+    return transport->ssl && SSL_session_reused(transport->ssl);
+}
+
+void
+rmq_transport_tune_buffers(struct rmq_transport *transport, uint64_t now) {
+#ifdef TCP_INFO
+    uint64_t elapsed, rtt, send_rate, receive_rate;
+    struct tcp_info info;
+    socklen_t len;
+
+    if (transport->state != RMQ_TRANSPORT_STATE_CONNECTED)
+        return;
+    if (!transport->socket_cfg.auto_buffer_size)
+        return;
+    if (rmq_transport_current_endpoint(transport)->path)
+        return;
+
+    if (now <= transport->tuning_time)
+        return;
+    elapsed = now - transport->tuning_time;
+
+    len = sizeof(struct tcp_info);
+    if (getsockopt(transport->sock, IPPROTO_TCP, TCP_INFO,
+                   &info, &len) == -1) {
+        return;
+    }
+
+    rtt = info.tcpi_rtt; /* microseconds */
+
+    /* Bytes per second since the last adjustment */
+    send_rate = (transport->nb_bytes_sent - transport->tuning_nb_bytes_sent)
+              * 1000 / elapsed;
+    receive_rate = (transport->nb_bytes_received
+                    - transport->tuning_nb_bytes_received)
+                 * 1000 / elapsed;
+
+    rmq_transport_grow_buffer(transport, SO_SNDBUF,
+                              &transport->send_buffer_size,
+                              send_rate * rtt / 1000000);
+    rmq_transport_grow_buffer(transport, SO_RCVBUF,
+                              &transport->receive_buffer_size,
+                              receive_rate * rtt / 1000000);
+
+    transport->tuning_time = now;
+    transport->tuning_nb_bytes_sent = transport->nb_bytes_sent;
+    transport->tuning_nb_bytes_received = transport->nb_bytes_received;
+#endif
+}
+
+struct c_buffer *
+rmq_transport_rbuf(const struct rmq_transport *transport) {
+    return transport->rbuf;
+}
+
+struct c_buffer *
+rmq_transport_wbuf(const struct rmq_transport *transport) {
+    return transport->wbuf;
+}
+
+void
+rmq_transport_signal_data_written(struct rmq_transport *transport) {
+    if (transport->state != RMQ_TRANSPORT_STATE_CONNECTED)
+        return;
+
+    rmq_transport_update_watch(transport);
+}
+
+void
+rmq_transport_write(struct rmq_transport *transport,
+                    const void *data, size_t size) {
+    c_buffer_add(transport->wbuf, data, size);
+    rmq_transport_signal_data_written(transport);
+}
+
+static void
+rmq_transport_signal_event(struct rmq_transport *transport,
+                           enum rmq_transport_event event) {
+    if (transport->event_cb)
+        transport->event_cb(transport, event, transport->event_cb_arg);
+}
+
+static void
+rmq_transport_abort(struct rmq_transport *transport) {
+    enum rmq_transport_state state;
+
+    state = transport->state;
+
+    rmq_transport_signal_event(transport, RMQ_TRANSPORT_EVENT_ERROR);
+    rmq_transport_close(transport);
+
+    rmq_transport_on_endpoint_failure(transport, transport->endpoint);
+
+    if (state == RMQ_TRANSPORT_STATE_CONNECTING
+     || state == RMQ_TRANSPORT_STATE_TLS_HANDSHAKE) {
+        rmq_transport_signal_event(transport,
+                                   RMQ_TRANSPORT_EVENT_CONN_FAILED);
+    } else {
+        rmq_transport_signal_event(transport,
+                                   RMQ_TRANSPORT_EVENT_CONN_CLOSED);
+    }
+}
+
+static int
+rmq_transport_watch(struct rmq_transport *transport, uint32_t events) {
+    if (events == transport->events)
+        return 0;
+
+    if (transport->events != 0) {
+        io_base_unwatch_fd(transport->io_base, transport->sock);
+        transport->events = 0;
+    }
+
+    if (io_base_watch_fd(transport->io_base, transport->sock, events,
+                         rmq_transport_on_fd_event, transport) == -1) {
+        return -1;
+    }
+
+    transport->events = events;
+    return 0;
+}
+
+static void
+rmq_transport_update_watch(struct rmq_transport *transport) {
+    uint32_t events;
+
+    events = IO_EVENT_FD_READ;
+    if (c_buffer_length(transport->wbuf) > 0)
+        events |= IO_EVENT_FD_WRITE;
+
+    if (rmq_transport_watch(transport, events) == -1)
+        rmq_transport_abort(transport);
+}
+
+static void
+rmq_transport_set_endpoints(struct rmq_transport *transport,
+                            const struct rmq_endpoint *endpoints,
+                            size_t nb_endpoints) {
+    struct c_vector *old_endpoints;
+
+    old_endpoints = transport->endpoints;
+    transport->endpoints =
+        c_vector_new(sizeof(struct rmq_transport_endpoint));
+
+    for (size_t i = 0; i < nb_endpoints; i++) {
+        const struct rmq_endpoint *endpoint;
+        struct rmq_transport_endpoint tendpoint;
+
+        endpoint = endpoints + i;
+
+        memset(&tendpoint, 0, sizeof(struct rmq_transport_endpoint));
+
+        /* Keep the session and the failure history of endpoints which were
+         * already known */
+        for (size_t j = 0; j < c_vector_length(old_endpoints); j++) {
+            struct rmq_transport_endpoint *old;
+
+            old = c_vector_entry(old_endpoints, j);
+            if (!old->host && !old->path)
+                continue;
+
+            if (endpoint->path) {
+                if (!old->path || strcmp(old->path, endpoint->path) != 0)
+                    continue;
+            } else {
+                if (!old->host || strcmp(old->host, endpoint->host) != 0
+                 || old->port != endpoint->port) {
+                    continue;
+                }
+            }
+
+            tendpoint = *old;
+            memset(old, 0, sizeof(struct rmq_transport_endpoint));
+            break;
+        }
+
+        if (!tendpoint.host && !tendpoint.path) {
+            if (endpoint->path) {
+                tendpoint.path = c_strdup(endpoint->path);
+            } else {
+                tendpoint.host = c_strdup(endpoint->host);
+                tendpoint.port = endpoint->port;
+            }
+        }
+
+        c_vector_append(transport->endpoints, &tendpoint);
+    }
+
+    for (size_t i = 0; i < c_vector_length(old_endpoints); i++)
+        rmq_transport_endpoint_free(c_vector_entry(old_endpoints, i));
+    c_vector_delete(old_endpoints);
+
+    transport->endpoint = 0;
+}
+
+static void
+rmq_transport_endpoint_free(struct rmq_transport_endpoint *endpoint) {
+    c_free(endpoint->host);
+    c_free(endpoint->path);
+
+    if (endpoint->ssl_session)
+        SSL_SESSION_free(endpoint->ssl_session);
+
+    memset(endpoint, 0, sizeof(struct rmq_transport_endpoint));
+}
+
+static struct rmq_transport_endpoint *
+rmq_transport_current_endpoint(const struct rmq_transport *transport) {
+    return c_vector_entry(transport->endpoints, transport->endpoint);
+}
+
+static void
+rmq_transport_on_endpoint_failure(struct rmq_transport *transport,
+                                  size_t idx) {
+    struct rmq_transport_endpoint *endpoint;
+    uint64_t backoff;
+    unsigned int shift;
+
+    if (idx >= c_vector_length(transport->endpoints))
+        return;
+
+    endpoint = c_vector_entry(transport->endpoints, idx);
+
+    endpoint->nb_failures++;
+
+    shift = endpoint->nb_failures - 1;
+    if (shift > 16)
+        shift = 16;
+
+    backoff = (uint64_t)RMQ_TRANSPORT_MIN_BACKOFF << shift;
+    if (backoff > RMQ_TRANSPORT_MAX_BACKOFF)
+        backoff = RMQ_TRANSPORT_MAX_BACKOFF;
+
+    endpoint->retry_time = rmq_now_ms() + backoff;
+
+    /* The next connection starts with the following endpoint */
+    if (idx == transport->endpoint) {
+        transport->endpoint =
+            (transport->endpoint + 1) % c_vector_length(transport->endpoints);
+    }
+}
+
+static int
+rmq_transport_check_endpoints(struct rmq_transport *transport,
+                              const struct rmq_endpoint *endpoints,
+                              size_t nb_endpoints) {
+    struct sockaddr_un addr;
+
+    if (nb_endpoints == 0) {
+        c_set_error("no endpoint");
+        return -1;
+    }
+
+    for (size_t i = 0; i < nb_endpoints; i++) {
+        const struct rmq_endpoint *endpoint;
+
+        endpoint = endpoints + i;
+
+        if (endpoint->path) {
+            if (strlen(endpoint->path) >= sizeof(addr.sun_path)) {
+                c_set_error("socket path too long");
+                return -1;
+            }
+
+            if (transport->ssl_ctx && !transport->ssl_server_name) {
+                c_set_error("missing tls server name");
+                return -1;
+            }
+        } else if (!endpoint->host) {
+            c_set_error("missing endpoint host");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+rmq_transport_start(struct rmq_transport *transport) {
+    /* Healthy endpoints are used first; endpoints whose backoff delay has
+     * not expired are only used if there is nothing else to try. */
+    if (rmq_transport_resolve(transport, false) == 0)
+        rmq_transport_resolve(transport, true);
+
+    if (c_vector_length(transport->addresses) == 0
+     && transport->nb_resolving_endpoints == 0) {
+        return -1;
+    }
+
+    c_buffer_clear(transport->rbuf);
+    c_buffer_clear(transport->wbuf);
+
+    transport->state = RMQ_TRANSPORT_STATE_CONNECTING;
+
+    /* If all host names are being resolved, the first attempt starts when
+     * the first result is available. */
+    if (!rmq_transport_start_attempt(transport)
+     && transport->nb_resolving_endpoints == 0) {
+        rmq_transport_close(transport);
+        return -1;
+    }
+
+    if (rmq_transport_schedule_attempts(transport) == -1) {
+        rmq_transport_close(transport);
+        return -1;
+    }
+
+    return 0;
+}
+
+static size_t
+rmq_transport_resolve(struct rmq_transport *transport, bool all) {
+    size_t nb_endpoints, nb_used, start;
+    uint64_t now;
+
+    c_vector_delete(transport->addresses);
+    transport->addresses = c_vector_new(sizeof(struct rmq_transport_address));
+    transport->next_address = 0;
+
+    nb_endpoints = c_vector_length(transport->endpoints);
+    now = rmq_now_ms();
+
+    nb_used = 0;
+
+    /* Failures change the current endpoint */
+    start = transport->endpoint;
+
+    for (size_t i = 0; i < nb_endpoints; i++) {
+        struct rmq_transport_endpoint *endpoint;
+        size_t idx;
+
+        idx = (start + i) % nb_endpoints;
+        endpoint = c_vector_entry(transport->endpoints, idx);
+
+        if (!all && endpoint->retry_time > now)
+            continue;
+
+        nb_used++;
+
+        if (rmq_transport_resolve_endpoint(transport, idx) == -1)
+            rmq_transport_on_endpoint_failure(transport, idx);
+    }
+
+    return nb_used;
+}
+
+static int
+rmq_transport_resolve_endpoint(struct rmq_transport *transport, size_t idx) {
+    struct rmq_transport_endpoint *endpoint;
+    struct rmq_transport_address address;
+    const struct addrinfo *cached_res;
+    struct addrinfo hints, *res;
+    char service[8];
+    int ret;
+
+    endpoint = c_vector_entry(transport->endpoints, idx);
+
+    memset(&address, 0, sizeof(struct rmq_transport_address));
+    address.endpoint = idx;
+
+    if (endpoint->path) {
+        struct sockaddr_un *addr;
+
+        addr = (struct sockaddr_un *)&address.addr;
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, endpoint->path, strlen(endpoint->path));
+
+        address.addr_len = sizeof(struct sockaddr_un);
+
+        c_vector_append(transport->addresses, &address);
+        return 0;
+    }
+
+    /* Numeric addresses do not require a DNS query */
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    snprintf(service, sizeof(service), "%u", endpoint->port);
+
+    if (getaddrinfo(endpoint->host, service, &hints, &res) == 0) {
+        rmq_transport_add_addresses(transport, idx, res);
+        freeaddrinfo(res);
+        return 0;
+    }
+
+    ret = rmq_resolver_lookup(transport->resolver,
+                              endpoint->host, endpoint->port, &cached_res);
+    if (ret == -1) {
+        return -1;
+    } else if (ret == 1) {
+        rmq_transport_add_addresses(transport, idx, cached_res);
+        return 0;
+    }
+
+    if (!endpoint->resolving) {
+        if (rmq_resolver_resolve(transport->resolver,
+                                 endpoint->host, endpoint->port) == -1) {
+            return -1;
+        }
+
+        endpoint->resolving = true;
+        transport->nb_resolving_endpoints++;
+    }
+
+    return 0;
+}
+
+static void
+rmq_transport_add_addresses(struct rmq_transport *transport, size_t idx,
+                            const struct addrinfo *res) {
+    struct rmq_transport_address address;
+
+    memset(&address, 0, sizeof(struct rmq_transport_address));
+    address.endpoint = idx;
+
+    for (const struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+        address.addr_len = ai->ai_addrlen;
+
+        c_vector_append(transport->addresses, &address);
+    }
+}
+
+static void
+rmq_transport_on_resolved(const char *host, uint16_t port,
+                          const struct addrinfo *res, void *arg) {
+    struct rmq_transport *transport;
+    bool found;
+
+    transport = arg;
+
+    if (transport->state != RMQ_TRANSPORT_STATE_CONNECTING)
+        return;
+
+    found = false;
+
+    for (size_t i = 0; i < c_vector_length(transport->endpoints); i++) {
+        struct rmq_transport_endpoint *endpoint;
+
+        endpoint = c_vector_entry(transport->endpoints, i);
+        if (!endpoint->resolving || endpoint->port != port
+         || strcmp(endpoint->host, host) != 0) {
+            continue;
+        }
+
+        endpoint->resolving = false;
+        transport->nb_resolving_endpoints--;
+
+        if (res) {
+            rmq_transport_add_addresses(transport, i, res);
+        } else {
+            rmq_transport_on_endpoint_failure(transport, i);
+        }
+
+        found = true;
+    }
+
+    if (!found)
+        return;
+
+    if (rmq_transport_nb_attempts(transport) == 0)
+        rmq_transport_start_attempt(transport);
+
+    if (rmq_transport_schedule_attempts(transport) == -1) {
+        rmq_transport_abort(transport);
+        return;
+    }
+
+    rmq_transport_check_attempts(transport);
+}
+
+static int
+rmq_transport_schedule_attempts(struct rmq_transport *transport) {
+    int timer;
+
+    if (transport->attempt_timer >= 0)
+        return 0;
+
+    if (transport->next_address >= c_vector_length(transport->addresses))
+        return 0;
+
+    /* Other addresses are tried in parallel after a short delay if the
+     * first attempt has not succeeded or failed yet (RFC 8305). */
+    timer = io_base_add_timer(transport->io_base, RMQ_TRANSPORT_ATTEMPT_DELAY,
+                              IO_TIMER_RECURRENT,
+                              rmq_transport_on_attempt_timer, transport);
+    if (timer == -1) {
+        c_set_error("cannot create timer: %s", c_get_error());
+        return -1;
+    }
+
+    transport->attempt_timer = timer;
+    return 0;
+}
+
+static void
+rmq_transport_check_attempts(struct rmq_transport *transport) {
+    /* The connection fails once all addresses have been tried and no host
+     * name is left to resolve. */
+    if (rmq_transport_nb_attempts(transport) > 0
+     || transport->nb_resolving_endpoints > 0) {
+        return;
+    }
+
+    rmq_transport_close(transport);
+
+    rmq_transport_signal_event(transport, RMQ_TRANSPORT_EVENT_ERROR);
+    rmq_transport_signal_event(transport, RMQ_TRANSPORT_EVENT_CONN_FAILED);
+}
+
+static bool
+rmq_transport_start_attempt(struct rmq_transport *transport) {
+    struct rmq_transport_attempt *attempt;
+
+    attempt = NULL;
+    for (size_t i = 0; i < RMQ_TRANSPORT_MAX_ATTEMPTS; i++) {
+        if (transport->attempts[i].sock == -1) {
+            attempt = transport->attempts + i;
+            break;
+        }
+    }
+
+    if (!attempt)
+        return false;
+
+    while (transport->next_address < c_vector_length(transport->addresses)) {
+        struct rmq_transport_address *address;
+        int sock, timer;
+
+        address = c_vector_entry(transport->addresses,
+                                 transport->next_address++);
+
+        sock = rmq_transport_open_socket(transport, address->addr.ss_family,
+                                         (struct sockaddr *)&address->addr,
+                                         address->addr_len);
+        if (sock == -1) {
+            rmq_transport_on_endpoint_failure(transport, address->endpoint);
+            continue;
+        }
+
+        /* The socket becomes writable once the connection is established
+         * or has failed. */
+        if (io_base_watch_fd(transport->io_base, sock, IO_EVENT_FD_WRITE,
+                             rmq_transport_on_attempt_event, attempt) == -1) {
+            c_set_error("cannot watch socket: %s", c_get_error());
+            close(sock);
+            continue;
+        }
+
+        timer = io_base_add_timer(transport->io_base,
+                                  RMQ_TRANSPORT_CONNECT_TIMEOUT, 0,
+                                  rmq_transport_on_attempt_timeout, attempt);
+        if (timer == -1) {
+            c_set_error("cannot create timer: %s", c_get_error());
+            io_base_unwatch_fd(transport->io_base, sock);
+            close(sock);
+            continue;
+        }
+
+        attempt->sock = sock;
+        attempt->timer = timer;
+        attempt->endpoint = address->endpoint;
+        return true;
+    }
+
+    return false;
+}
+
+static size_t
+rmq_transport_nb_attempts(const struct rmq_transport *transport) {
+    size_t nb_attempts;
+
+    nb_attempts = 0;
+    for (size_t i = 0; i < RMQ_TRANSPORT_MAX_ATTEMPTS; i++) {
+        if (transport->attempts[i].sock >= 0)
+            nb_attempts++;
+    }
+
+    return nb_attempts;
+}
+
+static void
+rmq_transport_close_attempt(struct rmq_transport_attempt *attempt) {
+    /* The socket of the attempt which succeeded has already been taken
+     * over, but its timer is still running. */
+    if (attempt->timer >= 0) {
+        io_base_remove_timer(attempt->transport->io_base, attempt->timer);
+        attempt->timer = -1;
+    }
+
+    if (attempt->sock == -1)
+        return;
+
+    io_base_unwatch_fd(attempt->transport->io_base, attempt->sock);
+
+    close(attempt->sock);
+    attempt->sock = -1;
+}
+
+static void
+rmq_transport_cancel_attempts(struct rmq_transport *transport) {
+    for (size_t i = 0; i < RMQ_TRANSPORT_MAX_ATTEMPTS; i++)
+        rmq_transport_close_attempt(transport->attempts + i);
+
+    if (transport->attempt_timer >= 0) {
+        io_base_remove_timer(transport->io_base, transport->attempt_timer);
+        transport->attempt_timer = -1;
+    }
+
+    /* Results of pending queries are still cached but are not used */
+    for (size_t i = 0; i < c_vector_length(transport->endpoints); i++) {
+        struct rmq_transport_endpoint *endpoint;
+
+        endpoint = c_vector_entry(transport->endpoints, i);
+        endpoint->resolving = false;
+    }
+
+    transport->nb_resolving_endpoints = 0;
+}
+
+static void
+rmq_transport_on_attempt_event(int fd, uint32_t events, void *arg) {
+    struct rmq_transport_attempt *attempt;
+    socklen_t len;
+    int error;
+
+    attempt = arg;
+
+    len = sizeof(error);
+    if (getsockopt(attempt->sock, SOL_SOCKET, SO_ERROR,
+                   &error, &len) == -1) {
+        error = errno;
+    }
+
+    if (error == 0) {
+        rmq_transport_on_attempt_connected(attempt);
+        return;
+    }
+
+    rmq_transport_on_attempt_failure(attempt, strerror(error));
+}
+
+static void
+rmq_transport_on_attempt_timeout(int timer, uint64_t delay, void *arg) {
+    struct rmq_transport_attempt *attempt;
+
+    attempt = arg;
+
+    /* The timer is not recurrent and has already been removed */
+    attempt->timer = -1;
+
+    rmq_transport_on_attempt_failure(attempt, "connection timed out");
+}
+
+static void
+rmq_transport_on_attempt_failure(struct rmq_transport_attempt *attempt,
+                                 const char *error) {
+    struct rmq_transport_endpoint *endpoint;
+    struct rmq_transport *transport;
+
+    transport = attempt->transport;
+
+    endpoint = c_vector_entry(transport->endpoints, attempt->endpoint);
+
+    if (endpoint->path) {
+        c_set_error("cannot connect to %s: %s", endpoint->path, error);
+    } else {
+        c_set_error("cannot connect to %s:%u: %s",
+                    endpoint->host, endpoint->port, error);
+    }
+
+    rmq_transport_close_attempt(attempt);
+    rmq_transport_on_endpoint_failure(transport, attempt->endpoint);
+
+    /* Try the next address without waiting for the timer */
+    rmq_transport_start_attempt(transport);
+
+    rmq_transport_check_attempts(transport);
+}
+
+static void
+rmq_transport_on_attempt_timer(int timer, uint64_t delay, void *arg) {
+    struct rmq_transport *transport;
+
+    transport = arg;
+
+    rmq_transport_start_attempt(transport);
+
+    if (transport->next_address >= c_vector_length(transport->addresses)) {
+        io_base_remove_timer(transport->io_base, transport->attempt_timer);
+        transport->attempt_timer = -1;
+    }
+}
+
+static void
+rmq_transport_on_attempt_connected(struct rmq_transport_attempt *attempt) {
+    struct rmq_transport_endpoint *endpoint;
+    struct rmq_transport *transport;
+    int sock;
+
+    transport = attempt->transport;
+
+    sock = attempt->sock;
+    io_base_unwatch_fd(transport->io_base, sock);
+    attempt->sock = -1;
+
+    /* The first connection established wins */
+    rmq_transport_cancel_attempts(transport);
+
+    transport->endpoint = attempt->endpoint;
+
+    endpoint = rmq_transport_current_endpoint(transport);
+    endpoint->nb_failures = 0;
+    endpoint->retry_time = 0;
+
+    rmq_transport_init_connection(transport, sock);
+
+    if (transport->ssl_ctx) {
+        if (rmq_transport_start_tls(transport) == -1)
+            rmq_transport_abort(transport);
+        return;
+    }
+
+    rmq_transport_on_established(transport);
+}
+
+static void
+rmq_transport_init_connection(struct rmq_transport *transport, int sock) {
+    transport->sock = sock;
+    transport->events = 0;
+
+    transport->nb_bytes_sent = 0;
+    transport->nb_bytes_received = 0;
+
+    transport->tuning_time = rmq_now_ms();
+    transport->tuning_nb_bytes_sent = 0;
+    transport->tuning_nb_bytes_received = 0;
+
+    transport->send_buffer_size =
+        rmq_transport_socket_buffer_size(sock, SO_SNDBUF);
+    transport->receive_buffer_size =
+        rmq_transport_socket_buffer_size(sock, SO_RCVBUF);
+}
+
+static int
+rmq_transport_open_socket(struct rmq_transport *transport, int family,
+                          const struct sockaddr *addr, socklen_t addr_len) {
+    int sock, flags;
+
+    sock = socket(family, SOCK_STREAM, 0);
+    if (sock == -1) {
+        c_set_error("cannot create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        c_set_error("cannot set socket non-blocking: %s", strerror(errno));
+        goto error;
+    }
+
+    if (fcntl(sock, F_SETFD, FD_CLOEXEC) == -1) {
+        c_set_error("cannot set close-on-exec flag: %s", strerror(errno));
+        goto error;
+    }
+
+    if (rmq_transport_setup_socket(transport, sock, family) == -1)
+        goto error;
+
+    if (connect(sock, addr, addr_len) == -1
+     && errno != EINPROGRESS) {
+        c_set_error("cannot connect socket: %s", strerror(errno));
+        goto error;
+    }
+
+    return sock;
+
+error:
+    close(sock);
+    return -1;
+}
+
+static int
+rmq_transport_setup_socket(struct rmq_transport *transport,
+                           int sock, int family) {
+    const struct rmq_socket_cfg *cfg;
+
+    cfg = &transport->socket_cfg;
+
+#ifdef SO_NOSIGPIPE
+    if (rmq_transport_set_socket_option(sock, SOL_SOCKET, SO_NOSIGPIPE,
+                                        1) == -1) {
+        return -1;
+    }
+#endif
+
+    if (cfg->send_buffer_size > 0) {
+        if (rmq_transport_set_socket_option(sock, SOL_SOCKET, SO_SNDBUF,
+                                            cfg->send_buffer_size) == -1) {
+            return -1;
+        }
+    }
+
+    if (cfg->receive_buffer_size > 0) {
+        if (rmq_transport_set_socket_option(sock, SOL_SOCKET, SO_RCVBUF,
+                                            cfg->receive_buffer_size) == -1) {
+            return -1;
+        }
+    }
+
+    if (family != AF_INET && family != AF_INET6)
+        return 0;
+
+    if (cfg->nodelay) {
+        if (rmq_transport_set_socket_option(sock, IPPROTO_TCP, TCP_NODELAY,
+                                            1) == -1) {
+            return -1;
+        }
+    }
+
+    if (cfg->keepalive) {
+        if (rmq_transport_set_socket_option(sock, SOL_SOCKET, SO_KEEPALIVE,
+                                            1) == -1) {
+            return -1;
+        }
+
+#ifdef TCP_KEEPIDLE
+        if (cfg->keepalive_idle > 0) {
+            if (rmq_transport_set_socket_option(sock, IPPROTO_TCP,
+                                                TCP_KEEPIDLE,
+                                                cfg->keepalive_idle) == -1) {
+                return -1;
+            }
+        }
+#endif
+
+#ifdef TCP_KEEPINTVL
+        if (cfg->keepalive_interval > 0) {
+            if (rmq_transport_set_socket_option(sock, IPPROTO_TCP,
+                                                TCP_KEEPINTVL,
+                                                cfg->keepalive_interval)
+                == -1) {
+                return -1;
+            }
+        }
+#endif
+
+#ifdef TCP_KEEPCNT
+        if (cfg->keepalive_count > 0) {
+            if (rmq_transport_set_socket_option(sock, IPPROTO_TCP,
+                                                TCP_KEEPCNT,
+                                                cfg->keepalive_count) == -1) {
+                return -1;
+            }
+        }
+#endif
+    }
+
+#ifdef TCP_USER_TIMEOUT
+    if (cfg->user_timeout > 0) {
+        if (rmq_transport_set_socket_option(sock, IPPROTO_TCP,
+                                            TCP_USER_TIMEOUT,
+                                            cfg->user_timeout) == -1) {
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+static int
+rmq_transport_set_socket_option(int sock, int level, int option,
+                                uint32_t value) {
+    int ivalue;
+
+    ivalue = (value > INT_MAX) ? INT_MAX : (int)value;
+
+    if (setsockopt(sock, level, option, &ivalue, sizeof(int)) == -1) {
+        c_set_error("cannot set socket option: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint32_t
+rmq_transport_socket_buffer_size(int sock, int option) {
+    socklen_t len;
+    int value;
+
+    len = sizeof(int);
+    if (getsockopt(sock, SOL_SOCKET, option, &value, &len) == -1)
+        return 0;
+
+    return (value > 0) ? (uint32_t)value : 0;
+}
+
+static void
+rmq_transport_grow_buffer(struct rmq_transport *transport, int option,
+                          uint32_t *psize, uint64_t bdp) {
+    uint64_t max_size, size;
+
+    max_size = transport->socket_cfg.max_buffer_size;
+    if (max_size == 0)
+        max_size = RMQ_TRANSPORT_DEFAULT_MAX_BUFFER_SIZE;
+
+    /* Buffers are only grown: shrinking them after a burst would limit
+     * the throughput of the next one. */
+    size = bdp * 2;
+    if (size > max_size)
+        size = max_size;
+    if (size <= *psize)
+        return;
+
+    if (rmq_transport_set_socket_option(transport->sock, SOL_SOCKET, option,
+                                        (uint32_t)size) == -1) {
+        return;
+    }
+
+    *psize = (uint32_t)size;
+}
+
+static void
+rmq_transport_on_fd_event(int fd, uint32_t events, void *arg) {
+    struct rmq_transport *transport;
+
+    transport = arg;
+
+    switch (transport->state) {
+    case RMQ_TRANSPORT_STATE_DISCONNECTED:
+        break;
+
+    case RMQ_TRANSPORT_STATE_CONNECTING:
+        /* Connection attempts have their own handler */
+        break;
+
+    case RMQ_TRANSPORT_STATE_TLS_HANDSHAKE:
+        rmq_transport_tls_handshake(transport);
+        break;
+
+    case RMQ_TRANSPORT_STATE_CONNECTED:
+        if (events & (IO_EVENT_FD_READ | IO_EVENT_FD_HANGUP
+                      | IO_EVENT_FD_ERROR)) {
+            rmq_transport_read(transport);
+            if (transport->state != RMQ_TRANSPORT_STATE_CONNECTED)
+                break;
+        }
+
+        if (events & IO_EVENT_FD_WRITE)
+            rmq_transport_flush(transport);
+        break;
+
+    case RMQ_TRANSPORT_STATE_DISCONNECTING:
+        rmq_transport_flush(transport);
+        break;
+    }
+}
+
+static void
+rmq_transport_on_established(struct rmq_transport *transport) {
+    transport->state = RMQ_TRANSPORT_STATE_CONNECTED;
+
+    rmq_transport_signal_event(transport,
+                               RMQ_TRANSPORT_EVENT_CONN_ESTABLISHED);
+    if (transport->state != RMQ_TRANSPORT_STATE_CONNECTED)
+        return;
+
+    rmq_transport_update_watch(transport);
+}
+
+static int
+rmq_transport_start_tls(struct rmq_transport *transport) {
+    struct rmq_transport_endpoint *endpoint;
+    const char *server_name;
+    int timer;
+
+    endpoint = rmq_transport_current_endpoint(transport);
+
+    ERR_clear_error();
+
+    transport->ssl = SSL_new(transport->ssl_ctx);
+    if (!transport->ssl) {
+        c_set_error("cannot create tls connection: %s",
+                    rmq_transport_tls_error());
+        return -1;
+    }
+
+    SSL_set_app_data(transport->ssl, transport);
+
+    if (SSL_set_fd(transport->ssl, transport->sock) != 1) {
+        c_set_error("cannot set tls socket: %s", rmq_transport_tls_error());
+        return -1;
+    }
+
+    server_name = transport->ssl_server_name;
+    if (!server_name)
+        server_name = endpoint->host;
+
+    if (SSL_set_tlsext_host_name(transport->ssl, server_name) != 1) {
+        c_set_error("cannot set tls server name: %s",
+                    rmq_transport_tls_error());
+        return -1;
+    }
+
+    if (transport->ssl_verify) {
+        if (SSL_set1_host(transport->ssl, server_name) != 1) {
+            c_set_error("cannot set tls verification host: %s",
+                        rmq_transport_tls_error());
+            return -1;
+        }
+    }
+
+    if (endpoint->ssl_session) {
+        if (SSL_set_session(transport->ssl, endpoint->ssl_session) != 1) {
+            /* Not fatal, the handshake will negotiate a new session */
+            ERR_clear_error();
+        }
+    }
+
+    timer = io_base_add_timer(transport->io_base,
+                              RMQ_TRANSPORT_TLS_HANDSHAKE_TIMEOUT, 0,
+                              rmq_transport_on_handshake_timer, transport);
+    if (timer == -1) {
+        c_set_error("cannot create timer: %s", c_get_error());
+        return -1;
+    }
+
+    transport->handshake_timer = timer;
+
+    transport->state = RMQ_TRANSPORT_STATE_TLS_HANDSHAKE;
+
+    rmq_transport_tls_handshake(transport);
+    return 0;
+}
+
+static void
+rmq_transport_tls_handshake(struct rmq_transport *transport) {
+    struct rmq_transport_endpoint *endpoint;
+    long verify_result;
+    uint32_t events;
+    int ret;
+
+    ERR_clear_error();
+
+    ret = SSL_connect(transport->ssl);
+    if (ret == 1) {
+        io_base_remove_timer(transport->io_base, transport->handshake_timer);
+        transport->handshake_timer = -1;
+
+        transport->ktls_send = BIO_get_ktls_send(SSL_get_wbio(transport->ssl));
+        transport->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(transport->ssl));
+
+        rmq_transport_on_established(transport);
+        return;
+    }
+
+    switch (SSL_get_error(transport->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+        events = IO_EVENT_FD_READ;
+        break;
+
+    case SSL_ERROR_WANT_WRITE:
+        events = IO_EVENT_FD_WRITE;
+        break;
+
+    default:
+        verify_result = SSL_get_verify_result(transport->ssl);
+        if (verify_result != X509_V_OK) {
+            c_set_error("tls handshake failed: %s",
+                        X509_verify_cert_error_string(verify_result));
+        } else {
+            c_set_error("tls handshake failed: %s",
+                        rmq_transport_tls_error());
+        }
+
+        /* Do not try to resume a session the server may have rejected */
+        endpoint = rmq_transport_current_endpoint(transport);
+        if (endpoint->ssl_session) {
+            SSL_SESSION_free(endpoint->ssl_session);
+            endpoint->ssl_session = NULL;
+        }
+
+        rmq_transport_abort(transport);
+        return;
+    }
+
+    if (rmq_transport_watch(transport, events) == -1)
+        rmq_transport_abort(transport);
+}
+
+static void
+rmq_transport_on_handshake_timer(int timer, uint64_t delay, void *arg) {
+    struct rmq_transport *transport;
+
+    transport = arg;
+
+    /* The timer is not recurrent and has already been removed */
+    transport->handshake_timer = -1;
+
+    c_set_error("tls handshake timed out");
+
+    /* Handled as any other handshake failure */
+    rmq_transport_abort(transport);
+}
+
+static int
+rmq_transport_on_tls_session(SSL *ssl, SSL_SESSION *session) {
+    struct rmq_transport_endpoint *endpoint;
+    struct rmq_transport *transport;
+
+    transport = SSL_get_app_data(ssl);
+    endpoint = rmq_transport_current_endpoint(transport);
+
+    if (endpoint->ssl_session)
+        SSL_SESSION_free(endpoint->ssl_session);
+    endpoint->ssl_session = session;
+
+    /* We keep the reference */
+    return 1;
+}
+
+static const char *
+rmq_transport_tls_error(void) {
+    const char *reason;
+    unsigned long error;
+
+    error = ERR_get_error();
+    ERR_clear_error();
+
+    if (error == 0)
+        return (errno != 0) ? strerror(errno) : "unknown error";
+
+    reason = ERR_reason_error_string(error);
+    return reason ? reason : "unknown error";
+}
+
+static void
+rmq_transport_read(struct rmq_transport *transport) {
+    struct c_buffer *rbuf;
+    size_t total_read;
+    bool eof;
+
+    rbuf = transport->rbuf;
+
+    total_read = 0;
+    eof = false;
+
+    for (;;) {
+        size_t nb_read;
+        void *ptr;
+
+        ptr = c_buffer_reserve(rbuf, RMQ_TRANSPORT_READ_SIZE);
+
+        if (rmq_transport_recv(transport, ptr, RMQ_TRANSPORT_READ_SIZE,
+                               &nb_read, &eof) == -1) {
+            rmq_transport_abort(transport);
+            return;
+        }
+
+        if (nb_read == 0)
+            break;
+
+        c_buffer_increase_length(rbuf, nb_read);
+        total_read += nb_read;
+
+        transport->nb_bytes_received += nb_read;
+
+        if (!transport->ssl) {
+            if (nb_read < RMQ_TRANSPORT_READ_SIZE
+             || total_read >= RMQ_TRANSPORT_MAX_READ_SIZE) {
+                break;
+            }
+        }
+    }
+
+    if (total_read > 0) {
+        rmq_transport_signal_event(transport, RMQ_TRANSPORT_EVENT_DATA_READ);
+        if (transport->state != RMQ_TRANSPORT_STATE_CONNECTED)
+            return;
+    }
+
+    if (eof) {
+        rmq_transport_close(transport);
+        rmq_transport_on_endpoint_failure(transport, transport->endpoint);
+
+        rmq_transport_signal_event(transport,
+                                   RMQ_TRANSPORT_EVENT_CONN_CLOSED);
+    }
+}
+
+static int
+rmq_transport_recv(struct rmq_transport *transport, void *buf, size_t size,
+                   size_t *pnb_read, bool *peof) {
+    ssize_t ret;
+
+    *pnb_read = 0;
+
+    if (transport->ssl) {
+        int iret;
+
+        ERR_clear_error();
+        errno = 0;
+
+        iret = SSL_read(transport->ssl, buf, (int)size);
+        if (iret > 0) {
+            *pnb_read = (size_t)iret;
+            return 0;
+        }
+
+        switch (SSL_get_error(transport->ssl, iret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+
+        case SSL_ERROR_ZERO_RETURN:
+            *peof = true;
+            return 0;
+
+        case SSL_ERROR_SYSCALL:
+            c_set_error("cannot read socket: %s",
+                        (errno != 0) ? strerror(errno) : "connection reset");
+            return -1;
+
+        default:
+            c_set_error("cannot read tls data: %s",
+                        rmq_transport_tls_error());
+            return -1;
+        }
+    }
+
+    for (;;) {
+        ret = read(transport->sock, buf, size);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            c_set_error("cannot read socket: %s", strerror(errno));
+            return -1;
+        }
+
+        break;
+    }
+
+    if (ret == 0) {
+        *peof = true;
+    } else {
+        *pnb_read = (size_t)ret;
+    }
+
+    return 0;
+}
+
+static void
+rmq_transport_flush(struct rmq_transport *transport) {
+    struct c_buffer *wbuf;
+
+    wbuf = transport->wbuf;
+
+    while (c_buffer_length(wbuf) > 0) {
+        size_t nb_written;
+
+        if (rmq_transport_send(transport, c_buffer_data(wbuf),
+                               c_buffer_length(wbuf), &nb_written) == -1) {
+            rmq_transport_abort(transport);
+            return;
+        }
+
+        if (nb_written == 0)
+            break;
+
+        c_buffer_skip(wbuf, nb_written);
+
+        transport->nb_bytes_sent += nb_written;
+    }
+
+    if (transport->state == RMQ_TRANSPORT_STATE_DISCONNECTING) {
+        if (c_buffer_length(wbuf) > 0)
+            return;
+
+        if (transport->ssl) {
+            /* Best effort, we do not wait for the close_notify alert of
+             * the server. */
+            SSL_shutdown(transport->ssl);
+            ERR_clear_error();
+        }
+
+        rmq_transport_close(transport);
+        rmq_transport_signal_event(transport,
+                                   RMQ_TRANSPORT_EVENT_CONN_CLOSED);
+        return;
+    }
+
+    rmq_transport_update_watch(transport);
+}
+
+static int
+rmq_transport_send(struct rmq_transport *transport,
+                   const void *data, size_t size, size_t *pnb_written) {
+    ssize_t ret;
+    int flags;
+
+    *pnb_written = 0;
+
+    /* With kernel TLS, application data written to the socket is encrypted
+     * by the kernel: going through SSL_write() would only add a copy.
+     * Reads still use SSL_read() since the kernel returns non-application
+     * records such as session tickets as control messages. */
+    if (transport->ssl && !transport->ktls_send) {
+        int iret;
+
+        if (size > INT_MAX)
+            size = INT_MAX;
+
+        ERR_clear_error();
+        errno = 0;
+
+        iret = SSL_write(transport->ssl, data, (int)size);
+        if (iret > 0) {
+            *pnb_written = (size_t)iret;
+            return 0;
+        }
+
+        switch (SSL_get_error(transport->ssl, iret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return 0;
+
+        case SSL_ERROR_SYSCALL:
+            c_set_error("cannot write to socket: %s",
+                        (errno != 0) ? strerror(errno) : "connection reset");
+            return -1;
+
+        default:
+            c_set_error("cannot write tls data: %s",
+                        rmq_transport_tls_error());
+            return -1;
+        }
+    }
+
+    flags = 0;
+#ifdef MSG_NOSIGNAL
+    flags |= MSG_NOSIGNAL;
+#endif
+
+    for (;;) {
+        ret = send(transport->sock, data, size, flags);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            c_set_error("cannot write to socket: %s", strerror(errno));
+            return -1;
+        }
+
+        break;
+    }
+
+    *pnb_written = (size_t)ret;
+    return 0;
+}
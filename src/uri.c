@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "internal.h"
+
+static int rmq_uri_parse_authority(struct rmq_uri *, const char *, size_t);
+static int rmq_uri_parse_query(struct rmq_uri *, const char *);
+static int rmq_uri_parse_parameter(struct rmq_uri *, const char *, size_t);
+static char *rmq_uri_decode(const char *, size_t);
+static int rmq_uri_hex_digit(char);
+
+void
+rmq_uri_init(struct rmq_uri *uri) {
+    memset(uri, 0, sizeof(struct rmq_uri));
+}
+
+void
+rmq_uri_free(struct rmq_uri *uri) {
+    if (!uri)
+        return;
+
+    c_free(uri->user);
+    c_free(uri->password);
+    c_free(uri->host);
+    c_free(uri->vhost);
+
+    for (size_t i = 0; i < rmq_uri_nb_ignored_parameters(uri); i++)
+        c_free(c_ptr_vector_entry(uri->ignored_parameters, i));
+    c_ptr_vector_delete(uri->ignored_parameters);
+
+    memset(uri, 0, sizeof(struct rmq_uri));
+}
+
+size_t
+rmq_uri_nb_ignored_parameters(const struct rmq_uri *uri) {
+    if (!uri->ignored_parameters)
+        return 0;
+
+    return c_ptr_vector_length(uri->ignored_parameters);
+}
+
+const char *
+rmq_uri_ignored_parameter(const struct rmq_uri *uri, size_t i) {
+    return c_ptr_vector_entry(uri->ignored_parameters, i);
+}
+
+int
+rmq_uri_parse(struct rmq_uri *uri, const char *string) {
+    const char *ptr, *authority;
+    size_t authority_len;
+
+    /* See https://www.rabbitmq.com/uri-spec.html */
+    ptr = string;
+
+    if (strncmp(ptr, "amqp://", 7) == 0) {
+        uri->tls = false;
+        ptr += 7;
+    } else if (strncmp(ptr, "amqps://", 8) == 0) {
+        uri->tls = true;
+        ptr += 8;
+    } else {
+        c_set_error("invalid scheme");
+        return -1;
+    }
+
+    authority = ptr;
+    authority_len = strcspn(ptr, "/?");
+    ptr += authority_len;
+
+    if (rmq_uri_parse_authority(uri, authority, authority_len) == -1)
+        goto error;
+
+    /* A missing path means the default vhost while an empty path is the
+     * empty vhost. */
+    if (*ptr == '/') {
+        size_t len;
+
+        ptr++;
+
+        len = strcspn(ptr, "?");
+        if (memchr(ptr, '/', len)) {
+            c_set_error("invalid vhost");
+            goto error;
+        }
+
+        uri->vhost = rmq_uri_decode(ptr, len);
+        if (!uri->vhost) {
+            c_set_error("invalid vhost: %s", c_get_error());
+            goto error;
+        }
+
+        ptr += len;
+    }
+
+    if (*ptr == '?') {
+        if (rmq_uri_parse_query(uri, ptr + 1) == -1)
+            goto error;
+    }
+
+    return 0;
+
+error:
+    rmq_uri_free(uri);
+    return -1;
+}
+
+static int
+rmq_uri_parse_authority(struct rmq_uri *uri,
+                        const char *string, size_t len) {
+    const char *at, *host, *port;
+    size_t host_len, port_len;
+
+    /* User information */
+    at = NULL;
+    for (size_t i = len; i > 0; i--) {
+        if (string[i - 1] == '@') {
+            at = string + i - 1;
+            break;
+        }
+    }
+
+    if (at) {
+        const char *colon;
+        size_t userinfo_len;
+
+        userinfo_len = (size_t)(at - string);
+
+        colon = memchr(string, ':', userinfo_len);
+        if (colon) {
+            uri->user = rmq_uri_decode(string, (size_t)(colon - string));
+            uri->password = rmq_uri_decode(colon + 1,
+                                           (size_t)(at - colon - 1));
+        } else {
+            uri->user = rmq_uri_decode(string, userinfo_len);
+            uri->password = c_strdup("");
+        }
+
+        if (!uri->user || !uri->password) {
+            c_set_error("invalid user information: %s", c_get_error());
+            return -1;
+        }
+
+        len -= userinfo_len + 1;
+        string = at + 1;
+    }
+
+    /* Host and port */
+    port = NULL;
+    port_len = 0;
+
+    if (len > 0 && string[0] == '[') {
+        const char *bracket;
+
+        bracket = memchr(string, ']', len);
+        if (!bracket) {
+            c_set_error("invalid ipv6 address");
+            return -1;
+        }
+
+        host = string + 1;
+        host_len = (size_t)(bracket - host);
+
+        if (bracket + 1 < string + len) {
+            if (bracket[1] != ':') {
+                c_set_error("invalid ipv6 address");
+                return -1;
+            }
+
+            port = bracket + 2;
+            port_len = (size_t)(string + len - port);
+        }
+    } else {
+        const char *colon;
+
+        colon = memchr(string, ':', len);
+
+        host = string;
+        if (colon) {
+            host_len = (size_t)(colon - string);
+
+            port = colon + 1;
+            port_len = (size_t)(string + len - port);
+        } else {
+            host_len = len;
+        }
+    }
+
+    if (host_len == 0) {
+        uri->host = c_strdup("localhost");
+    } else {
+        uri->host = rmq_uri_decode(host, host_len);
+        if (!uri->host) {
+            c_set_error("invalid host: %s", c_get_error());
+            return -1;
+        }
+    }
+
+    if (port && port_len > 0) {
+        char *port_string;
+        int ret;
+
+        port_string = c_strndup(port, port_len);
+        ret = c_parse_u16(port_string, &uri->port, NULL);
+        c_free(port_string);
+
+        if (ret == -1 || uri->port == 0) {
+            c_set_error("invalid port");
+            return -1;
+        }
+    } else {
+        uri->port = uri->tls ? 5671 : 5672;
+    }
+
+    return 0;
+}
+
+static int
+rmq_uri_parse_query(struct rmq_uri *uri, const char *string) {
+    const char *ptr;
+
+    ptr = string;
+
+    while (*ptr != '\0') {
+        size_t len;
+
+        len = strcspn(ptr, "&");
+
+        if (len > 0) {
+            if (rmq_uri_parse_parameter(uri, ptr, len) == -1)
+                return -1;
+        }
+
+        ptr += len;
+        if (*ptr == '&')
+            ptr++;
+    }
+
+    return 0;
+}
+
+static int
+rmq_uri_parse_parameter(struct rmq_uri *uri, const char *string, size_t len) {
+    const char *equal;
+    char *name, *value;
+    int ret;
+
+    equal = memchr(string, '=', len);
+    if (!equal) {
+        c_set_error("missing value for parameter '%.*s'", (int)len, string);
+        return -1;
+    }
+
+    name = rmq_uri_decode(string, (size_t)(equal - string));
+    value = rmq_uri_decode(equal + 1, (size_t)(string + len - equal - 1));
+    if (!name || !value) {
+        c_set_error("invalid parameter: %s", c_get_error());
+        ret = -1;
+        goto end;
+    }
+
+    if (strcmp(name, "heartbeat") == 0) {
+        ret = c_parse_u16(value, &uri->tune_cfg.heartbeat, NULL);
+
+        /* Following the RabbitMQ convention, a null heartbeat disables
+         * heartbeats instead of using the value of the server */
+        uri->tune_cfg.disable_heartbeat = (uri->tune_cfg.heartbeat == 0);
+    } else if (strcmp(name, "frame_max") == 0) {
+        ret = c_parse_u32(value, &uri->tune_cfg.frame_max, NULL);
+    } else if (strcmp(name, "channel_max") == 0) {
+        ret = c_parse_u16(value, &uri->tune_cfg.channel_max, NULL);
+    } else {
+        /* Parameters meant for other clients, e.g. connection_timeout or
+         * TLS options, are ignored so that the same URI can be shared. */
+        if (!uri->ignored_parameters)
+            uri->ignored_parameters = c_ptr_vector_new();
+
+        c_ptr_vector_append(uri->ignored_parameters, name);
+        name = NULL;
+
+        ret = 0;
+        goto end;
+    }
+
+    if (ret == -1)
+        c_set_error("invalid value for parameter '%s'", name);
+
+end:
+    c_free(name);
+    c_free(value);
+    return ret;
+}
+
+static char *
+rmq_uri_decode(const char *string, size_t len) {
+    char *decoded;
+    size_t i, j;
+
+    decoded = c_malloc(len + 1);
+
+    for (i = 0, j = 0; i < len; i++) {
+        int hi, lo;
+
+        if (string[i] != '%') {
+            decoded[j++] = string[i];
+            continue;
+        }
+
+        if (len - i < 3) {
+            c_set_error("truncated percent-encoded sequence");
+            goto error;
+        }
+
+        hi = rmq_uri_hex_digit(string[i + 1]);
+        lo = rmq_uri_hex_digit(string[i + 2]);
+        if (hi == -1 || lo == -1) {
+            c_set_error("invalid percent-encoded sequence");
+            goto error;
+        }
+
+        decoded[j++] = (char)((hi << 4) | lo);
+        i += 2;
+    }
+
+    decoded[j] = '\0';
+    return decoded;
+
+error:
+    c_free(decoded);
+    return NULL;
+}
+
+static int
+rmq_uri_hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2015 Nicolas Martyanoff
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <core.h>
+#include <utest.h>
+
+#include "../src/internal.h"
+
+/* Each handler is registered with a distinct integer as argument; routing
+ * a key returns the argument of the handler called, 0 for the default
+ * handler and -1 if the message was rejected. */
+static int rmqt_handler;
+
+static enum rmq_msg_action
+rmqt_on_msg(struct rmq_client *client, const struct rmq_delivery *delivery,
+            const struct rmq_msg *msg, void *arg) {
+    rmqt_handler = *(int *)arg;
+    return RMQ_MSG_ACTION_ACK;
+}
+
+static int
+rmqt_route(struct rmq_router *router, const char *routing_key) {
+    struct rmq_delivery delivery;
+    enum rmq_msg_action action;
+
+    memset(&delivery, 0, sizeof(struct rmq_delivery));
+    delivery.type = RMQ_DELIVERY_TYPE_BASIC_DELIVER;
+    delivery.routing_key = (char *)routing_key;
+
+    rmqt_handler = -1;
+
+    action = rmq_router_dispatch(NULL, &delivery, NULL, router);
+    if (action == RMQ_MSG_ACTION_REJECT)
+        return -1;
+
+    return rmqt_handler;
+}
+
+static int rmqt_handler_ids[] = {0, 1, 2, 3, 4};
+
+#define RMQT_ADD(router_, pattern_, id_)                       \
+    rmq_router_add(router_, pattern_, rmqt_on_msg, &rmqt_handler_ids[id_])
+
+TEST(literal_keys) {
+    struct rmq_router *router;
+
+    router = rmq_router_new();
+    RMQT_ADD(router, "a.b", 1);
+    RMQT_ADD(router, "a.c", 2);
+
+    TEST_INT_EQ(rmqt_route(router, "a.b"), 1);
+    TEST_INT_EQ(rmqt_route(router, "a.c"), 2);
+    TEST_INT_EQ(rmqt_route(router, "a"), -1);
+    TEST_INT_EQ(rmqt_route(router, "a.b.c"), -1);
+    TEST_INT_EQ(rmqt_route(router, ""), -1);
+
+    rmq_router_set_default(router, rmqt_on_msg, &rmqt_handler_ids[0]);
+    TEST_INT_EQ(rmqt_route(router, "a.d"), 0);
+
+    rmq_router_delete(router);
+}
+
+TEST(dot_keys) {
+    struct rmq_router *router;
+
+    /* Dots separate empty words, which are matched like any other word */
+    router = rmq_router_new();
+    RMQT_ADD(router, "*.*", 1);
+    RMQT_ADD(router, "a..b", 2);
+    RMQT_ADD(router, "#.", 3);
+
+    TEST_INT_EQ(rmqt_route(router, "."), 1);
+    TEST_INT_EQ(rmqt_route(router, "a."), 1);
+    TEST_INT_EQ(rmqt_route(router, "a..b"), 2);
+    TEST_INT_EQ(rmqt_route(router, ".."), 3);
+    TEST_INT_EQ(rmqt_route(router, "a.b.c."), 3);
+    TEST_INT_EQ(rmqt_route(router, "a"), -1);
+    TEST_INT_EQ(rmqt_route(router, "a.b.c"), -1);
+
+    rmq_router_delete(router);
+
+    router = rmq_router_new();
+    RMQT_ADD(router, "#", 1);
+
+    TEST_INT_EQ(rmqt_route(router, ""), 1);
+    TEST_INT_EQ(rmqt_route(router, "..."), 1);
+
+    rmq_router_delete(router);
+}
+
+TEST(max_length_keys) {
+    struct rmq_router *router;
+    char key[RMQ_ROUTER_MAX_KEY_SIZE + 1];
+
+    router = rmq_router_new();
+    RMQT_ADD(router, "*", 1);
+    RMQT_ADD(router, "#.b", 2);
+    RMQT_ADD(router, "#", 3);
+
+    /* A single word */
+    memset(key, 'a', RMQ_ROUTER_MAX_KEY_SIZE);
+    key[RMQ_ROUTER_MAX_KEY_SIZE] = '\0';
+    TEST_INT_EQ(rmqt_route(router, key), 1);
+
+    /* As many words as possible */
+    for (size_t i = 0; i < RMQ_ROUTER_MAX_KEY_SIZE; i++)
+        key[i] = (i % 2 == 0) ? 'b' : '.';
+    TEST_INT_EQ(rmqt_route(router, key), 2);
+
+    /* Only dots, i.e. the maximum number of words */
+    memset(key, '.', RMQ_ROUTER_MAX_KEY_SIZE);
+    TEST_INT_EQ(rmqt_route(router, key), 3);
+
+    rmq_router_delete(router);
+}
+
+TEST(multiple_hashes) {
+    struct rmq_router *router;
+
+    router = rmq_router_new();
+    RMQT_ADD(router, "#.b.#", 1);
+    RMQT_ADD(router, "#.#.#", 2);
+
+    TEST_INT_EQ(rmqt_route(router, "b"), 1);
+    TEST_INT_EQ(rmqt_route(router, "a.b"), 1);
+    TEST_INT_EQ(rmqt_route(router, "b.c"), 1);
+    TEST_INT_EQ(rmqt_route(router, "a.a.b.c.c"), 1);
+    TEST_INT_EQ(rmqt_route(router, "a.c"), 2);
+    TEST_INT_EQ(rmqt_route(router, ""), 2);
+
+    rmq_router_delete(router);
+
+    router = rmq_router_new();
+    RMQT_ADD(router, "a.#.b.#.c", 1);
+
+    TEST_INT_EQ(rmqt_route(router, "a.b.c"), 1);
+    TEST_INT_EQ(rmqt_route(router, "a.x.b.y.z.c"), 1);
+    TEST_INT_EQ(rmqt_route(router, "a.c.b"), -1);
+    TEST_INT_EQ(rmqt_route(router, "a.b.c.d"), -1);
+
+    rmq_router_delete(router);
+}
+
+TEST(first_registered_wins) {
+    struct rmq_router *router;
+
+    router = rmq_router_new();
+    RMQT_ADD(router, "a.*", 1);
+    RMQT_ADD(router, "#", 2);
+    RMQT_ADD(router, "a.b", 3);
+
+    TEST_INT_EQ(rmqt_route(router, "a.b"), 1);
+    TEST_INT_EQ(rmqt_route(router, "a.c"), 1);
+    TEST_INT_EQ(rmqt_route(router, "b"), 2);
+
+    rmq_router_delete(router);
+
+    router = rmq_router_new();
+    RMQT_ADD(router, "a.b", 1);
+    RMQT_ADD(router, "#", 2);
+    RMQT_ADD(router, "a.*", 3);
+
+    TEST_INT_EQ(rmqt_route(router, "a.b"), 1);
+    TEST_INT_EQ(rmqt_route(router, "a.c"), 2);
+
+    /* Registering a pattern again replaces its handler but keeps its
+     * position */
+    RMQT_ADD(router, "a.b", 4);
+    TEST_INT_EQ(rmqt_route(router, "a.b"), 4);
+
+    rmq_router_delete(router);
+}
+
+int
+main(int argc, char **argv) {
+    struct test_suite *suite;
+
+    suite = test_suite_new("router");
+    test_suite_initialize_from_args(suite, argc, argv);
+
+    test_suite_start(suite);
+
+    TEST_RUN(suite, literal_keys);
+    TEST_RUN(suite, dot_keys);
+    TEST_RUN(suite, max_length_keys);
+    TEST_RUN(suite, multiple_hashes);
+    TEST_RUN(suite, first_registered_wins);
+
+    test_suite_print_results_and_exit(suite);
+}
@@ -14,14 +14,80 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <signal.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <core.h>
 #include <io.h>
 
 #include "../src/rabbitmq.h"
 
+/* Publication stops when this many bytes are waiting to be written, and
+ * resumes on the next tick of the publish timer. */
+#define RMQU_MAX_OUTPUT_SIZE (4 * 1024 * 1024)
+#define RMQU_PUBLISH_TIMER_DELAY 10 /* milliseconds */
+
+#define RMQU_READ_SIZE (64 * 1024)
+
+struct rmqu_input {
+    const char *path;
+    int fd; /* -1 for a memory mapped file */
+    int fd_flags; /* original flags of the standard input */
+    bool length_delimited;
+
+    /* Memory mapped file */
+    uint8_t *map;
+    size_t map_sz;
+    size_t map_offset;
+
+    /* Streamed file */
+    struct c_buffer *buf;
+    size_t buf_skip;
+    bool eof;
+};
+
+enum rmqu_ack_mode {
+    RMQU_ACK_MODE_NONE,
+    RMQU_ACK_MODE_EACH,
+    RMQU_ACK_MODE_BATCH,
+    RMQU_ACK_MODE_REQUEUE,
+};
+
+struct rmqu_publish {
+    struct rmqu_input input;
+    struct rmq_publish_template *template;
+
+    uint64_t nb_msgs;
+    int timer;
+
+    /* Waiting for the input to be readable */
+    bool watching_input;
+};
+
+struct rmqu_consume {
+    FILE *output;
+    bool length_delimited;
+
+    enum rmqu_ack_mode ack_mode;
+    unsigned int batch_size;
+    unsigned int nb_unacked;
+    uint64_t last_tag;
+
+    uint64_t max_nb_msgs; /* 0 if there is no limit */
+    uint64_t nb_msgs;
+    int timer;
+
+    bool done;
+};
+
 struct rmqu {
     struct io_base *io_base;
     struct rmq_client *client;
@@ -35,6 +101,15 @@ struct rmqu {
     char **argv;
 
     bool error;
+
+    /* Synchronous operations in flight */
+    unsigned int nb_pending_ops;
+    unsigned int nb_failed_ops;
+    unsigned int nb_skipped_ops;
+    struct c_ptr_vector *op_descriptions;
+
+    struct rmqu_publish publish;
+    struct rmqu_consume consume;
 };
 
 static struct rmqu rmqu;
@@ -48,17 +123,23 @@ static void rmqu_die(const char *, ...)
 
 static void rmqu_on_signal(int, void *);
 
+static struct rmq_endpoint *rmqu_parse_endpoints(const char *, uint16_t,
+                                                 size_t *);
+
 static void rmqu_on_client_event(struct rmq_client *, enum rmq_client_event,
                                  void *, void *);
 static void rmqu_on_client_ready(void);
 
-static enum rmq_msg_action rmqu_on_msg(struct rmq_client *,
-                                       const struct rmq_delivery *,
-                                       const struct rmq_msg *, void *);
+static enum rmq_msg_action rmqu_on_consumed_msg(struct rmq_client *,
+                                                const struct rmq_delivery *,
+                                                const struct rmq_msg *,
+                                                void *);
 static void rmqu_on_undeliverable_msg(struct rmq_client *,
                                       const struct rmq_delivery *,
                                       const struct rmq_msg *, void *);
 
+static void rmqu_publish_wait_input(void);
+
 struct rmqu_cmd {
     const char *name;
     void (*exec)(int, char **);
@@ -70,6 +151,9 @@ static void rmqu_cmd_declare_queue(int, char **);
 static void rmqu_cmd_delete_queue(int, char **);
 static void rmqu_cmd_bind_queue(int, char **);
 static void rmqu_cmd_unbind_queue(int, char **);
+static void rmqu_cmd_apply(int, char **);
+static void rmqu_cmd_publish(int, char **);
+static void rmqu_cmd_consume(int, char **);
 
 static struct rmqu_cmd rmqu_cmds[] = {
     {"declare-exchange", rmqu_cmd_declare_exchange},
@@ -78,15 +162,22 @@ static struct rmqu_cmd rmqu_cmds[] = {
     {"delete-queue", rmqu_cmd_delete_queue},
     {"bind-queue", rmqu_cmd_bind_queue},
     {"unbind-queue", rmqu_cmd_unbind_queue},
+    {"apply", rmqu_cmd_apply},
+    {"publish", rmqu_cmd_publish},
+    {"consume", rmqu_cmd_consume},
 };
 size_t rmqu_nb_cmds = sizeof(rmqu_cmds) / sizeof(rmqu_cmds[0]);
 
 int
 main(int argc, char **argv) {
     struct c_command_line *cmdline;
-    const char *host, *port_string;
+    const char *host, *port_string, *socket_path;
     const char *user, *password, *vhost;
+    struct rmq_endpoint *endpoints;
+    size_t nb_endpoints;
+    struct rmq_tls_cfg tls_cfg;
     uint16_t port;
+    bool use_tls;
     int ret;
 
     /* Command line */
@@ -107,18 +198,42 @@ main(int argc, char **argv) {
                                      "  bind a queue to an exchange\n"
                                      "unbind-queue           "
                                      "  unbind a queue from an exchange\n"
+                                     "apply                  "
+                                     "  declare the content of a topology "
+                                     "file\n"
+                                     "publish                "
+                                     "  publish messages read from a file\n"
+                                     "consume                "
+                                     "  write messages of a queue to a file\n"
                                     );
 
     c_command_line_add_option(cmdline, "s", "host",
-                              "the host to connect to", "host", "localhost");
+                              "the host to connect to, or a comma separated "
+                              "list of host[:port] endpoints",
+                              "host", "localhost");
     c_command_line_add_option(cmdline, "p", "port",
-                              "the port to connect to", "port", "5672");
+                              "the port to connect to (default: 5672, or "
+                              "5671 with tls)", "port", NULL);
     c_command_line_add_option(cmdline, "u", "user",
                               "the user name", "name", "guest");
     c_command_line_add_option(cmdline, "w", "password",
                               "the password", "string", "guest");
     c_command_line_add_option(cmdline, "i", "vhost",
                               "the virtual host", "vhost", "/");
+    c_command_line_add_option(cmdline, "U", "unix-socket",
+                              "the unix socket to connect to instead of a "
+                              "host", "path", NULL);
+    c_command_line_add_flag(cmdline, "T", "tls", "connect using tls");
+    c_command_line_add_option(cmdline, "A", "ca-certificate",
+                              "the file containing trusted ca certificates",
+                              "path", NULL);
+    c_command_line_add_option(cmdline, "C", "certificate",
+                              "the client certificate", "path", NULL);
+    c_command_line_add_option(cmdline, "K", "private-key",
+                              "the private key of the client certificate",
+                              "path", NULL);
+    c_command_line_add_flag(cmdline, "I", "insecure",
+                            "do not verify the certificate of the server");
     c_command_line_add_flag(cmdline, "v", "verbose", "enable verbose mode");
 
     c_command_line_add_argument(cmdline, "the command to execute", "command");
@@ -130,10 +245,27 @@ main(int argc, char **argv) {
     argc -= ret - 1; /* keep the command name */
     argv += ret - 1;
 
+    use_tls = c_command_line_is_option_set(cmdline, "tls");
+
+    memset(&tls_cfg, 0, sizeof(struct rmq_tls_cfg));
+    tls_cfg.ca_certificate_path =
+        c_command_line_option_value(cmdline, "ca-certificate");
+    tls_cfg.certificate_path =
+        c_command_line_option_value(cmdline, "certificate");
+    tls_cfg.private_key_path =
+        c_command_line_option_value(cmdline, "private-key");
+    tls_cfg.skip_verification =
+        c_command_line_is_option_set(cmdline, "insecure");
+
     host = c_command_line_option_value(cmdline, "host");
+    socket_path = c_command_line_option_value(cmdline, "unix-socket");
     port_string = c_command_line_option_value(cmdline, "port");
-    if (c_parse_u16(port_string, &port, NULL) == -1)
-        rmqu_die("invalid port: %s", c_get_error());
+    if (port_string) {
+        if (c_parse_u16(port_string, &port, NULL) == -1)
+            rmqu_die("invalid port: %s", c_get_error());
+    } else {
+        port = use_tls ? 5671 : 5672;
+    }
 
     user = c_command_line_option_value(cmdline, "user");
     password = c_command_line_option_value(cmdline, "password");
@@ -166,6 +298,9 @@ main(int argc, char **argv) {
         rmqu.cmd_exec(rmqu.argc, rmqu.argv);
     }
 
+    rmqu.publish.timer = -1;
+    rmqu.consume.timer = -1;
+
     /* IO base */
     rmqu.io_base = io_base_new();
 
@@ -174,6 +309,9 @@ main(int argc, char **argv) {
     if (io_base_watch_signal(rmqu.io_base, SIGTERM, rmqu_on_signal, NULL) == -1)
         rmqu_die("cannot watch signal: %s", c_get_error());
 
+    /* Write errors are handled on the socket */
+    signal(SIGPIPE, SIG_IGN);
+
     /* Client */
     rmqu.client = rmq_client_new(rmqu.io_base);
 
@@ -183,9 +321,32 @@ main(int argc, char **argv) {
     rmq_client_set_credentials(rmqu.client, user, password);
     rmq_client_set_vhost(rmqu.client, vhost);
 
-    if (rmq_client_connect(rmqu.client, host, port) == -1) {
-        rmqu_die("cannot connect to %s:%d: %s",
-                host, port, c_get_error());
+    if (use_tls) {
+        if (rmq_client_enable_tls(rmqu.client, &tls_cfg) == -1)
+            rmqu_die("cannot enable tls: %s", c_get_error());
+    }
+
+    if (socket_path) {
+        if (rmq_client_connect_unix(rmqu.client, socket_path) == -1) {
+            rmqu_die("cannot connect to %s: %s",
+                     socket_path, c_get_error());
+        }
+    } else if (strchr(host, ',')) {
+        endpoints = rmqu_parse_endpoints(host, port, &nb_endpoints);
+
+        if (rmq_client_connect_endpoints(rmqu.client, endpoints,
+                                         nb_endpoints) == -1) {
+            rmqu_die("cannot connect to %s: %s", host, c_get_error());
+        }
+
+        for (size_t i = 0; i < nb_endpoints; i++)
+            c_free((char *)endpoints[i].host);
+        c_free(endpoints);
+    } else {
+        if (rmq_client_connect(rmqu.client, host, port) == -1) {
+            rmqu_die("cannot connect to %s:%d: %s",
+                    host, port, c_get_error());
+        }
     }
 
     /* Main loop */
@@ -209,6 +370,15 @@ main(int argc, char **argv) {
     rmq_client_delete(rmqu.client);
     io_base_delete(rmqu.io_base);
 
+    if (rmqu.consume.output && rmqu.consume.output != stdout)
+        fclose(rmqu.consume.output);
+
+    if (rmqu.op_descriptions) {
+        for (size_t i = 0; i < c_ptr_vector_length(rmqu.op_descriptions); i++)
+            c_free(c_ptr_vector_entry(rmqu.op_descriptions, i));
+        c_ptr_vector_delete(rmqu.op_descriptions);
+    }
+
     c_command_line_delete(cmdline);
     return rmqu.error ? 1 : 0;
 }
@@ -254,6 +424,52 @@ rmqu_die(const char *fmt, ...) {
     exit(1);
 }
 
+static struct rmq_endpoint *
+rmqu_parse_endpoints(const char *string, uint16_t default_port,
+                     size_t *pnb_endpoints) {
+    struct rmq_endpoint *endpoints;
+    size_t nb_endpoints;
+    const char *ptr;
+
+    nb_endpoints = 1;
+    for (ptr = string; *ptr != '\0'; ptr++) {
+        if (*ptr == ',')
+            nb_endpoints++;
+    }
+
+    endpoints = c_calloc(nb_endpoints, sizeof(struct rmq_endpoint));
+
+    ptr = string;
+    for (size_t i = 0; i < nb_endpoints; i++) {
+        const char *end, *colon;
+        char *host;
+        size_t len;
+
+        end = strchr(ptr, ',');
+        len = end ? (size_t)(end - ptr) : strlen(ptr);
+
+        host = c_strndup(ptr, len);
+        endpoints[i].port = default_port;
+
+        colon = strrchr(host, ':');
+        if (colon) {
+            if (c_parse_u16(colon + 1, &endpoints[i].port, NULL) == -1)
+                rmqu_die("invalid port in '%s': %s", host, c_get_error());
+            host[colon - host] = '\0';
+        }
+
+        if (*host == '\0')
+            rmqu_die("empty host in '%s'", string);
+
+        endpoints[i].host = host;
+
+        ptr += len + 1;
+    }
+
+    *pnb_endpoints = nb_endpoints;
+    return endpoints;
+}
+
 static void
 rmqu_on_signal(int signo, void *arg) {
     rmqu_trace("signal %d received\n", signo);
@@ -298,6 +514,21 @@ rmqu_on_client_event(struct rmq_client *client, enum rmq_client_event event,
         rmqu_trace("flow deactivated");
         break;
 
+    case RMQ_CLIENT_EVENT_CONN_BLOCKED:
+        rmqu_trace("connection blocked: %s", (const char *)data);
+        break;
+
+    case RMQ_CLIENT_EVENT_CONN_UNBLOCKED:
+        rmqu_trace("connection unblocked");
+        break;
+
+    case RMQ_CLIENT_EVENT_CONSUMER_CANCELLED:
+        rmqu_error("consumer on queue %s cancelled by the server",
+                   (const char *)data);
+        rmqu.error = true;
+        rmq_client_disconnect(rmqu.client);
+        break;
+
     case RMQ_CLIENT_EVENT_ERROR:
         rmqu_error("%s", (const char *)data);
         rmqu.error = true;
@@ -314,20 +545,6 @@ rmqu_on_client_ready(void) {
     rmqu.cmd_exec(rmqu.argc, rmqu.argv);
 }
 
-static enum rmq_msg_action
-rmqu_on_msg(struct rmq_client *client,
-            const struct rmq_delivery *delivery,
-            const struct rmq_msg *msg, void *arg) {
-    const uint8_t *data;
-    size_t size;
-
-    data = rmq_msg_data(msg, &size);
-
-    rmqu_trace("message received (%zu bytes)", size);
-
-    return RMQ_MSG_ACTION_ACK;
-}
-
 static void
 rmqu_on_undeliverable_msg(struct rmq_client *client,
                           const struct rmq_delivery *delivery,
@@ -574,3 +791,835 @@ rmqu_cmd_unbind_queue(int argc, char **argv) {
 
     c_command_line_delete(cmdline);
 }
+
+static void
+rmqu_on_apply_op(struct rmq_client *client,
+                 const struct rmq_op_result *result, void *arg) {
+    const char *description;
+
+    description = arg;
+
+    /* A failed operation closes the channel, and the client with it; the
+     * operations sent after it are aborted without having been processed
+     * by the server. */
+    if (result->error && rmqu.nb_failed_ops > 0) {
+        rmqu_error("%s: not applied", description);
+        rmqu.nb_skipped_ops++;
+    } else if (result->error) {
+        rmqu_error("%s: %s", description, result->error);
+        rmqu.nb_failed_ops++;
+    } else {
+        rmqu_trace("%s: ok", description);
+    }
+
+    rmqu.nb_pending_ops--;
+    if (rmqu.nb_pending_ops == 0) {
+        if (rmqu.nb_failed_ops > 0) {
+            if (rmqu.nb_skipped_ops > 0) {
+                rmqu_error("%u operations not applied",
+                           rmqu.nb_skipped_ops);
+            }
+
+            rmqu.error = true;
+        }
+
+        rmq_client_disconnect(rmqu.client);
+    }
+}
+
+static int
+rmqu_apply_line(char *line) {
+    const char *words[8];
+    char *description, *saveptr, *word;
+    size_t nb_words;
+
+    nb_words = 0;
+    for (word = strtok_r(line, " \t\r\n", &saveptr); word;
+         word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        if (nb_words == 0 && word[0] == '#')
+            return 0;
+
+        if (nb_words >= sizeof(words) / sizeof(words[0])) {
+            c_set_error("too many words");
+            return -1;
+        }
+
+        words[nb_words++] = word;
+    }
+
+    if (nb_words == 0)
+        return 0;
+
+    if (strcmp(words[0], "exchange") == 0) {
+        enum rmq_exchange_type type;
+        uint8_t options;
+
+        /* exchange <name> <type> [durable|auto-delete|internal|passive]... */
+        if (nb_words < 3) {
+            c_set_error("missing exchange name or type");
+            return -1;
+        }
+
+        if (rmq_exchange_type_parse(words[2], &type) == -1) {
+            c_set_error("unknown exchange type '%s'", words[2]);
+            return -1;
+        }
+
+        options = RMQ_EXCHANGE_DEFAULT;
+        for (size_t i = 3; i < nb_words; i++) {
+            if (strcmp(words[i], "durable") == 0) {
+                options |= RMQ_EXCHANGE_DURABLE;
+            } else if (strcmp(words[i], "auto-delete") == 0) {
+                options |= RMQ_EXCHANGE_AUTO_DELETE;
+            } else if (strcmp(words[i], "internal") == 0) {
+                options |= RMQ_EXCHANGE_INTERNAL;
+            } else if (strcmp(words[i], "passive") == 0) {
+                options |= RMQ_EXCHANGE_PASSIVE;
+            } else {
+                c_set_error("unknown exchange option '%s'", words[i]);
+                return -1;
+            }
+        }
+
+        c_asprintf(&description, "exchange %s", words[1]);
+        c_ptr_vector_append(rmqu.op_descriptions, description);
+
+        rmq_client_declare_exchange_sync(rmqu.client, words[1], type,
+                                         options, NULL,
+                                         rmqu_on_apply_op, description);
+    } else if (strcmp(words[0], "queue") == 0) {
+        uint8_t options;
+
+        /* queue <name> [durable|exclusive|auto-delete]... */
+        if (nb_words < 2) {
+            c_set_error("missing queue name");
+            return -1;
+        }
+
+        options = RMQ_QUEUE_DEFAULT;
+        for (size_t i = 2; i < nb_words; i++) {
+            if (strcmp(words[i], "durable") == 0) {
+                options |= RMQ_QUEUE_DURABLE;
+            } else if (strcmp(words[i], "exclusive") == 0) {
+                options |= RMQ_QUEUE_EXCLUSIVE;
+            } else if (strcmp(words[i], "auto-delete") == 0) {
+                options |= RMQ_QUEUE_AUTO_DELETE;
+            } else {
+                c_set_error("unknown queue option '%s'", words[i]);
+                return -1;
+            }
+        }
+
+        c_asprintf(&description, "queue %s", words[1]);
+        c_ptr_vector_append(rmqu.op_descriptions, description);
+
+        rmq_client_declare_queue_sync(rmqu.client, words[1], options, NULL,
+                                      rmqu_on_apply_op, description);
+    } else if (strcmp(words[0], "bind") == 0) {
+        const char *routing_key;
+
+        /* bind <queue> <exchange> [routing-key] */
+        if (nb_words < 3 || nb_words > 4) {
+            c_set_error("invalid binding");
+            return -1;
+        }
+
+        routing_key = (nb_words == 4) ? words[3] : "";
+
+        c_asprintf(&description, "binding %s -> %s (%s)",
+                   words[2], words[1], routing_key);
+        c_ptr_vector_append(rmqu.op_descriptions, description);
+
+        rmq_client_bind_queue_sync(rmqu.client, words[1], words[2],
+                                   routing_key, NULL,
+                                   rmqu_on_apply_op, description);
+    } else {
+        c_set_error("unknown entity '%s'", words[0]);
+        return -1;
+    }
+
+    rmqu.nb_pending_ops++;
+    return 0;
+}
+
+static void
+rmqu_cmd_apply(int argc, char **argv) {
+    struct c_command_line *cmdline;
+    const char *path;
+    char *line;
+    size_t line_sz;
+    unsigned int line_number;
+    FILE *file;
+
+    /* Command line */
+    cmdline = c_command_line_new();
+
+    c_command_line_set_trailing_text(cmdline, "FILE FORMAT\n\n"
+                                     "exchange <name> <type> [durable] "
+                                     "[auto-delete] [internal] [passive]\n"
+                                     "queue <name> [durable] [exclusive] "
+                                     "[auto-delete]\n"
+                                     "bind <queue> <exchange> "
+                                     "[routing-key]\n\n"
+                                     "Empty lines and lines starting with "
+                                     "'#' are ignored. Entities are applied "
+                                     "in order;\nthe ones following an "
+                                     "entity which cannot be applied are "
+                                     "not applied.\n");
+
+    c_command_line_add_argument(cmdline, "the topology file, or - for "
+                                "standard input", "path");
+
+    if (c_command_line_parse(cmdline, argc, argv) == -1)
+        rmqu_die("%s", c_get_error());
+
+    path = c_command_line_argument_value(cmdline, 0);
+
+    /* Main */
+    if (strcmp(path, "-") == 0) {
+        file = stdin;
+    } else {
+        file = fopen(path, "r");
+        if (!file)
+            rmqu_die("cannot open %s: %s", path, strerror(errno));
+    }
+
+    rmqu.op_descriptions = c_ptr_vector_new();
+
+    /* All operations are sent without waiting for replies; the server
+     * processes them in order and the connection is closed once the last
+     * reply has been received. */
+    line = NULL;
+    line_sz = 0;
+    line_number = 0;
+
+    while (getline(&line, &line_sz, file) != -1) {
+        line_number++;
+
+        if (rmqu_apply_line(line) == -1)
+            rmqu_die("%s:%u: %s", path, line_number, c_get_error());
+    }
+
+    if (ferror(file))
+        rmqu_die("cannot read %s: %s", path, strerror(errno));
+
+    free(line);
+    if (file != stdin)
+        fclose(file);
+
+    rmqu_trace("%u operations sent", rmqu.nb_pending_ops);
+
+    if (rmqu.nb_pending_ops == 0)
+        rmq_client_disconnect(rmqu.client);
+
+    c_command_line_delete(cmdline);
+}
+
+static int
+rmqu_input_open(struct rmqu_input *input, const char *path, bool use_mmap,
+                bool length_delimited) {
+    memset(input, 0, sizeof(struct rmqu_input));
+
+    input->path = path;
+    input->fd = -1;
+    input->length_delimited = length_delimited;
+
+    /* Streamed input is read without blocking so that the event loop keeps
+     * running while waiting for data, e.g. on a pipe or a terminal. */
+    if (strcmp(path, "-") == 0) {
+        if (use_mmap) {
+            c_set_error("cannot map standard input");
+            return -1;
+        }
+
+        input->fd_flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+        if (input->fd_flags == -1
+         || fcntl(STDIN_FILENO, F_SETFL, input->fd_flags | O_NONBLOCK) == -1) {
+            c_set_error("cannot configure standard input: %s",
+                        strerror(errno));
+            return -1;
+        }
+
+        input->fd = STDIN_FILENO;
+    } else if (use_mmap) {
+        struct stat st;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            c_set_error("cannot open %s: %s", path, strerror(errno));
+            return -1;
+        }
+
+        if (fstat(fd, &st) == -1) {
+            c_set_error("cannot stat %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        input->map_sz = (size_t)st.st_size;
+
+        if (input->map_sz > 0) {
+            input->map = mmap(NULL, input->map_sz, PROT_READ, MAP_PRIVATE,
+                              fd, 0);
+            if (input->map == MAP_FAILED) {
+                c_set_error("cannot map %s: %s", path, strerror(errno));
+                close(fd);
+                return -1;
+            }
+
+            posix_madvise(input->map, input->map_sz,
+                          POSIX_MADV_SEQUENTIAL);
+        }
+
+        close(fd);
+
+        /* The whole content is available */
+        input->eof = true;
+        return 0;
+    } else {
+        input->fd = open(path, O_RDONLY | O_NONBLOCK);
+        if (input->fd == -1) {
+            c_set_error("cannot open %s: %s", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    input->buf = c_buffer_new();
+    return 0;
+}
+
+static void
+rmqu_input_close(struct rmqu_input *input) {
+    if (input->map)
+        munmap(input->map, input->map_sz);
+
+    if (input->fd == STDIN_FILENO) {
+        fcntl(STDIN_FILENO, F_SETFL, input->fd_flags);
+    } else if (input->fd >= 0) {
+        close(input->fd);
+    }
+
+    c_buffer_delete(input->buf);
+
+    memset(input, 0, sizeof(struct rmqu_input));
+}
+
+static int
+rmqu_input_parse(const struct rmqu_input *input,
+                 const uint8_t *data, size_t size, bool eof,
+                 const void **pmsg, size_t *pmsg_sz, size_t *plen) {
+    if (size == 0)
+        return 0;
+
+    if (input->length_delimited) {
+        uint32_t msg_sz;
+
+        /* 32 bit big endian length followed by the message */
+        if (size < 4 || size - 4 < ((uint32_t)data[0] << 24
+                                    | (uint32_t)data[1] << 16
+                                    | (uint32_t)data[2] << 8
+                                    | (uint32_t)data[3])) {
+            if (eof && size > 0) {
+                c_set_error("truncated message");
+                return -1;
+            }
+
+            return 0;
+        }
+
+        msg_sz = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16
+               | (uint32_t)data[2] << 8 | (uint32_t)data[3];
+
+        *pmsg = data + 4;
+        *pmsg_sz = msg_sz;
+        *plen = 4 + msg_sz;
+    } else {
+        const uint8_t *eol;
+
+        eol = memchr(data, '\n', size);
+        if (!eol) {
+            /* The last line may not end with a newline character */
+            if (eof && size > 0) {
+                *pmsg = data;
+                *pmsg_sz = size;
+                *plen = size;
+                return 1;
+            }
+
+            return 0;
+        }
+
+        *pmsg = data;
+        *pmsg_sz = (size_t)(eol - data);
+        *plen = *pmsg_sz + 1;
+    }
+
+    return 1;
+}
+
+/* Return 1 if a message was read, 0 if no message is available and -1 on
+ * error. The end of the input has been reached when no message is available
+ * and input->eof is set; otherwise the input is not readable yet. */
+static int
+rmqu_input_next(struct rmqu_input *input, const void **pmsg,
+                size_t *pmsg_sz) {
+    size_t len;
+    int ret;
+
+    if (input->fd == -1) {
+        if (input->map_offset >= input->map_sz)
+            return 0;
+
+        ret = rmqu_input_parse(input, input->map + input->map_offset,
+                               input->map_sz - input->map_offset, true,
+                               pmsg, pmsg_sz, &len);
+        if (ret == 1)
+            input->map_offset += len;
+
+        return ret;
+    }
+
+    /* The previous message is only skipped now since the caller was using
+     * the content of the buffer. */
+    c_buffer_skip(input->buf, input->buf_skip);
+    input->buf_skip = 0;
+
+    for (;;) {
+        uint8_t *ptr;
+        ssize_t nb_read;
+
+        ret = rmqu_input_parse(input, c_buffer_data(input->buf),
+                               c_buffer_length(input->buf), input->eof,
+                               pmsg, pmsg_sz, &len);
+        if (ret != 0) {
+            if (ret == 1)
+                input->buf_skip = len;
+            return ret;
+        }
+
+        if (input->eof)
+            return 0;
+
+        ptr = c_buffer_reserve(input->buf, RMQU_READ_SIZE);
+
+        nb_read = read(input->fd, ptr, RMQU_READ_SIZE);
+        if (nb_read == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            c_set_error("cannot read %s: %s", input->path, strerror(errno));
+            return -1;
+        }
+
+        if (nb_read == 0)
+            input->eof = true;
+
+        c_buffer_increase_length(input->buf, (size_t)nb_read);
+    }
+}
+
+static void
+rmqu_publish_stop(void) {
+    struct rmqu_publish *publish;
+
+    publish = &rmqu.publish;
+
+    if (publish->timer >= 0) {
+        io_base_remove_timer(rmqu.io_base, publish->timer);
+        publish->timer = -1;
+    }
+
+    if (publish->watching_input) {
+        io_base_unwatch_fd(rmqu.io_base, publish->input.fd);
+        publish->watching_input = false;
+    }
+
+    rmqu_input_close(&publish->input);
+
+    rmq_publish_template_delete(publish->template);
+    publish->template = NULL;
+
+    rmqu_trace("%"PRIu64" messages published", publish->nb_msgs);
+
+    rmq_client_disconnect(rmqu.client);
+}
+
+static void
+rmqu_publish_msgs(void) {
+    struct rmqu_publish *publish;
+
+    publish = &rmqu.publish;
+
+    /* Messages are encoded with a template directly from the input, and
+     * written until enough data is waiting to be sent. */
+    while (rmq_client_output_size(rmqu.client) < RMQU_MAX_OUTPUT_SIZE) {
+        const void *msg;
+        size_t msg_sz;
+        int ret;
+
+        ret = rmqu_input_next(&publish->input, &msg, &msg_sz);
+        if (ret == -1) {
+            rmqu_error("%s", c_get_error());
+            rmqu.error = true;
+        }
+
+        if (ret == 0 && !publish->input.eof) {
+            rmqu_publish_wait_input();
+            return;
+        }
+
+        if (ret <= 0) {
+            rmqu_publish_stop();
+            return;
+        }
+
+        rmq_client_publish_template(rmqu.client, publish->template,
+                                    msg, msg_sz);
+        publish->nb_msgs++;
+    }
+}
+
+static void
+rmqu_on_publish_input_event(int fd, uint32_t events, void *arg) {
+    io_base_unwatch_fd(rmqu.io_base, fd);
+    rmqu.publish.watching_input = false;
+
+    /* If the client is not ready, the publish timer will resume
+     * publication later. */
+    if (!rmq_client_is_ready(rmqu.client))
+        return;
+
+    rmqu_publish_msgs();
+}
+
+static void
+rmqu_publish_wait_input(void) {
+    struct rmqu_publish *publish;
+
+    publish = &rmqu.publish;
+
+    if (publish->watching_input)
+        return;
+
+    if (io_base_watch_fd(rmqu.io_base, publish->input.fd, IO_EVENT_FD_READ,
+                         rmqu_on_publish_input_event, NULL) == -1) {
+        rmqu_error("cannot watch %s: %s", publish->input.path,
+                   c_get_error());
+        rmqu.error = true;
+        rmqu_publish_stop();
+        return;
+    }
+
+    publish->watching_input = true;
+}
+
+static void
+rmqu_on_publish_timer(int timer, uint64_t delay, void *arg) {
+    if (!rmq_client_is_ready(rmqu.client))
+        return;
+
+    rmqu_publish_msgs();
+}
+
+static void
+rmqu_cmd_publish(int argc, char **argv) {
+    struct c_command_line *cmdline;
+    const char *exchange, *routing_key, *path, *content_type;
+    bool use_mmap, length_delimited, persistent;
+    struct rmq_msg *msg;
+    int timer;
+
+    /* Command line */
+    cmdline = c_command_line_new();
+
+    c_command_line_add_option(cmdline, "k", "routing-key",
+                              "the routing key", "key", "");
+    c_command_line_add_option(cmdline, "f", "file",
+                              "the file to read messages from, or - for "
+                              "standard input", "path", "-");
+    c_command_line_add_option(cmdline, "t", "content-type",
+                              "the content type of messages", "type", NULL);
+    c_command_line_add_flag(cmdline, "l", "length-delimited",
+                            "read messages prefixed by their size as a 32 "
+                            "bit big endian integer instead of lines");
+    c_command_line_add_flag(cmdline, "m", "mmap",
+                            "map the file in memory instead of reading it");
+    c_command_line_add_flag(cmdline, "P", "persistent",
+                            "publish persistent messages");
+
+    c_command_line_add_argument(cmdline, "the name of the exchange",
+                                "exchange");
+
+    if (c_command_line_parse(cmdline, argc, argv) == -1)
+        rmqu_die("%s", c_get_error());
+
+    routing_key = c_command_line_option_value(cmdline, "routing-key");
+    path = c_command_line_option_value(cmdline, "file");
+    content_type = c_command_line_option_value(cmdline, "content-type");
+    length_delimited = c_command_line_is_option_set(cmdline,
+                                                    "length-delimited");
+    use_mmap = c_command_line_is_option_set(cmdline, "mmap");
+    persistent = c_command_line_is_option_set(cmdline, "persistent");
+
+    exchange = c_command_line_argument_value(cmdline, 0);
+
+    /* Main */
+    if (rmqu_input_open(&rmqu.publish.input, path, use_mmap,
+                        length_delimited) == -1) {
+        rmqu_die("%s", c_get_error());
+    }
+
+    /* All messages share the same properties */
+    msg = rmq_msg_new();
+    if (content_type)
+        rmq_msg_set_content_type(msg, content_type);
+    if (persistent)
+        rmq_msg_set_delivery_mode(msg, RMQ_MSG_DELIVERY_PERSISTENT);
+
+    rmqu.publish.template = rmq_publish_template_new(msg, exchange,
+                                                     routing_key,
+                                                     RMQ_PUBLISH_DEFAULT);
+    rmq_msg_delete(msg);
+
+    timer = io_base_add_timer(rmqu.io_base, RMQU_PUBLISH_TIMER_DELAY,
+                              IO_TIMER_RECURRENT, rmqu_on_publish_timer, NULL);
+    if (timer == -1)
+        rmqu_die("cannot create timer: %s", c_get_error());
+    rmqu.publish.timer = timer;
+
+    rmqu_publish_msgs();
+
+    c_command_line_delete(cmdline);
+}
+
+static void
+rmqu_consume_stop(void) {
+    struct rmqu_consume *consume;
+
+    consume = &rmqu.consume;
+
+    if (consume->done)
+        return;
+    consume->done = true;
+
+    if (consume->timer >= 0) {
+        io_base_remove_timer(rmqu.io_base, consume->timer);
+        consume->timer = -1;
+    }
+
+    if (consume->nb_unacked > 0) {
+        rmq_client_ack_multiple(rmqu.client, consume->last_tag);
+        consume->nb_unacked = 0;
+    }
+
+    if (fflush(consume->output) == EOF) {
+        rmqu_error("cannot write output: %s", strerror(errno));
+        rmqu.error = true;
+    }
+
+    rmqu_trace("%"PRIu64" messages consumed", consume->nb_msgs);
+
+    rmq_client_disconnect(rmqu.client);
+}
+
+static void
+rmqu_on_consume_timer(int timer, uint64_t delay, void *arg) {
+    rmqu_consume_stop();
+}
+
+static enum rmq_msg_action
+rmqu_on_consumed_msg(struct rmq_client *client,
+                     const struct rmq_delivery *delivery,
+                     const struct rmq_msg *msg, void *arg) {
+    struct rmqu_consume *consume;
+    const uint8_t *data;
+    uint64_t tag;
+    size_t size;
+
+    consume = &rmqu.consume;
+
+    /* Messages prefetched after the end of the consumption are not
+     * acknowledged: Connection.Close has already been sent, and the server
+     * requeues them when the connection is closed. */
+    if (consume->done)
+        return RMQ_MSG_ACTION_NONE;
+
+    data = rmq_msg_data(msg, &size);
+
+    if (consume->length_delimited) {
+        uint8_t header[4];
+
+        header[0] = (uint8_t)(size >> 24);
+        header[1] = (uint8_t)(size >> 16);
+        header[2] = (uint8_t)(size >> 8);
+        header[3] = (uint8_t)size;
+
+        fwrite(header, 1, 4, consume->output);
+        fwrite(data, 1, size, consume->output);
+    } else {
+        fwrite(data, 1, size, consume->output);
+        putc('\n', consume->output);
+    }
+
+    if (ferror(consume->output))
+        rmqu_die("cannot write output: %s", strerror(errno));
+
+    consume->nb_msgs++;
+
+    if (consume->ack_mode == RMQU_ACK_MODE_NONE) {
+        if (consume->nb_msgs == consume->max_nb_msgs)
+            rmqu_consume_stop();
+        return RMQ_MSG_ACTION_NONE;
+    }
+
+    tag = rmq_delivery_tag(delivery);
+
+    if (consume->nb_msgs == consume->max_nb_msgs) {
+        /* The message is acknowledged before the connection is closed */
+        if (consume->ack_mode == RMQU_ACK_MODE_REQUEUE) {
+            rmq_client_requeue(client, tag);
+        } else {
+            rmq_client_ack_multiple(client, tag);
+            consume->nb_unacked = 0;
+        }
+
+        rmqu_consume_stop();
+        return RMQ_MSG_ACTION_NONE;
+    }
+
+    switch (consume->ack_mode) {
+    case RMQU_ACK_MODE_NONE:
+        break;
+
+    case RMQU_ACK_MODE_EACH:
+        return RMQ_MSG_ACTION_ACK;
+
+    case RMQU_ACK_MODE_BATCH:
+        consume->last_tag = tag;
+        consume->nb_unacked++;
+
+        if (consume->nb_unacked >= consume->batch_size) {
+            rmq_client_ack_multiple(client, tag);
+            consume->nb_unacked = 0;
+        }
+        break;
+
+    case RMQU_ACK_MODE_REQUEUE:
+        return RMQ_MSG_ACTION_REQUEUE;
+    }
+
+    return RMQ_MSG_ACTION_NONE;
+}
+
+static void
+rmqu_cmd_consume(int argc, char **argv) {
+    struct rmqu_consume *consume;
+    struct c_command_line *cmdline;
+    const char *queue, *path, *ack_mode_string;
+    const char *count_string, *timeout_string, *prefetch_string;
+    uint64_t timeout;
+    uint16_t prefetch;
+    uint8_t options;
+
+    consume = &rmqu.consume;
+
+    /* Command line */
+    cmdline = c_command_line_new();
+
+    c_command_line_add_option(cmdline, "o", "output",
+                              "the file to write messages to, or - for "
+                              "standard output", "path", "-");
+    c_command_line_add_option(cmdline, "n", "count",
+                              "stop after this number of messages",
+                              "count", "0");
+    c_command_line_add_option(cmdline, "t", "timeout",
+                              "stop after this number of seconds",
+                              "seconds", "0");
+    c_command_line_add_option(cmdline, "a", "ack",
+                              "the acknowledgement mode (none, each, batch "
+                              "or requeue)", "mode", "batch");
+    c_command_line_add_option(cmdline, "p", "prefetch",
+                              "the maximum number of unacknowledged "
+                              "messages", "count", "1000");
+    c_command_line_add_flag(cmdline, "l", "length-delimited",
+                            "prefix messages by their size as a 32 bit big "
+                            "endian integer instead of writing lines");
+
+    c_command_line_add_argument(cmdline, "the name of the queue", "queue");
+
+    if (c_command_line_parse(cmdline, argc, argv) == -1)
+        rmqu_die("%s", c_get_error());
+
+    path = c_command_line_option_value(cmdline, "output");
+    count_string = c_command_line_option_value(cmdline, "count");
+    timeout_string = c_command_line_option_value(cmdline, "timeout");
+    ack_mode_string = c_command_line_option_value(cmdline, "ack");
+    prefetch_string = c_command_line_option_value(cmdline, "prefetch");
+    consume->length_delimited =
+        c_command_line_is_option_set(cmdline, "length-delimited");
+
+    queue = c_command_line_argument_value(cmdline, 0);
+
+    if (c_parse_u64(count_string, &consume->max_nb_msgs, NULL) == -1)
+        rmqu_die("invalid count: %s", c_get_error());
+    if (c_parse_u64(timeout_string, &timeout, NULL) == -1)
+        rmqu_die("invalid timeout: %s", c_get_error());
+    if (c_parse_u16(prefetch_string, &prefetch, NULL) == -1)
+        rmqu_die("invalid prefetch count: %s", c_get_error());
+
+    if (strcmp(ack_mode_string, "none") == 0) {
+        consume->ack_mode = RMQU_ACK_MODE_NONE;
+    } else if (strcmp(ack_mode_string, "each") == 0) {
+        consume->ack_mode = RMQU_ACK_MODE_EACH;
+    } else if (strcmp(ack_mode_string, "batch") == 0) {
+        consume->ack_mode = RMQU_ACK_MODE_BATCH;
+    } else if (strcmp(ack_mode_string, "requeue") == 0) {
+        consume->ack_mode = RMQU_ACK_MODE_REQUEUE;
+    } else {
+        rmqu_die("unknown acknowledgement mode '%s'", ack_mode_string);
+    }
+
+    /* Acknowledging half of the prefetch window at once keeps the server
+     * sending messages while limiting the number of acknowledgements. */
+    consume->batch_size = prefetch / 2;
+    if (consume->batch_size == 0)
+        consume->batch_size = 1;
+
+    /* Main */
+    if (strcmp(path, "-") == 0) {
+        consume->output = stdout;
+    } else {
+        consume->output = fopen(path, "w");
+        if (!consume->output)
+            rmqu_die("cannot open %s: %s", path, strerror(errno));
+    }
+
+    setvbuf(consume->output, NULL, _IOFBF, RMQU_READ_SIZE);
+
+    consume->timer = -1;
+    if (timeout > 0) {
+        int timer;
+
+        timer = io_base_add_timer(rmqu.io_base, timeout * 1000,
+                                  IO_TIMER_RECURRENT,
+                                  rmqu_on_consume_timer, NULL);
+        if (timer == -1)
+            rmqu_die("cannot create timer: %s", c_get_error());
+        consume->timer = timer;
+    }
+
+    options = RMQ_SUBSCRIBE_DEFAULT;
+    if (consume->ack_mode == RMQU_ACK_MODE_NONE) {
+        options |= RMQ_SUBSCRIBE_NO_ACK;
+    } else {
+        rmq_client_set_prefetch_count(rmqu.client, prefetch, NULL, NULL);
+    }
+
+    rmq_client_subscribe(rmqu.client, queue, options,
+                         rmqu_on_consumed_msg, NULL);
+
+    c_command_line_delete(cmdline);
+}